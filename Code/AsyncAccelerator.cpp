@@ -0,0 +1,201 @@
+#include "AsyncAccelerator.h"
+#include "Threading.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+
+class AccelerationQueue {
+protected:
+	struct Job {
+		Mesh* mesh;
+		int maxLeafTriangles;
+		bool built;
+		std::vector<LinearBVHNode> nodes;
+		std::vector<int> order;
+	};
+
+	std::thread builder;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	std::vector<Job*> jobs; // Queue order, built jobs stay until they are installed
+	Job* building; // Built without the lock held
+	bool quit;
+protected:
+	// Call with the lock held
+	Job* NextJob() const {
+		for (int i = 0, size = (int)jobs.size(); i < size; ++i) {
+			if (!jobs[i]->built && jobs[i] != building) {
+				return jobs[i];
+			}
+		}
+		return 0;
+	}
+
+	int FindJob(const Mesh* mesh) const {
+		for (int i = 0, size = (int)jobs.size(); i < size; ++i) {
+			if (jobs[i]->mesh == mesh) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	void BuilderLoop() {
+		// The workers stay with the main thread, a build never stalls its ParallelFors
+		SetSerialThread(true);
+		for (;;) {
+			Job* job = 0;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return quit || NextJob() != 0; });
+				if (quit) {
+					return;
+				}
+				job = NextJob();
+				building = job;
+			}
+
+			BuildLinearBVH(*job->mesh, job->maxLeafTriangles, &job->nodes, &job->order);
+
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				job->built = true;
+				building = 0;
+			}
+			done.notify_all();
+		}
+	}
+
+	static void Install(Job* job) {
+		AccelerateMesh(*job->mesh, job->nodes, job->order);
+		delete job;
+	}
+public:
+	AccelerationQueue() : building(0), quit(false) {
+		builder = std::thread(&AccelerationQueue::BuilderLoop, this);
+	}
+
+	~AccelerationQueue() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		builder.join();
+		for (int i = 0, size = (int)jobs.size(); i < size; ++i) {
+			delete jobs[i];
+		}
+	}
+
+	void Add(Mesh* mesh, int maxLeafTriangles) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (FindJob(mesh) >= 0) {
+				return;
+			}
+			Job* job = new Job();
+			job->mesh = mesh;
+			job->maxLeafTriangles = maxLeafTriangles;
+			job->built = false;
+			jobs.push_back(job);
+		}
+		wake.notify_one();
+	}
+
+	int InstallBuilt() {
+		std::vector<Job*> built;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			int kept = 0;
+			for (int i = 0, size = (int)jobs.size(); i < size; ++i) {
+				if (jobs[i]->built) {
+					built.push_back(jobs[i]);
+				}
+				else {
+					jobs[kept++] = jobs[i];
+				}
+			}
+			jobs.resize(kept);
+		}
+
+		for (int i = 0, size = (int)built.size(); i < size; ++i) {
+			Install(built[i]);
+		}
+		return (int)built.size();
+	}
+
+	bool Contains(const Mesh* mesh) {
+		std::lock_guard<std::mutex> lock(mutex);
+		return FindJob(mesh) >= 0;
+	}
+
+	// Takes the job of the mesh out of the queue, waits if it is being built.
+	// The wait releases the lock, so InstallBuilt may install (and delete) the
+	// job meanwhile, the queue is searched again after every wait.
+	Job* Remove(const Mesh* mesh) {
+		std::unique_lock<std::mutex> lock(mutex);
+		for (;;) {
+			int index = FindJob(mesh);
+			if (index < 0) {
+				return 0; // Never queued, or installed already
+			}
+			Job* job = jobs[index];
+			if (building != job) {
+				jobs.erase(jobs.begin() + index);
+				return job;
+			}
+			done.wait(lock);
+		}
+	}
+
+	// A job that wasn't started yet is built on the calling thread
+	void Finish(Mesh* mesh) {
+		Job* job = Remove(mesh);
+		if (job == 0) {
+			return;
+		}
+		if (!job->built) {
+			BuildLinearBVH(*job->mesh, job->maxLeafTriangles, &job->nodes, &job->order);
+		}
+		Install(job);
+	}
+
+	void Cancel(Mesh* mesh) {
+		delete Remove(mesh);
+	}
+};
+
+static AccelerationQueue& GetAccelerationQueue() {
+	static AccelerationQueue queue;
+	return queue;
+}
+
+void AccelerateMeshAsync(Mesh* mesh) {
+	AccelerateMeshAsync(mesh, BVH_DEFAULT_LEAF_SIZE);
+}
+
+void AccelerateMeshAsync(Mesh* mesh, int maxLeafTriangles) {
+	if (mesh == 0 || mesh->accelerator != 0 || mesh->compressed != 0 || mesh->numTriangles == 0) {
+		return;
+	}
+	GetAccelerationQueue().Add(mesh, maxLeafTriangles);
+}
+
+int UpdateAcceleration() {
+	return GetAccelerationQueue().InstallBuilt();
+}
+
+bool IsAccelerating(const Mesh* mesh) {
+	return GetAccelerationQueue().Contains(mesh);
+}
+
+void FinishAcceleration(Mesh* mesh) {
+	GetAccelerationQueue().Finish(mesh);
+}
+
+void CancelAcceleration(Mesh* mesh) {
+	GetAccelerationQueue().Cancel(mesh);
+}
@@ -0,0 +1,30 @@
+#ifndef _H_ASYNC_ACCELERATOR_
+#define _H_ASYNC_ACCELERATOR_
+
+#include "Geometry3D.h"
+
+// Builds mesh BVHs on a background thread, so loading a mesh doesn't stall
+// the thread that runs the queries. Meshes are built one at a time in the
+// order they were queued, each on that thread alone, the worker threads
+// (Threading.h) stay free for everything else. A mesh has no accelerator
+// until its tree is installed by UpdateAcceleration, every query against it
+// brute forces until then and returns the same results.
+//
+// The build only reads the triangles, don't change or free a queued mesh
+// (CancelAcceleration first). Installing reorders the triangles like
+// AccelerateMesh does, which is why it waits for UpdateAcceleration.
+
+void AccelerateMeshAsync(Mesh* mesh);
+void AccelerateMeshAsync(Mesh* mesh, int maxLeafTriangles);
+
+// Installs every tree that finished building, returns how many. Call it
+// where no queries are running, once per frame for example.
+int UpdateAcceleration();
+// True from AccelerateMeshAsync until the tree is installed or cancelled
+bool IsAccelerating(const Mesh* mesh);
+// Installs the tree of the mesh now, waits for the build or builds it here
+void FinishAcceleration(Mesh* mesh);
+// Drops the mesh from the queue, waits if it is being built right now
+void CancelAcceleration(Mesh* mesh);
+
+#endif
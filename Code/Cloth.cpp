@@ -1,6 +1,7 @@
 #include "Cloth.h"
 #include "glad/glad.h"
 #include "FixedFunctionPrimitives.h"
+#include <cfloat>
 
 void Cloth::Initialize(int gridSize, float distance, const vec3& position) {
 	float k = -1.0f;
@@ -112,6 +113,28 @@ void Cloth::Initialize(int gridSize, float distance, const vec3& position) {
 			bend.push_back(spring);
 		}
 	}
+
+	// Static index buffer, two triangles per grid cell
+	renderVertices.resize(verts.size() * 6);
+	renderIndices.clear();
+	int size = (int)clothSize;
+	renderIndices.reserve((size - 1) * (size - 1) * 6);
+	for (int x = 0; x < size - 1; ++x) {
+		for (int z = 0; z < size - 1; ++z) {
+			unsigned int tl = z * size + x;
+			unsigned int bl = (z + 1) * size + x;
+			unsigned int tr = z * size + (x + 1);
+			unsigned int br = (z + 1) * size + (x + 1);
+
+			renderIndices.push_back(tl);
+			renderIndices.push_back(br);
+			renderIndices.push_back(bl);
+
+			renderIndices.push_back(tl);
+			renderIndices.push_back(tr);
+			renderIndices.push_back(br);
+		}
+	}
 }
 
 void Cloth::SetStructuralSprings(float k, float b) {
@@ -138,33 +161,435 @@ void Cloth::SetParticleMass(float mass) {
 	}
 }
 
+void Cloth::SetSelfCollision(bool enabled, float radius) {
+	selfCollision = enabled;
+	selfCollisionRadius = radius;
+}
+
+void Cloth::SetParticleRadius(float radius) {
+	particleRadius = radius;
+}
+
 void Cloth::ApplyForces() {
 	for (int i = 0, size = verts.size(); i < size; ++i) {
 		verts[i].ApplyForces();
 	}
 }
 
-void Cloth::Update(float dt) {
+template<int INTEGRATOR>
+void Cloth::UpdateKernel(float dt) {
+	lastDeltaTime = dt;
 	for (int i = 0, size = verts.size(); i < size; ++i) {
-		verts[i].Update(dt);
+		verts[i].UpdateKernel<INTEGRATOR>(dt);
 	}
 }
 
-void Cloth::SolveConstraints(const std::vector<OBB>& constraints) {
+template<int INTEGRATOR>
+void Cloth::SolveConstraintsKernel(const std::vector<OBB>& constraints) {
 	for (int i = 0, size = verts.size(); i < size; ++i) {
-		verts[i].SolveConstraints(constraints);
+		verts[i].SolveConstraintsKernel<INTEGRATOR>(constraints);
+	}
+
+	if (selfCollision) {
+		SolveSelfCollisionKernel<INTEGRATOR>();
 	}
 }
 
-void Cloth::ApplySpringForces(float dt) {
+template<int INTEGRATOR>
+void Cloth::SolveSelfCollisionKernel() {
+	int numVerts = verts.size();
+	int gridSize = (int)clothSize;
+	if (numVerts == 0 || selfCollisionRadius <= 0.0f) {
+		return;
+	}
+
+	// Work on a packed copy of the positions, Particle is too big to stream through
+	selfCollisionPositions.resize(numVerts);
+	selfCollisionCorrections.resize(numVerts);
+	for (int i = 0; i < numVerts; ++i) {
+		selfCollisionPositions[i] = verts[i].position;
+		selfCollisionCorrections[i] = vec3();
+	}
+
+	float diameter = selfCollisionRadius * 2.0f;
+	float diameterSq = diameter * diameter;
+	selfCollisionHash.Build(&selfCollisionPositions[0], numVerts, diameter);
+
+	int cell[3];
+	for (int i = 0; i < numVerts; ++i) {
+		vec3 p = selfCollisionPositions[i];
+		int ix = i % gridSize;
+		int iz = i / gridSize;
+		selfCollisionHash.GetCell(p, cell);
+
+		for (int x = cell[0] - 1; x <= cell[0] + 1; ++x) {
+			for (int y = cell[1] - 1; y <= cell[1] + 1; ++y) {
+				for (int z = cell[2] - 1; z <= cell[2] + 1; ++z) {
+					unsigned int bucket = selfCollisionHash.Bucket(x, y, z);
+					for (int k = selfCollisionHash.BucketStart(bucket), end = selfCollisionHash.BucketEnd(bucket); k < end; ++k) {
+						int j = selfCollisionHash.Entry(k);
+						// Every pair is resolved once, entries of other cells in this bucket are skipped
+						if (j <= i || !selfCollisionHash.EntryInCell(k, x, y, z)) {
+							continue;
+						}
+
+						// Skip neighbours that are already held apart by springs
+						int dx = j % gridSize - ix;
+						int dz = j / gridSize - iz;
+						if (dx >= -2 && dx <= 2 && dz >= -2 && dz <= 2) {
+							continue;
+						}
+
+						vec3 delta = selfCollisionHash.EntryPoint(k) - p;
+						float distSq = MagnitudeSq(delta);
+						if (distSq >= diameterSq || distSq < 0.0000001f) {
+							continue;
+						}
+
+						float dist = sqrtf(distSq);
+						vec3 correction = delta * ((diameter - dist) / dist * 0.5f);
+						selfCollisionCorrections[i] = selfCollisionCorrections[i] - correction;
+						selfCollisionCorrections[j] = selfCollisionCorrections[j] + correction;
+					}
+				}
+			}
+		}
+	}
+
+	for (int i = 0; i < numVerts; ++i) {
+		vec3 correction = selfCollisionCorrections[i];
+		float lengthSq = MagnitudeSq(correction);
+		if (lengthSq == 0.0f) {
+			continue;
+		}
+
+		Particle& particle = verts[i];
+		particle.position = particle.position + correction;
+
+		// Verlet picks the push up as velocity, euler has to lose the approaching velocity
+		if (INTEGRATOR != INTEGRATOR_VERLET) {
+			vec3 normal = correction * (1.0f / sqrtf(lengthSq));
+			float approach = Dot(particle.velocity, normal);
+			if (approach < 0.0f) {
+				particle.velocity = particle.velocity - normal * approach;
+			}
+		}
+	}
+}
+
+template<int INTEGRATOR>
+void Cloth::ApplySpringForcesKernel(float dt) {
 	for (int i = 0, size = structural.size(); i < size; ++i) {
-		structural[i].ApplyForce(dt);
+		structural[i].ApplyForceKernel<INTEGRATOR>(dt);
 	}
 	for (int i = 0, size = shear.size(); i < size; ++i) {
-		shear[i].ApplyForce(dt);
+		shear[i].ApplyForceKernel<INTEGRATOR>(dt);
 	}
 	for (int i = 0, size = bend.size(); i < size; ++i) {
-		bend[i].ApplyForce(dt);
+		bend[i].ApplyForceKernel<INTEGRATOR>(dt);
+	}
+}
+
+void Cloth::UpdateCollisionBounds() {
+	int numVerts = verts.size();
+	int numBatches = (numVerts + CLOTH_COLLISION_BATCH - 1) / CLOTH_COLLISION_BATCH;
+	batchBounds.resize(numBatches);
+	if (numVerts == 0) {
+		return;
+	}
+
+	vec3 margin(particleRadius, particleRadius, particleRadius);
+	vec3 clothMin = verts[0].position;
+	vec3 clothMax = verts[0].position;
+	for (int b = 0; b < numBatches; ++b) {
+		int first = b * CLOTH_COLLISION_BATCH;
+		int last = first + CLOTH_COLLISION_BATCH;
+		last = (last > numVerts) ? numVerts : last;
+
+		vec3 min = verts[first].position;
+		vec3 max = verts[first].position;
+		for (int i = first + 1; i < last; ++i) {
+			const vec3& p = verts[i].position;
+			min = vec3(fminf(min.x, p.x), fminf(min.y, p.y), fminf(min.z, p.z));
+			max = vec3(fmaxf(max.x, p.x), fmaxf(max.y, p.y), fmaxf(max.z, p.z));
+		}
+		batchBounds[b] = FromMinMax(min - margin, max + margin);
+
+		clothMin = vec3(fminf(clothMin.x, min.x), fminf(clothMin.y, min.y), fminf(clothMin.z, min.z));
+		clothMax = vec3(fmaxf(clothMax.x, max.x), fmaxf(clothMax.y, max.y), fmaxf(clothMax.z, max.z));
+	}
+	clothBounds = FromMinMax(clothMin - margin, clothMax + margin);
+}
+
+template<int INTEGRATOR, int ROTATION>
+void Cloth::ResolveContact(Particle& particle, const vec3& surface, const vec3& normal, RigidbodyVolume* body) {
+	float dt = (lastDeltaTime > 0.0f) ? lastDeltaTime : 1.0f / 60.0f;
+
+	// Velocity in units per second, verlet stores it as the last displacement
+	vec3 velocity = particle.velocity;
+	if (INTEGRATOR == INTEGRATOR_VERLET) {
+		velocity = (particle.position - particle.oldPosition) * (1.0f / dt);
+	}
+
+	particle.position = surface + normal * particleRadius;
+
+	vec3 bodyVelocity = (body != 0) ? body->velocity : vec3();
+	float approach = Dot(velocity - bodyVelocity, normal);
+	if (approach < 0.0f) {
+		float invMassParticle = particle.InvMass();
+		float invMassBody = (body != 0) ? body->InvMass() : 0.0f;
+		float invMassSum = invMassParticle + invMassBody;
+
+		if (invMassSum > 0.0f) {
+			// Equal and opposite impulse, cancels the approaching velocity
+			float j = -approach / invMassSum;
+			velocity = velocity + normal * (j * invMassParticle);
+
+			if (body != 0 && invMassBody > 0.0f) {
+				body->AddLinearImpulse(normal * (-j * invMassBody));
+				if (ROTATION == ROTATION_MODEL_ANGULAR) {
+					body->AddRotationalImpulse(surface, normal * -j);
+				}
+			}
+		}
+	}
+
+	if (INTEGRATOR == INTEGRATOR_VERLET) {
+		particle.oldPosition = particle.position - velocity * dt;
+	}
+	else {
+		particle.velocity = velocity;
+	}
+}
+
+template<int INTEGRATOR, int ROTATION>
+void Cloth::SolveRigidbodiesKernel(const std::vector<Rigidbody*>& bodies) {
+	int numVerts = verts.size();
+	if (numVerts == 0) {
+		return;
+	}
+	UpdateCollisionBounds();
+
+	for (int k = 0, size = bodies.size(); k < size; ++k) {
+		if (!bodies[k]->HasVolume()) {
+			continue;
+		}
+		RigidbodyVolume* body = (RigidbodyVolume*)bodies[k];
+
+		AABB bodyBounds;
+		if (body->type == RIGIDBODY_TYPE_SPHERE) {
+			bodyBounds = AABB(body->sphere.position, vec3(body->sphere.radius, body->sphere.radius, body->sphere.radius));
+		}
+		else {
+			const OBB& box = body->box;
+			const float* o = box.orientation.asArray;
+			bodyBounds.position = box.position;
+			for (int i = 0; i < 3; ++i) {
+				bodyBounds.size.asArray[i] = fabsf(o[0 * 3 + i]) * box.size.x +
+					fabsf(o[1 * 3 + i]) * box.size.y + fabsf(o[2 * 3 + i]) * box.size.z;
+			}
+		}
+
+		if (!AABBAABB(clothBounds, bodyBounds)) {
+			continue;
+		}
+
+		for (int b = 0, numBatches = batchBounds.size(); b < numBatches; ++b) {
+			if (!AABBAABB(batchBounds[b], bodyBounds)) {
+				continue;
+			}
+
+			int last = (b + 1) * CLOTH_COLLISION_BATCH;
+			last = (last > numVerts) ? numVerts : last;
+			for (int i = b * CLOTH_COLLISION_BATCH; i < last; ++i) {
+				Particle& particle = verts[i];
+
+				if (body->type == RIGIDBODY_TYPE_SPHERE) {
+					vec3 delta = particle.position - body->sphere.position;
+					float reach = body->sphere.radius + particleRadius;
+					float distSq = MagnitudeSq(delta);
+					if (distSq >= reach * reach || distSq < 0.0000001f) {
+						continue;
+					}
+
+					vec3 normal = delta * (1.0f / sqrtf(distSq));
+					ResolveContact<INTEGRATOR, ROTATION>(particle, body->sphere.position + normal * body->sphere.radius, normal, body);
+				}
+				else {
+					// Push out through the face with the least penetration
+					const OBB& box = body->box;
+					vec3 dir = particle.position - box.position;
+					float minPenetration = FLT_MAX;
+					vec3 normal;
+					bool inside = true;
+
+					for (int axis = 0; axis < 3 && inside; ++axis) {
+						const float* o = &box.orientation.asArray[axis * 3];
+						vec3 axisDir(o[0], o[1], o[2]);
+						float distance = Dot(dir, axisDir);
+						float penetration = box.size.asArray[axis] + particleRadius - fabsf(distance);
+
+						if (penetration <= 0.0f) {
+							inside = false;
+						}
+						else if (penetration < minPenetration) {
+							minPenetration = penetration;
+							normal = (distance < 0.0f) ? axisDir * -1.0f : axisDir;
+						}
+					}
+
+					if (inside) {
+						vec3 surface = particle.position + normal * (minPenetration - particleRadius);
+						ResolveContact<INTEGRATOR, ROTATION>(particle, surface, normal, body);
+					}
+				}
+			}
+		}
+	}
+}
+
+template<int INTEGRATOR>
+void Cloth::SolveModelsKernel(const std::vector<Model*>& models) {
+	int numVerts = verts.size();
+	if (numVerts == 0 || models.size() == 0) {
+		return;
+	}
+	UpdateCollisionBounds();
+
+	for (int k = 0, size = models.size(); k < size; ++k) {
+		const Mesh* mesh = models[k]->GetMesh();
+		if (mesh == 0 || mesh->numTriangles == 0) {
+			continue;
+		}
+
+		// Models are rotated and translated, never scaled, so distances
+		// in model space are the same as in world space
+		mat4 world = GetWorldMatrix(*models[k]);
+		mat4 inv = Inverse(world);
+
+		for (int b = 0, numBatches = batchBounds.size(); b < numBatches; ++b) {
+			// Batch bounds in model space
+			AABB local;
+			local.position = MultiplyPoint(batchBounds[b].position, inv);
+			for (int i = 0; i < 3; ++i) {
+				local.size.asArray[i] = fabsf(inv.asArray[0 * 4 + i]) * batchBounds[b].size.x +
+					fabsf(inv.asArray[1 * 4 + i]) * batchBounds[b].size.y +
+					fabsf(inv.asArray[2 * 4 + i]) * batchBounds[b].size.z;
+			}
+
+			candidateTriangles.clear();
+			MeshQueryTriangles(*mesh, local, &candidateTriangles);
+			if (candidateTriangles.size() == 0) {
+				continue;
+			}
+
+			int last = (b + 1) * CLOTH_COLLISION_BATCH;
+			last = (last > numVerts) ? numVerts : last;
+			for (int i = b * CLOTH_COLLISION_BATCH; i < last; ++i) {
+				Particle& particle = verts[i];
+				vec3 oldLocal = MultiplyPoint(particle.oldPosition, inv);
+				vec3 newLocal = MultiplyPoint(particle.position, inv);
+
+				for (int c = 0, numCandidates = candidateTriangles.size(); c < numCandidates; ++c) {
+					Triangle triangle = GetTriangle(*mesh, candidateTriangles[c]);
+					Plane plane = FromTriangle(triangle);
+					float oldSide = PlaneEquation(oldLocal, plane);
+					float newSide = PlaneEquation(newLocal, plane);
+
+					// Keep the particle on the side it came from
+					vec3 normal = (oldSide >= 0.0f) ? plane.normal : plane.normal * -1.0f;
+					vec3 surface;
+					bool contact = false;
+
+					if ((oldSide >= 0.0f) != (newSide >= 0.0f)) {
+						// Tunneled trough the plane this step
+						vec3 hit = oldLocal + (newLocal - oldLocal) * (oldSide / (oldSide - newSide));
+						if (PointInTriangle(hit, triangle)) {
+							surface = hit;
+							contact = true;
+						}
+					}
+					if (!contact && fabsf(newSide) < particleRadius) {
+						vec3 closest = ClosestPoint(triangle, newLocal);
+						if (MagnitudeSq(newLocal - closest) < particleRadius * particleRadius) {
+							surface = closest;
+							contact = true;
+						}
+					}
+
+					if (contact) {
+						// No body to turn, so the rotation model doesn't matter
+						ResolveContact<INTEGRATOR, ROTATION_MODEL_DEFAULT>(particle, MultiplyPoint(surface, world), MultiplyVector(normal, world), 0);
+						newLocal = MultiplyPoint(particle.position, inv);
+					}
+				}
+			}
+		}
+	}
+}
+
+#define INSTANTIATE_CLOTH_KERNELS(I) \
+	template void Cloth::UpdateKernel<I>(float dt); \
+	template void Cloth::SolveConstraintsKernel<I>(const std::vector<OBB>& constraints); \
+	template void Cloth::ApplySpringForcesKernel<I>(float dt); \
+	template void Cloth::SolveRigidbodiesKernel<I, ROTATION_MODEL_LINEAR_ONLY>(const std::vector<Rigidbody*>& bodies); \
+	template void Cloth::SolveRigidbodiesKernel<I, ROTATION_MODEL_ANGULAR>(const std::vector<Rigidbody*>& bodies); \
+	template void Cloth::SolveModelsKernel<I>(const std::vector<Model*>& models);
+
+INSTANTIATE_CLOTH_KERNELS(INTEGRATOR_EULER)
+INSTANTIATE_CLOTH_KERNELS(INTEGRATOR_ACCURATE_EULER)
+INSTANTIATE_CLOTH_KERNELS(INTEGRATOR_VERLET)
+
+void Cloth::Update(float dt) {
+	UpdateKernel<INTEGRATOR_DEFAULT>(dt);
+}
+
+void Cloth::SolveConstraints(const std::vector<OBB>& constraints) {
+	SolveConstraintsKernel<INTEGRATOR_DEFAULT>(constraints);
+}
+
+void Cloth::ApplySpringForces(float dt) {
+	ApplySpringForcesKernel<INTEGRATOR_DEFAULT>(dt);
+}
+
+void Cloth::FillRenderBuffer() {
+	int numVerts = verts.size();
+	renderVertices.resize(numVerts * 6);
+	if (numVerts == 0) {
+		return;
+	}
+	float* out = &renderVertices[0];
+
+	for (int i = 0; i < numVerts; ++i) {
+		const vec3& p = verts[i].position;
+		float* v = &out[i * 6];
+		v[0] = p.x; v[1] = p.y; v[2] = p.z;
+		v[3] = 0.0f; v[4] = 0.0f; v[5] = 0.0f;
+	}
+
+	// Area weighted face normals, accumulated on every corner
+	for (int i = 0, size = renderIndices.size(); i < size; i += 3) {
+		float* a = &out[renderIndices[i + 0] * 6];
+		float* b = &out[renderIndices[i + 1] * 6];
+		float* c = &out[renderIndices[i + 2] * 6];
+
+		vec3 normal = Cross(
+			vec3(b[0] - a[0], b[1] - a[1], b[2] - a[2]),
+			vec3(c[0] - a[0], c[1] - a[1], c[2] - a[2])
+		);
+
+		a[3] += normal.x; a[4] += normal.y; a[5] += normal.z;
+		b[3] += normal.x; b[4] += normal.y; b[5] += normal.z;
+		c[3] += normal.x; c[4] += normal.y; c[5] += normal.z;
+	}
+
+	for (int i = 0; i < numVerts; ++i) {
+		float* n = &out[i * 6 + 3];
+		float lengthSq = n[0] * n[0] + n[1] * n[1] + n[2] * n[2];
+		if (lengthSq > 0.0f) {
+			float invLength = 1.0f / sqrtf(lengthSq);
+			n[0] *= invLength; n[1] *= invLength; n[2] *= invLength;
+		}
 	}
 }
 
@@ -232,20 +657,18 @@ void Cloth::Render(bool debug) {
 			glEnable(GL_LIGHTING);
 		}
 	}
-	else {
-		for (int x = 0; x < clothSize - 1; ++x) {
-			for (int z = 0; z < clothSize - 1; ++z) {
-				int tl = z * clothSize + x;
-				int bl = (z + 1) * clothSize + x;
-				int tr = z * clothSize + (x + 1);
-				int br = (z + 1) * clothSize + (x + 1);
-
-				Triangle t1(verts[tl].GetPosition(), verts[br].GetPosition(), verts[bl].GetPosition());
-				Triangle t2(verts[tl].GetPosition(), verts[tr].GetPosition(), verts[br].GetPosition());
-
-				::Render(t1, true);
-				::Render(t2, true);
-			}
-		}
+	else if (renderIndices.size() > 0) {
+		FillRenderBuffer();
+
+		const float* vertices = GetRenderVertices();
+		glEnableClientState(GL_VERTEX_ARRAY);
+		glEnableClientState(GL_NORMAL_ARRAY);
+		glVertexPointer(3, GL_FLOAT, sizeof(float) * 6, vertices);
+		glNormalPointer(GL_FLOAT, sizeof(float) * 6, vertices + 3);
+
+		glDrawElements(GL_TRIANGLES, renderIndices.size(), GL_UNSIGNED_INT, GetRenderIndices());
+
+		glDisableClientState(GL_NORMAL_ARRAY);
+		glDisableClientState(GL_VERTEX_ARRAY);
 	}
 }
\ No newline at end of file
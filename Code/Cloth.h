@@ -3,8 +3,13 @@
 
 #include "Particle.h"
 #include "Spring.h"
+#include "SpatialHash.h"
+#include "RigidbodyVolume.h"
 #include <vector>
 
+// Particles are culled against colliders in batches of this size
+#define CLOTH_COLLISION_BATCH	64
+
 class Cloth {
 protected:
 	std::vector<Particle> verts;
@@ -12,7 +17,33 @@ protected:
 	std::vector<Spring> shear;
 	std::vector<Spring> bend;
 	float clothSize;
+
+	// Self collision, see SetSelfCollision
+	bool selfCollision;
+	float selfCollisionRadius;
+	SpatialHash selfCollisionHash;
+	std::vector<vec3> selfCollisionPositions;
+	std::vector<vec3> selfCollisionCorrections;
+
+	// Rigidbody and model collision
+	float particleRadius;
+	float lastDeltaTime;
+	AABB clothBounds;
+	std::vector<AABB> batchBounds; // One per CLOTH_COLLISION_BATCH particles
+	std::vector<int> candidateTriangles;
+
+	// Interleaved position and normal per particle (6 floats), plus an index
+	// buffer that only depends on clothSize and is built once in Initialize
+	std::vector<float> renderVertices;
+	std::vector<unsigned int> renderIndices;
+protected:
+	template<int INTEGRATOR> void SolveSelfCollisionKernel();
+	template<int INTEGRATOR, int ROTATION> void ResolveContact(Particle& particle, const vec3& surface, const vec3& normal, RigidbodyVolume* body);
+	void UpdateCollisionBounds();
 public:
+	inline Cloth() : clothSize(0), selfCollision(false), selfCollisionRadius(0.0f),
+		particleRadius(0.05f), lastDeltaTime(0.0f) { }
+
 	// Public API
 	void Initialize(int gridSize, float distance, const vec3& position);
 
@@ -20,6 +51,11 @@ public:
 	void SetShearSprings(float k, float b);
 	void SetBendSprings(float k, float b);
 	void SetParticleMass(float mass);
+	// Keeps particles at least 2 * radius apart. Particles that are two or
+	// fewer grid steps apart are connected by springs and are skipped.
+	void SetSelfCollision(bool enabled, float radius);
+	// Distance kept between particles and rigidbodies or models
+	void SetParticleRadius(float radius);
 
 	// For Physics System
 	void ApplyForces();
@@ -27,6 +63,32 @@ public:
 	void SolveConstraints(const std::vector<OBB>& constraints);
 	void ApplySpringForces(float dt);
 	void Render(bool debug);
+
+	// Writes current positions and recomputed normals into the render
+	// buffer. Does not touch GL, so it can run without a context.
+	void FillRenderBuffer();
+	inline const float* GetRenderVertices() const {
+		return renderVertices.size() > 0 ? &renderVertices[0] : 0;
+	}
+	inline int GetRenderVertexCount() const {
+		return renderVertices.size() / 6;
+	}
+	inline const unsigned int* GetRenderIndices() const {
+		return renderIndices.size() > 0 ? &renderIndices[0] : 0;
+	}
+	inline int GetRenderIndexCount() const {
+		return renderIndices.size();
+	}
+
+	// Specialized per integration model, see Particle.h
+	template<int INTEGRATOR> void UpdateKernel(float dt);
+	template<int INTEGRATOR> void SolveConstraintsKernel(const std::vector<OBB>& constraints);
+	template<int INTEGRATOR> void ApplySpringForcesKernel(float dt);
+	// Two-way coupling with sphere and box RigidbodyVolumes, ROTATION is the
+	// rotation model of the bodies (ROTATION_MODEL_*, see RigidbodyVolume.h)
+	template<int INTEGRATOR, int ROTATION> void SolveRigidbodiesKernel(const std::vector<Rigidbody*>& bodies);
+	// Static triangle meshes, uses the mesh BVH if it has one
+	template<int INTEGRATOR> void SolveModelsKernel(const std::vector<Model*>& models);
 };
 
 #endif
\ No newline at end of file
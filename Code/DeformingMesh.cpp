@@ -0,0 +1,103 @@
+#include "DeformingMesh.h"
+#include "Threading.h"
+
+DeformingMesh::DeformingMesh() : mesh(0), builtCost(0.0f), building(false), built(false) {
+	rebuildThreshold = 1.5f;
+	maxLeafTriangles = BVH_DEFAULT_LEAF_SIZE;
+}
+
+DeformingMesh::~DeformingMesh() {
+	if (builder.joinable()) {
+		builder.join();
+	}
+}
+
+void DeformingMesh::SetMesh(Mesh* _mesh) {
+	if (builder.joinable()) {
+		builder.join();
+	}
+	building = false;
+	built = false;
+
+	mesh = _mesh;
+	triangleSlot.clear();
+	slotTriangle.clear();
+	if (mesh == 0) {
+		return;
+	}
+
+	// Always a fresh tree, so the triangle order is known
+	std::vector<LinearBVHNode> nodes;
+	std::vector<int> order;
+	BuildLinearBVH(*mesh, maxLeafTriangles, &nodes, &order);
+	AccelerateMesh(*mesh, nodes, order);
+
+	triangleSlot.resize(mesh->numTriangles);
+	slotTriangle = order;
+	for (int i = 0; i < mesh->numTriangles; ++i) {
+		triangleSlot[order[i]] = i;
+	}
+	builtCost = GetBVHCost(*mesh);
+}
+
+int DeformingMesh::GetTriangleSlot(int index) const {
+	return triangleSlot[index];
+}
+
+float DeformingMesh::GetCostRatio() const {
+	if (mesh == 0 || builtCost <= 0.0f) {
+		return 1.0f;
+	}
+	return GetBVHCost(*mesh) / builtCost;
+}
+
+void DeformingMesh::Update() {
+	if (mesh == 0 || mesh->accelerator == 0) {
+		return;
+	}
+
+	if (built) {
+		FinishRebuild();
+		return;
+	}
+
+	float cost = RefitMesh(*mesh);
+	if (!building && cost > builtCost * rebuildThreshold) {
+		StartRebuild();
+	}
+}
+
+void DeformingMesh::StartRebuild() {
+	if (builder.joinable()) {
+		builder.join();
+	}
+
+	buildTriangles.resize(mesh->numTriangles);
+	for (int i = 0; i < mesh->numTriangles; ++i) {
+		buildTriangles[i] = GetTriangle(*mesh, i);
+	}
+	building = true;
+	built = false;
+	builder = std::thread([this]() {
+		SetSerialThread(true); // Keeps the workers free for the main thread
+		BuildLinearBVH(&buildTriangles[0], (int)buildTriangles.size(), maxLeafTriangles, &buildNodes, &buildOrder);
+		built = true;
+	});
+}
+
+// The new tree was built from the snapshot, the triangles kept moving since
+// but are still in the same order, so the build order still applies.
+void DeformingMesh::FinishRebuild() {
+	builder.join();
+	AccelerateMesh(*mesh, buildNodes, buildOrder);
+
+	std::vector<int> previous = slotTriangle;
+	for (int i = 0; i < mesh->numTriangles; ++i) {
+		slotTriangle[i] = previous[buildOrder[i]];
+		triangleSlot[slotTriangle[i]] = i;
+	}
+
+	builtCost = RefitMesh(*mesh);
+	building = false;
+	built = false;
+}
@@ -0,0 +1,63 @@
+#ifndef _H_DEFORMING_MESH_
+#define _H_DEFORMING_MESH_
+
+#include "Geometry3D.h"
+#include <thread>
+#include <atomic>
+
+// Keeps the BVH of a mesh whose triangles move (skinned or cloth like
+// geometry) usable without rebuilding it every frame. Update refits the
+// tree, which is O(n) but lets the nodes grow as the triangles drift away
+// from where they were at build time. Once the refit tree costs more than
+// rebuildThreshold times the cost it had when it was built, a new tree is
+// built on a separate thread from a copy of the triangles, and swapped in
+// by a later Update.
+//
+// Building reorders the mesh triangles (see AccelerateMesh), GetTriangleSlot
+// maps the triangle indices the mesh had in SetMesh to their current index.
+
+class DeformingMesh {
+protected:
+	Mesh* mesh;
+	float builtCost; // GetBVHCost right after the current tree was built
+	std::vector<int> triangleSlot; // Original index to mesh index
+	std::vector<int> slotTriangle; // Mesh index to original index
+
+	// Background rebuild
+	std::thread builder;
+	std::atomic<bool> building;
+	std::atomic<bool> built;
+	std::vector<Triangle> buildTriangles; // Snapshot the builder works on
+	std::vector<LinearBVHNode> buildNodes;
+	std::vector<int> buildOrder;
+protected:
+	void StartRebuild();
+	void FinishRebuild();
+private:
+	DeformingMesh(const DeformingMesh&);
+	DeformingMesh& operator=(const DeformingMesh&);
+public:
+	float rebuildThreshold;
+	int maxLeafTriangles;
+
+	DeformingMesh();
+	~DeformingMesh();
+
+	// Always rebuilds the tree of the mesh, freeing any accelerator (compressed
+	// too) it had, so the triangle order is known. The mesh must outlive this object.
+	void SetMesh(Mesh* mesh);
+	inline Mesh* GetMesh() const {
+		return mesh;
+	}
+	int GetTriangleSlot(int index) const;
+
+	// Call after the triangles of the mesh changed
+	void Update();
+	// Current cost over the cost at build time, rebuilds start above rebuildThreshold
+	float GetCostRatio() const;
+	inline bool IsRebuilding() const {
+		return building;
+	}
+};
+
+#endif
@@ -5,6 +5,7 @@
 #include "LinearImpulse.h"
 #include "ConservationOfMomentum.h"
 #include "SimpleSprings.h"
+#include "FluidDemo.h"
 
 #include <cstdlib>
 
@@ -71,7 +72,7 @@ void DemoWindow::Update(float deltaTime) {
 
     if (selectAllDemos) {
         const char* demoItems[] = {
-            "Raycast Demo", "Collision Features", "Linear Impulse", "Conservation Of Momentum", "Simple Springs",
+            "Raycast Demo", "Collision Features", "Linear Impulse", "Conservation Of Momentum", "Simple Springs", "Fluid",
         };
 
         int previousDemoIndex = m_selectedDemoIndex;
@@ -87,6 +88,7 @@ void DemoWindow::Update(float deltaTime) {
                 case 2: m_currentDemo = new LinearImpulse(); break;
                 case 3: m_currentDemo = new ConservationOfMomentum(); break;
                 case 4: m_currentDemo = new SimpleSprings(); break;
+                case 5: m_currentDemo = new FluidDemo(); break;
             }
 
             m_currentDemo->InitializeDemo(GetWindowWidth(), GetWindowHeight());
@@ -0,0 +1,118 @@
+#include "FluidDemo.h"
+#include "Threading.h"
+#include "glad/glad.h"
+#include "imgui/imgui.h"
+
+extern double GetMilliseconds();
+
+static const int particleCounts[] = { 10000, 25000, 50000, 100000 };
+static const char* particleCountNames[] = { "10k", "25k", "50k", "100k" };
+
+void FluidDemo::Initialize(int width, int height) {
+    DemoBase::Initialize(width, height);
+
+    glPointSize(3.0f);
+    glEnable(GL_LIGHTING);
+    glEnable(GL_LIGHT0);
+
+    float lightPosition[] = { 0.5f, 1.0f, -1.5f, 0.0f };
+    glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
+
+    size_imgui_window = true;
+
+    camera.SetTarget(vec3(0.0f, 1.0f, 0.0f));
+    camera.SetZoom(9.0f);
+    camera.SetRotation(vec2(-67.9312f, 19.8f));
+
+    ResetDemo();
+}
+
+void FluidDemo::ResetDemo() {
+    physicsSystem.ClearConstraints();
+    physicsSystem.ClearFluids();
+    simulationTimes.clear();
+
+    // Tank, 4 x 2 inside. The floor reaches under the walls so the corners are closed.
+    physicsSystem.AddConstraint(OBB(vec3(0.0f, -0.5f, 0.0f), vec3(3.0f, 0.5f, 2.0f)));
+    physicsSystem.AddConstraint(OBB(vec3(-2.5f, 3.0f, 0.0f), vec3(0.5f, 3.5f, 1.5f)));
+    physicsSystem.AddConstraint(OBB(vec3(2.5f, 3.0f, 0.0f), vec3(0.5f, 3.5f, 1.5f)));
+    physicsSystem.AddConstraint(OBB(vec3(0.0f, 3.0f, -1.5f), vec3(3.0f, 3.5f, 0.5f)));
+    physicsSystem.AddConstraint(OBB(vec3(0.0f, 3.0f, 1.5f), vec3(3.0f, 3.5f, 0.5f)));
+
+    // Water column against the left wall, as tall as it needs to be for the particle count
+    fluid.Clear();
+    int numParticles = particleCounts[particleCountIndex];
+    float spacing = fluid.GetParticleSpacing();
+    int columns = (int)(1.5f / spacing);
+    int rows = (int)(2.0f / spacing);
+    int layers = (numParticles + columns * rows - 1) / (columns * rows);
+    fluid.Reserve(columns * rows * layers);
+    fluid.AddVolume(FromMinMax(vec3(-2.0f, 0.0f, -1.0f), vec3(-2.0f + columns * spacing, layers * spacing, 1.0f)));
+
+    physicsSystem.AddFluid(&fluid);
+}
+
+void FluidDemo::Render() {
+    DemoBase::Render();
+
+    float lightPosition[] = { 0.0f, 1.0f, 0.0f, 0.0f };
+    glLightfv(GL_LIGHT0, GL_POSITION, lightPosition);
+
+    glColor3f(0.2f, 0.4f, 1.0f);
+    physicsSystem.Render();
+}
+
+void FluidDemo::ImGUI() {
+    DemoBase::ImGUI();
+
+    float avgTime = 0;
+    std::list<float>::iterator iterator = simulationTimes.begin();
+    for (; iterator != simulationTimes.end(); iterator++) {
+        avgTime += *iterator;
+    }
+    if (simulationTimes.size() > 0) {
+        avgTime /= simulationTimes.size();
+    }
+    // Every particle goes trough all passes once per sub step
+    double particlesPerSecond = (avgTime > 0.0f) ?
+        (double)fluid.Size() * fluid.substeps / (avgTime / 1000.0) : 0.0;
+
+    if (size_imgui_window) {
+        size_imgui_window = false;
+        ImGui::SetNextWindowPos(ImVec2(400, 10));
+        ImGui::SetNextWindowSize(ImVec2(370, 120));
+    }
+
+    ImGui::Begin("Fluid Demo", 0, ImGuiWindowFlags_NoResize);
+
+    ImGui::Text("%d particles, %d sub steps, %d threads", fluid.Size(), fluid.substeps, GetWorkerCount());
+    ImGui::Text("Simulation: %.2f ms, %.2f M particles/sec", avgTime, particlesPerSecond / 1000000.0);
+
+    ImGui::PushItemWidth(100);
+    if (ImGui::Combo("Particles", &particleCountIndex, particleCountNames, 4)) {
+        ResetDemo();
+    }
+    ImGui::SameLine();
+    ImGui::PushItemWidth(100);
+    ImGui::SliderFloat("Viscosity", &fluid.viscosity, 0.0f, 20.0f);
+
+    if (ImGui::Button("Reset")) {
+        ResetDemo();
+    }
+    ImGui::SameLine();
+    if (ImGui::Button("Show Help")) {
+        show_help = true;
+    }
+    ImGui::End();
+}
+
+void FluidDemo::Update(float dt) {
+    DemoBase::Update(dt);
+
+    double startTime = GetMilliseconds();
+    physicsSystem.Update(dt);
+    simulationTimes.push_back(float(GetMilliseconds() - startTime));
+    while (simulationTimes.size() > 120) {
+        simulationTimes.pop_front();
+    }
+}
@@ -0,0 +1,32 @@
+#ifndef _H_FLUID_DEMO_
+#define _H_FLUID_DEMO_
+
+#include "DemoBase.h"
+#include "PhysicsSystem.h"
+#include "FluidSystem.h"
+#include <list>
+
+// Dam break in a tank of OBB constraints. Doubles as the SPH
+// benchmark, the default scene has 100k particles and the
+// window reports how many particles are simulated per second.
+
+class FluidDemo : public DemoBase {
+protected:
+	PhysicsSystem physicsSystem;
+	FluidSystem fluid;
+	std::list<float> simulationTimes; // Milliseconds per Update
+
+	int particleCountIndex;
+	bool size_imgui_window;
+protected:
+	void ResetDemo();
+public:
+	inline FluidDemo() : DemoBase(), particleCountIndex(3), size_imgui_window(true) { }
+
+	void Initialize(int width, int height);
+	void Render();
+	void Update(float dt);
+	void ImGUI();
+};
+
+#endif
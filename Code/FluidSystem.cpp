@@ -0,0 +1,268 @@
+#include "FluidSystem.h"
+#include "Threading.h"
+#include <cmath>
+#include <cfloat>
+
+#define FLUID_PI			3.14159265358979f
+#define FLUID_CHUNK			512 // Particles per ParallelFor chunk
+#define FLUID_CELLS_PER_PARTICLE	4 // Grid memory limit, the cells grow if the fluid spreads out
+
+FluidSystem::FluidSystem() : ParticleSystem() {
+	friction = 1.0f; // Viscosity takes care of damping
+	bounce = 0.1f;
+	restDensity = 1000.0f;
+	stiffness = 50.0f;
+	viscosity = 3.0f;
+	substeps = 8;
+	gridCellSize = 1.0f;
+	gridSize[0] = gridSize[1] = gridSize[2] = 0;
+	SetParticleSpacing(0.05f);
+}
+
+void FluidSystem::SetParticleSpacing(float spacing) {
+	particleSpacing = spacing;
+	particleMass = restDensity * spacing * spacing * spacing;
+	smoothingRadius = spacing * 2.0f;
+}
+
+int FluidSystem::AddVolume(const AABB& volume) {
+	vec3 min = GetMin(volume);
+	vec3 max = GetMax(volume);
+	float half = particleSpacing * 0.5f;
+
+	int count = 0;
+	for (float y = min.y + half; y <= max.y; y += particleSpacing) {
+		for (float z = min.z + half; z <= max.z; z += particleSpacing) {
+			for (float x = min.x + half; x <= max.x; x += particleSpacing) {
+				AddParticle(vec3(x, y, z), particleMass);
+				count += 1;
+			}
+		}
+	}
+	return count;
+}
+
+template<int INTEGRATOR>
+void FluidSystem::BuildGrid(float deltaTime) {
+	vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
+	vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	for (int i = 0; i < numParticles; ++i) {
+		min.x = fminf(min.x, positionX[i]); max.x = fmaxf(max.x, positionX[i]);
+		min.y = fminf(min.y, positionY[i]); max.y = fmaxf(max.y, positionY[i]);
+		min.z = fminf(min.z, positionZ[i]); max.z = fmaxf(max.z, positionZ[i]);
+	}
+
+	// Cells at least as big as the smoothing radius, so all neighbours
+	// are in the 27 surrounding cells. Grow them while the grid is too big.
+	double maxCells = (double)numParticles * FLUID_CELLS_PER_PARTICLE + 4096.0;
+	gridOrigin = min;
+	gridCellSize = smoothingRadius;
+	for (;;) {
+		float invCellSize = 1.0f / gridCellSize;
+		gridSize[0] = (int)((max.x - min.x) * invCellSize) + 1;
+		gridSize[1] = (int)((max.y - min.y) * invCellSize) + 1;
+		gridSize[2] = (int)((max.z - min.z) * invCellSize) + 1;
+		if ((double)gridSize[0] * gridSize[1] * gridSize[2] <= maxCells) {
+			break;
+		}
+		gridCellSize *= 2.0f;
+	}
+	int numCells = gridSize[0] * gridSize[1] * gridSize[2];
+
+	// Counting sort of the particles by cell
+	particleCell.resize(numParticles);
+	sortedIndex.resize(numParticles);
+	cellStart.assign(numCells + 1, 0);
+
+	float invCellSize = 1.0f / gridCellSize;
+	for (int i = 0; i < numParticles; ++i) {
+		int x = (int)((positionX[i] - min.x) * invCellSize);
+		int y = (int)((positionY[i] - min.y) * invCellSize);
+		int z = (int)((positionZ[i] - min.z) * invCellSize);
+		x = (x < gridSize[0]) ? x : gridSize[0] - 1;
+		y = (y < gridSize[1]) ? y : gridSize[1] - 1;
+		z = (z < gridSize[2]) ? z : gridSize[2] - 1;
+		int cell = x + gridSize[0] * (y + gridSize[1] * z);
+		particleCell[i] = cell;
+		cellStart[cell + 1] += 1;
+	}
+	for (int i = 0; i < numCells; ++i) {
+		cellStart[i + 1] += cellStart[i];
+	}
+	// cellStart[c] is used as a write cursor and restored after
+	for (int i = 0; i < numParticles; ++i) {
+		sortedIndex[cellStart[particleCell[i]]++] = i;
+	}
+	for (int i = numCells; i > 0; --i) {
+		cellStart[i] = cellStart[i - 1];
+	}
+	cellStart[0] = 0;
+
+	sortedX.resize(numParticles); sortedY.resize(numParticles); sortedZ.resize(numParticles);
+	sortedVX.resize(numParticles); sortedVY.resize(numParticles); sortedVZ.resize(numParticles);
+	invDensity.resize(numParticles);
+	pressure.resize(numParticles);
+
+	float invDeltaTime = (deltaTime > 0.0f) ? 1.0f / deltaTime : 0.0f;
+	ParallelFor(numParticles, FLUID_CHUNK, [&](int first, int last) {
+		for (int s = first; s < last; ++s) {
+			int i = sortedIndex[s];
+			sortedX[s] = positionX[i];
+			sortedY[s] = positionY[i];
+			sortedZ[s] = positionZ[i];
+			if (INTEGRATOR == INTEGRATOR_VERLET) {
+				sortedVX[s] = (positionX[i] - oldPositionX[i]) * invDeltaTime;
+				sortedVY[s] = (positionY[i] - oldPositionY[i]) * invDeltaTime;
+				sortedVZ[s] = (positionZ[i] - oldPositionZ[i]) * invDeltaTime;
+			}
+			else {
+				sortedVX[s] = velocityX[i];
+				sortedVY[s] = velocityY[i];
+				sortedVZ[s] = velocityZ[i];
+			}
+		}
+	});
+}
+
+int FluidSystem::GetNeighbourRanges(int slot, int* outFirst, int* outLast) const {
+	int cell = particleCell[sortedIndex[slot]];
+	int cx = cell % gridSize[0];
+	int cy = (cell / gridSize[0]) % gridSize[1];
+	int cz = cell / (gridSize[0] * gridSize[1]);
+
+	// Cells next to each other along x are contiguous in sorted
+	// order, the 27 cells around a particle are only 9 ranges
+	int xMin = (cx > 0) ? cx - 1 : 0;
+	int xMax = (cx + 1 < gridSize[0]) ? cx + 1 : cx;
+	int numRanges = 0;
+	for (int z = (cz > 0) ? cz - 1 : 0; z <= cz + 1 && z < gridSize[2]; ++z) {
+		for (int y = (cy > 0) ? cy - 1 : 0; y <= cy + 1 && y < gridSize[1]; ++y) {
+			int row = gridSize[0] * (y + gridSize[1] * z);
+			outFirst[numRanges] = cellStart[row + xMin];
+			outLast[numRanges] = cellStart[row + xMax + 1];
+			numRanges += 1;
+		}
+	}
+	return numRanges;
+}
+
+void FluidSystem::ComputeDensities(int first, int last) {
+	float h2 = smoothingRadius * smoothingRadius;
+	float h9 = h2 * h2 * h2 * h2 * smoothingRadius;
+	float poly6 = particleMass * 315.0f / (64.0f * FLUID_PI * h9);
+
+	for (int s = first; s < last; ++s) {
+		float x = sortedX[s], y = sortedY[s], z = sortedZ[s];
+		float sum = 0.0f;
+
+		int rangeFirst[9], rangeLast[9];
+		int numRanges = GetNeighbourRanges(s, rangeFirst, rangeLast);
+		for (int range = 0; range < numRanges; ++range) {
+			for (int j = rangeFirst[range]; j < rangeLast[range]; ++j) {
+				float dx = x - sortedX[j], dy = y - sortedY[j], dz = z - sortedZ[j];
+				float r2 = dx * dx + dy * dy + dz * dz;
+				if (r2 < h2) {
+					float w = h2 - r2;
+					sum += w * w * w;
+				}
+			}
+		}
+
+		// Never zero, every particle is its own neighbour
+		float density = sum * poly6;
+		invDensity[s] = 1.0f / density;
+		// Only push apart, pulling makes the free surface clump
+		pressure[s] = fmaxf(stiffness * (density - restDensity), 0.0f);
+	}
+}
+
+template<int INTEGRATOR>
+void FluidSystem::ApplyPressureAndViscosity(int first, int last, float deltaTime) {
+	float h = smoothingRadius;
+	float h2 = h * h;
+	float h6 = h2 * h2 * h2;
+	float spiky = particleMass * 45.0f / (FLUID_PI * h6); // Gradient, sign folded in below
+	float laplacian = viscosity * particleMass * 45.0f / (FLUID_PI * h6);
+
+	for (int s = first; s < last; ++s) {
+		int i = sortedIndex[s];
+		if (invMass[i] == 0.0f) {
+			continue;
+		}
+
+		float x = sortedX[s], y = sortedY[s], z = sortedZ[s];
+		float vx = sortedVX[s], vy = sortedVY[s], vz = sortedVZ[s];
+		float p = pressure[s];
+		float ax = 0.0f, ay = 0.0f, az = 0.0f;
+
+		int rangeFirst[9], rangeLast[9];
+		int numRanges = GetNeighbourRanges(s, rangeFirst, rangeLast);
+		for (int range = 0; range < numRanges; ++range) {
+			for (int j = rangeFirst[range]; j < rangeLast[range]; ++j) {
+				float dx = x - sortedX[j], dy = y - sortedY[j], dz = z - sortedZ[j];
+				float r2 = dx * dx + dy * dy + dz * dz;
+				if (r2 >= h2 || j == s || r2 < 0.0000000001f) {
+					continue;
+				}
+
+				float r = sqrtf(r2);
+				float q = h - r;
+
+				// Pressure, away from the neighbour
+				float f = spiky * (p + pressure[j]) * 0.5f * invDensity[j] * q * q / r;
+				// Viscosity, towards the velocity of the neighbour
+				float v = laplacian * invDensity[j] * q;
+
+				ax += dx * f + (sortedVX[j] - vx) * v;
+				ay += dy * f + (sortedVY[j] - vy) * v;
+				az += dz * f + (sortedVZ[j] - vz) * v;
+			}
+		}
+
+		// Forces over density is the acceleration, same as AddImpulseKernel
+		float scale = deltaTime * invDensity[s];
+		if (INTEGRATOR == INTEGRATOR_VERLET) {
+			scale *= deltaTime;
+			oldPositionX[i] -= ax * scale;
+			oldPositionY[i] -= ay * scale;
+			oldPositionZ[i] -= az * scale;
+		}
+		else {
+			velocityX[i] += ax * scale;
+			velocityY[i] += ay * scale;
+			velocityZ[i] += az * scale;
+		}
+	}
+}
+
+template<int INTEGRATOR>
+void FluidSystem::StepKernel(float deltaTime, const std::vector<OBB>& constraints) {
+	if (numParticles == 0) {
+		return;
+	}
+	int steps = (substeps > 1) ? substeps : 1;
+	float dt = deltaTime / (float)steps;
+
+	for (int step = 0; step < steps; ++step) {
+		BuildGrid<INTEGRATOR>(dt);
+
+		ParallelFor(numParticles, FLUID_CHUNK, [&](int first, int last) {
+			ComputeDensities(first, last);
+		});
+		ParallelFor(numParticles, FLUID_CHUNK, [&](int first, int last) {
+			ApplyPressureAndViscosity<INTEGRATOR>(first, last, dt);
+		});
+
+		UpdateKernel<INTEGRATOR>(dt);
+		SolveConstraintsKernel<INTEGRATOR>(constraints);
+	}
+}
+
+#define INSTANTIATE_FLUID_KERNELS(I) \
+	template void FluidSystem::BuildGrid<I>(float deltaTime); \
+	template void FluidSystem::ApplyPressureAndViscosity<I>(int first, int last, float deltaTime); \
+	template void FluidSystem::StepKernel<I>(float deltaTime, const std::vector<OBB>& constraints);
+
+INSTANTIATE_FLUID_KERNELS(INTEGRATOR_EULER)
+INSTANTIATE_FLUID_KERNELS(INTEGRATOR_ACCURATE_EULER)
+INSTANTIATE_FLUID_KERNELS(INTEGRATOR_VERLET)
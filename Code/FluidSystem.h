@@ -0,0 +1,59 @@
+#ifndef _H_FLUID_SYSTEM_
+#define _H_FLUID_SYSTEM_
+
+#include "ParticleSystem.h"
+
+// Weakly compressible SPH, Muller et al. 2003, "Particle-Based Fluid
+// Simulation for Interactive Applications". Neighbours are found on a
+// uniform grid that is rebuilt every sub step by counting-sorting the
+// particles by cell. The density and force passes read sorted copies
+// of the particles, so the neighbours of a cell are close in memory,
+// and are split over the worker threads. Integration and OBB boundary
+// handling are the ParticleSystem kernels.
+
+class FluidSystem : public ParticleSystem {
+protected:
+	float particleSpacing;
+
+	// Grid, rebuilt every sub step
+	vec3 gridOrigin;
+	float gridCellSize;
+	int gridSize[3];
+	std::vector<int> cellStart; // Sorted particles of cell c are [cellStart[c], cellStart[c + 1])
+	std::vector<int> particleCell; // Cell of every particle
+	std::vector<int> sortedIndex; // Sorted slot to particle index
+
+	// Particle state in sorted order
+	std::vector<float> sortedX, sortedY, sortedZ;
+	std::vector<float> sortedVX, sortedVY, sortedVZ;
+	std::vector<float> invDensity;
+	std::vector<float> pressure;
+protected:
+	template<int INTEGRATOR> void BuildGrid(float deltaTime);
+	// Sorted particle ranges that cover the cells around a sorted particle, at most 9
+	int GetNeighbourRanges(int slot, int* outFirst, int* outLast) const;
+	void ComputeDensities(int first, int last);
+	template<int INTEGRATOR> void ApplyPressureAndViscosity(int first, int last, float deltaTime);
+public:
+	float smoothingRadius; // Neighbour distance, about twice the spacing
+	float restDensity;
+	float stiffness; // Pressure = stiffness * (density - restDensity)
+	float viscosity;
+	float particleMass;
+	int substeps; // SPH needs a much smaller time step than the rest of the system
+
+	FluidSystem();
+
+	// Sets particle mass and smoothing radius for particles this far apart at rest density
+	void SetParticleSpacing(float spacing);
+	inline float GetParticleSpacing() const {
+		return particleSpacing;
+	}
+	// Fills the box with particles on a grid of the current spacing, returns how many were added
+	int AddVolume(const AABB& volume);
+
+	// For Physics System, integrates and constrains every sub step
+	template<int INTEGRATOR> void StepKernel(float deltaTime, const std::vector<OBB>& constraints);
+};
+
+#endif
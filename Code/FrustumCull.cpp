@@ -0,0 +1,189 @@
+#include "FrustumCull.h"
+#include "Threading.h"
+#include "Simd.h"
+#include <cmath>
+
+// The planes of the mask, unpacked. abs* are the absolute normal components,
+// the extent of a box along the normal is their dot product with its size.
+struct CullPlanes {
+	float normalX[6], normalY[6], normalZ[6];
+	float absX[6], absY[6], absZ[6];
+	float distance[6];
+	int count;
+};
+
+static void GetCullPlanes(const Frustum& f, int planeMask, CullPlanes* outPlanes) {
+	outPlanes->count = 0;
+	for (int i = 0; i < 6; ++i) {
+		if ((planeMask & (1 << i)) == 0) {
+			continue;
+		}
+		const Plane& plane = f.planes[i];
+		int p = outPlanes->count++;
+		outPlanes->normalX[p] = plane.normal.x;
+		outPlanes->normalY[p] = plane.normal.y;
+		outPlanes->normalZ[p] = plane.normal.z;
+		outPlanes->absX[p] = fabsf(plane.normal.x);
+		outPlanes->absY[p] = fabsf(plane.normal.y);
+		outPlanes->absZ[p] = fabsf(plane.normal.z);
+		outPlanes->distance[p] = plane.distance;
+	}
+}
+
+// Entries [first, first + count) of one word, count is at most 32. The
+// distance and extent are summed in the same order as ClassifyPlanes, so
+// every path culls exactly what it does. Spheres have no sizeY and sizeZ,
+// their extent along any normal is the radius in sizeX.
+template<bool SPHERES>
+static unsigned int CullWord(const CullPlanes& planes, const float* x, const float* y, const float* z, const float* sizeX, const float* sizeY, const float* sizeZ, int first, int count) {
+	unsigned int visible = 0;
+	int i = 0;
+
+#if defined(SIMD_AVX2)
+	__m256 zero8 = _mm256_setzero_ps();
+	for (; i + 8 <= count; i += 8) {
+		int e = first + i;
+		__m256 cx = _mm256_loadu_ps(x + e);
+		__m256 cy = _mm256_loadu_ps(y + e);
+		__m256 cz = _mm256_loadu_ps(z + e);
+		__m256 sx = _mm256_loadu_ps(sizeX + e);
+		__m256 sy = SPHERES ? zero8 : _mm256_loadu_ps(sizeY + e);
+		__m256 sz = SPHERES ? zero8 : _mm256_loadu_ps(sizeZ + e);
+
+		__m256 outside = zero8;
+		for (int p = 0; p < planes.count; ++p) {
+			__m256 d = _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(cx, _mm256_set1_ps(planes.normalX[p])),
+				_mm256_mul_ps(cy, _mm256_set1_ps(planes.normalY[p]))),
+				_mm256_mul_ps(cz, _mm256_set1_ps(planes.normalZ[p]))),
+				_mm256_set1_ps(planes.distance[p]));
+			__m256 r = sx;
+			if (!SPHERES) {
+				r = _mm256_add_ps(_mm256_add_ps(
+					_mm256_mul_ps(sx, _mm256_set1_ps(planes.absX[p])),
+					_mm256_mul_ps(sy, _mm256_set1_ps(planes.absY[p]))),
+					_mm256_mul_ps(sz, _mm256_set1_ps(planes.absZ[p])));
+			}
+			outside = _mm256_or_ps(outside, _mm256_cmp_ps(d, _mm256_sub_ps(zero8, r), _CMP_LT_OQ));
+		}
+		visible |= (unsigned int)(~_mm256_movemask_ps(outside) & 0xff) << i;
+	}
+#endif
+
+#if defined(SIMD_SSE)
+	__m128 zero4 = _mm_setzero_ps();
+	for (; i + 4 <= count; i += 4) {
+		int e = first + i;
+		__m128 cx = _mm_loadu_ps(x + e);
+		__m128 cy = _mm_loadu_ps(y + e);
+		__m128 cz = _mm_loadu_ps(z + e);
+		__m128 sx = _mm_loadu_ps(sizeX + e);
+		__m128 sy = SPHERES ? zero4 : _mm_loadu_ps(sizeY + e);
+		__m128 sz = SPHERES ? zero4 : _mm_loadu_ps(sizeZ + e);
+
+		__m128 outside = zero4;
+		for (int p = 0; p < planes.count; ++p) {
+			__m128 d = _mm_add_ps(_mm_add_ps(_mm_add_ps(
+				_mm_mul_ps(cx, _mm_set1_ps(planes.normalX[p])),
+				_mm_mul_ps(cy, _mm_set1_ps(planes.normalY[p]))),
+				_mm_mul_ps(cz, _mm_set1_ps(planes.normalZ[p]))),
+				_mm_set1_ps(planes.distance[p]));
+			__m128 r = sx;
+			if (!SPHERES) {
+				r = _mm_add_ps(_mm_add_ps(
+					_mm_mul_ps(sx, _mm_set1_ps(planes.absX[p])),
+					_mm_mul_ps(sy, _mm_set1_ps(planes.absY[p]))),
+					_mm_mul_ps(sz, _mm_set1_ps(planes.absZ[p])));
+			}
+			outside = _mm_or_ps(outside, _mm_cmplt_ps(d, _mm_sub_ps(zero4, r)));
+		}
+		visible |= (unsigned int)(~_mm_movemask_ps(outside) & 0xf) << i;
+	}
+#endif
+
+	// Scalar path, also handles the tail of the SIMD loops
+	for (; i < count; ++i) {
+		int e = first + i;
+		bool outside = false;
+		for (int p = 0; p < planes.count && !outside; ++p) {
+			float d = x[e] * planes.normalX[p] + y[e] * planes.normalY[p] + z[e] * planes.normalZ[p] + planes.distance[p];
+			float r = SPHERES ? sizeX[e] : sizeX[e] * planes.absX[p] + sizeY[e] * planes.absY[p] + sizeZ[e] * planes.absZ[p];
+			outside = d < -r;
+		}
+		visible |= (outside ? 0u : 1u) << i;
+	}
+	return visible;
+}
+
+// Everything a FrustumCullRange needs, so the lambda it hands to ParallelFor
+// captures one reference and std::function stores it without allocating
+struct CullJob {
+	CullPlanes planes;
+	const float* x;
+	const float* y;
+	const float* z;
+	const float* sizeX;
+	const float* sizeY;
+	const float* sizeZ;
+	int count;
+	unsigned int* outVisible;
+};
+
+template<bool SPHERES>
+static void CullWords(const CullJob& job, int begin, int end) {
+	for (int w = begin; w < end; ++w) {
+		int first = w * 32;
+		int wordCount = (job.count - first < 32) ? job.count - first : 32;
+		job.outVisible[w] = CullWord<SPHERES>(job.planes, job.x, job.y, job.z, job.sizeX, job.sizeY, job.sizeZ, first, wordCount);
+	}
+}
+
+template<bool SPHERES>
+static void FrustumCullRange(const Frustum& f, int planeMask, const float* x, const float* y, const float* z, const float* sizeX, const float* sizeY, const float* sizeZ, int count, unsigned int* outVisible) {
+	CullJob job;
+	GetCullPlanes(f, planeMask, &job.planes);
+	job.x = x;
+	job.y = y;
+	job.z = z;
+	job.sizeX = sizeX;
+	job.sizeY = sizeY;
+	job.sizeZ = sizeZ;
+	job.count = count;
+	job.outVisible = outVisible;
+
+	int numWords = (count + 31) / 32;
+	if (count < FRUSTUM_CULL_PARALLEL) {
+		CullWords<SPHERES>(job, 0, numWords);
+	}
+	else {
+		ParallelFor(numWords, FRUSTUM_CULL_CHUNK / 32, [&job](int begin, int end) {
+			CullWords<SPHERES>(job, begin, end);
+		});
+	}
+}
+
+void FrustumAABBs(const Frustum& f, int planeMask, const float* x, const float* y, const float* z, const float* sizeX, const float* sizeY, const float* sizeZ, int count, unsigned int* outVisible) {
+	FrustumCullRange<false>(f, planeMask, x, y, z, sizeX, sizeY, sizeZ, count, outVisible);
+}
+
+void FrustumSpheres(const Frustum& f, int planeMask, const float* x, const float* y, const float* z, const float* radius, int count, unsigned int* outVisible) {
+	FrustumCullRange<true>(f, planeMask, x, y, z, radius, 0, 0, count, outVisible);
+}
+
+void ResizeCullList(CullList* list, int count) {
+	list->x.resize(count);
+	list->y.resize(count);
+	list->z.resize(count);
+	list->sizeX.resize(count);
+	list->sizeY.resize(count);
+	list->sizeZ.resize(count);
+	list->visible.resize((count + 31) / 32);
+}
+
+void FrustumCull(const Frustum& f, CullList* list) {
+	int count = (int)list->x.size();
+	if (count == 0) {
+		return;
+	}
+	FrustumAABBs(f, FRUSTUM_ALL_PLANES, &list->x[0], &list->y[0], &list->z[0], &list->sizeX[0], &list->sizeY[0], &list->sizeZ[0], count, &list->visible[0]);
+}
@@ -0,0 +1,47 @@
+#ifndef _H_FRUSTUM_CULL_
+#define _H_FRUSTUM_CULL_
+
+#include "Geometry3D.h"
+#include <vector>
+
+// Tests many world space boxes or spheres against a frustum at once. The
+// bounds are structure of arrays, so one load gets a component of 8 (AVX2)
+// or 4 (SSE) of them, and every plane is tested against all of them before
+// the next. Same rule as ClassifyPlanes: an entry is culled if it is behind
+// one of the planes in planeMask. Long lists are split over the workers.
+//
+// outVisible gets one bit per entry, (count + 31) / 32 words, bit i of
+// word i / 32 is set if entry i is visible. Bits past count are 0.
+
+#define FRUSTUM_CULL_PARALLEL 16384 // Shorter lists stay on the calling thread
+#define FRUSTUM_CULL_CHUNK 4096 // Fewest entries a thread takes at once, a multiple of 32
+
+inline bool IsCullVisible(const unsigned int* visible, int index) {
+	return ((visible[index >> 5] >> (index & 31)) & 1) != 0;
+}
+
+// x, y, z are the box centers and sizeX, sizeY, sizeZ the half extents
+void FrustumAABBs(const Frustum& f, int planeMask, const float* x, const float* y, const float* z, const float* sizeX, const float* sizeY, const float* sizeZ, int count, unsigned int* outVisible);
+void FrustumSpheres(const Frustum& f, int planeMask, const float* x, const float* y, const float* z, const float* radius, int count, unsigned int* outVisible);
+
+// The world boxes of a flat list of objects, kept between frames so culling
+// it allocates nothing once it has grown to size
+typedef struct CullList {
+	std::vector<float> x, y, z;
+	std::vector<float> sizeX, sizeY, sizeZ;
+	std::vector<unsigned int> visible;
+} CullList;
+
+void ResizeCullList(CullList* list, int count);
+inline void SetCullEntry(CullList* list, int index, const AABB& aabb) {
+	list->x[index] = aabb.position.x;
+	list->y[index] = aabb.position.y;
+	list->z[index] = aabb.position.z;
+	list->sizeX[index] = aabb.size.x;
+	list->sizeY[index] = aabb.size.y;
+	list->sizeZ[index] = aabb.size.z;
+}
+// Fills list->visible
+void FrustumCull(const Frustum& f, CullList* list);
+
+#endif
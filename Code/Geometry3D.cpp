@@ -2,6 +2,10 @@
 #include <cmath>
 #include <cfloat>
 #include <list>
+#include <algorithm>
+#include "Simd.h"
+#include "Threading.h"
+#include "TreeBuild.h"
 
 #define CMP(x, y) \
 	(fabsf(x - y) <= FLT_EPSILON * fmaxf(1.0f, fmaxf(fabsf(x), fabsf(y))))
@@ -152,12 +156,12 @@ Point ClosestPoint(const AABB& aabb, const Point& point) {
 	Point max = GetMax(aabb);
 
 	result.x = (result.x < min.x) ? min.x : result.x;
-	result.y = (result.y < min.x) ? min.y : result.y;
-	result.z = (result.z < min.x) ? min.z : result.z;
+	result.y = (result.y < min.y) ? min.y : result.y;
+	result.z = (result.z < min.z) ? min.z : result.z;
 
 	result.x = (result.x > max.x) ? max.x : result.x;
-	result.y = (result.y > max.x) ? max.y : result.y;
-	result.z = (result.z > max.x) ? max.z : result.z;
+	result.y = (result.y > max.y) ? max.y : result.y;
+	result.z = (result.z > max.z) ? max.z : result.z;
 
 	return result;
 }
@@ -701,6 +705,7 @@ void ResetRaycastResult(RaycastResult* outResult) {
 		outResult->hit = false;
 		outResult->normal = vec3(0, 0, 1);
 		outResult->point = vec3(0, 0, 0);
+		outResult->triangle = -1;
 	}
 }
 
@@ -1239,350 +1244,780 @@ bool Linetest(const Triangle& triangle, const Line& line) {
 	return t >= 0 && t * t <= LengthSq(line);
 }
 
-void AccelerateMesh(Mesh& mesh) {
-	if (mesh.accelerator != 0) {
-		return;
+// Triangle bounds and centroid, computed once per build. The records are
+// partitioned in place, so every node reads one contiguous range.
+struct BVHBuildTriangle {
+	vec3 min;
+	vec3 max;
+	vec3 centroid;
+	int index;
+};
+
+static inline float HalfSurfaceArea(const vec3& min, const vec3& max) {
+	vec3 d = max - min;
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+// Triangle and centroid bounds of a range, and its centroids binned along
+// all three axes. Ranges are combined with Add, min / max don't depend on
+// the order, so a range binned in chunks gives exactly the same bins.
+struct BVHBins {
+	vec3 nodeMin, nodeMax;
+	vec3 centroidMin, centroidMax;
+	int count[3][BVH_SAH_BINS];
+	vec3 min[3][BVH_SAH_BINS];
+	vec3 max[3][BVH_SAH_BINS];
+
+	void Reset() {
+		nodeMin = centroidMin = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+		nodeMax = centroidMax = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (int axis = 0; axis < 3; ++axis) {
+			for (int b = 0; b < BVH_SAH_BINS; ++b) {
+				count[axis][b] = 0;
+				min[axis][b] = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+				max[axis][b] = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+			}
+		}
 	}
 
-	vec3 min = mesh.vertices[0];
-	vec3 max = mesh.vertices[0];
-
-	for (int i = 1; i < mesh.numTriangles * 3; ++i) {
-		min.x = fminf(mesh.vertices[i].x, min.x);
-		min.y = fminf(mesh.vertices[i].y, min.y);
-		min.z = fminf(mesh.vertices[i].z, min.z);
-	
-		max.x = fmaxf(mesh.vertices[i].x, max.x);
-		max.y = fmaxf(mesh.vertices[i].y, max.y);
-		max.z = fmaxf(mesh.vertices[i].z, max.z);
+	void AddBounds(const BVHBins& other) {
+		GrowBounds(nodeMin, nodeMax, other.nodeMin, other.nodeMax);
+		GrowBounds(centroidMin, centroidMax, other.centroidMin, other.centroidMax);
 	}
 
-	mesh.accelerator = new BVHNode();
-	mesh.accelerator->bounds = FromMinMax(min, max);
-	mesh.accelerator->children = 0;
-	mesh.accelerator->numTriangles = mesh.numTriangles;
-	mesh.accelerator->triangles = new int[mesh.numTriangles];
-	for (int i = 0; i < mesh.numTriangles; ++i) {
-		mesh.accelerator->triangles[i] = i;
+	void AddBins(const BVHBins& other) {
+		for (int axis = 0; axis < 3; ++axis) {
+			for (int b = 0; b < BVH_SAH_BINS; ++b) {
+				count[axis][b] += other.count[axis][b];
+				GrowBounds(min[axis][b], max[axis][b], other.min[axis][b], other.max[axis][b]);
+			}
+		}
 	}
+};
 
-	SplitBVHNode(mesh.accelerator, mesh, 3);
+static void BoundBVHRange(const BVHBuildTriangle* triangles, int begin, int end, BVHBins* bins) {
+	for (int i = begin; i < end; ++i) {
+		GrowBounds(bins->nodeMin, bins->nodeMax, triangles[i].min, triangles[i].max);
+		GrowBounds(bins->centroidMin, bins->centroidMax, triangles[i].centroid, triangles[i].centroid);
+	}
 }
 
-void SplitBVHNode(BVHNode* node, const Mesh& model, int depth) {
-	if (depth-- <= 0) { // Decrements depth
-		return;
+static void BinBVHRange(const BVHBuildTriangle* triangles, int begin, int end, const vec3& centroidMin, const vec3& binScale, BVHBins* bins) {
+	for (int i = begin; i < end; ++i) {
+		const BVHBuildTriangle& t = triangles[i];
+		for (int axis = 0; axis < 3; ++axis) {
+			int b = (int)((t.centroid.asArray[axis] - centroidMin.asArray[axis]) * binScale.asArray[axis]);
+			b = (b < BVH_SAH_BINS) ? b : BVH_SAH_BINS - 1;
+			bins->count[axis][b] += 1;
+			GrowBounds(bins->min[axis][b], bins->max[axis][b], t.min, t.max);
+		}
 	}
+}
 
-	if (node->children == 0) {
-		// Only split if this node contains triangles
-		if (node->numTriangles > 0) {
-			node->children = new BVHNode[8];
-
-			vec3 c = node->bounds.position;
-			vec3 e = node->bounds.size *0.5f;
-
-			node->children[0].bounds = AABB(c + vec3(-e.x, +e.y, -e.z), e);
-			node->children[1].bounds = AABB(c + vec3(+e.x, +e.y, -e.z), e);
-			node->children[2].bounds = AABB(c + vec3(-e.x, +e.y, +e.z), e);
-			node->children[3].bounds = AABB(c + vec3(+e.x, +e.y, +e.z), e);
-			node->children[4].bounds = AABB(c + vec3(-e.x, -e.y, -e.z), e);
-			node->children[5].bounds = AABB(c + vec3(+e.x, -e.y, -e.z), e);
-			node->children[6].bounds = AABB(c + vec3(-e.x, -e.y, +e.z), e);
-			node->children[7].bounds = AABB(c + vec3(+e.x, -e.y, +e.z), e);
+// Finds the bounds of triangles [0, count) and their best split. The triangles are
+// partitioned in place, returns how many went left, or 0 if the range is a leaf.
+// Ranges of more than BVH_PARALLEL_CHUNK triangles are bounded and binned in
+// chunks on the worker threads.
+static int PartitionBVHRange(BVHBuildTriangle* triangles, int count, int depth, int maxLeafTriangles, vec3& nodeMin, vec3& nodeMax) {
+	int numChunks = (count + BVH_PARALLEL_CHUNK - 1) / BVH_PARALLEL_CHUNK;
+	BVHBins bins;
+	bins.Reset();
+	vec3 binScale;
 
+	if (numChunks <= 1) {
+		BoundBVHRange(triangles, 0, count, &bins);
+	}
+	else {
+		std::vector<BVHBins> chunks(numChunks);
+		ParallelFor(numChunks, 1, [&](int begin, int end) {
+			for (int c = begin; c < end; ++c) {
+				chunks[c].Reset();
+				BoundBVHRange(triangles, c * BVH_PARALLEL_CHUNK, std::min((c + 1) * BVH_PARALLEL_CHUNK, count), &chunks[c]);
+			}
+		});
+		for (int c = 0; c < numChunks; ++c) {
+			bins.AddBounds(chunks[c]);
 		}
 	}
-
-	// If this node was just split
-	if (node->children != 0 && node->numTriangles > 0) {
-		for (int i = 0; i < 8; ++i) { // For each child
-			// Count how many triangles each child will contain
-			node->children[i].numTriangles = 0;
-			for (int j = 0; j < node->numTriangles; ++j) {
-				Triangle t = model.triangles[node->triangles[j]];
-				if (TriangleAABB(t, node->children[i].bounds)) {
-					node->children[i].numTriangles += 1;
-				}
+	nodeMin = bins.nodeMin;
+	nodeMax = bins.nodeMax;
+	vec3 centroidMin = bins.centroidMin;
+	vec3 centroidMax = bins.centroidMax;
+
+	// Bin the centroids along all three axes in one pass
+	for (int axis = 0; axis < 3; ++axis) {
+		float extent = centroidMax.asArray[axis] - centroidMin.asArray[axis];
+		binScale.asArray[axis] = (extent > 0.0f) ? (float)BVH_SAH_BINS / extent : 0.0f;
+	}
+	if (count > 1 && numChunks <= 1) {
+		BinBVHRange(triangles, 0, count, centroidMin, binScale, &bins);
+	}
+	else if (count > 1) {
+		std::vector<BVHBins> chunks(numChunks);
+		ParallelFor(numChunks, 1, [&](int begin, int end) {
+			for (int c = begin; c < end; ++c) {
+				chunks[c].Reset();
+				BinBVHRange(triangles, c * BVH_PARALLEL_CHUNK, std::min((c + 1) * BVH_PARALLEL_CHUNK, count), centroidMin, binScale, &chunks[c]);
 			}
-			if (node->children[i].numTriangles == 0) {
+		});
+		for (int c = 0; c < numChunks; ++c) {
+			bins.AddBins(chunks[c]);
+		}
+	}
+	int bestAxis = -1;
+	int bestSplit = 0;
+	float bestCost = FLT_MAX;
+	for (int axis = 0; axis < 3 && count > 1; ++axis) {
+		if (binScale.asArray[axis] == 0.0f) {
+			continue;
+		}
+
+		// Sweep from the right to get the cost of every right side, then from the left
+		float rightArea[BVH_SAH_BINS];
+		int rightCount[BVH_SAH_BINS];
+		vec3 min(FLT_MAX, FLT_MAX, FLT_MAX), max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		int sum = 0;
+		for (int b = BVH_SAH_BINS - 1; b > 0; --b) {
+			GrowBounds(min, max, bins.min[axis][b], bins.max[axis][b]);
+			sum += bins.count[axis][b];
+			rightCount[b] = sum;
+			rightArea[b] = (sum > 0) ? HalfSurfaceArea(min, max) : 0.0f;
+		}
+
+		min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+		max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		sum = 0;
+		for (int b = 0; b < BVH_SAH_BINS - 1; ++b) {
+			GrowBounds(min, max, bins.min[axis][b], bins.max[axis][b]);
+			sum += bins.count[axis][b];
+			if (sum == 0 || rightCount[b + 1] == 0) {
 				continue;
 			}
-			node->children[i].triangles = new int[node->children[i].numTriangles];
-			int index = 0; // Add the triangles in the new child arrau
-			for (int j = 0; j < node->numTriangles; ++j) {
-				Triangle t = model.triangles[node->triangles[j]];
-				if (TriangleAABB(t, node->children[i].bounds)) {
-					node->children[i].triangles[index++] = node->triangles[j];
-				}
+			float cost = HalfSurfaceArea(min, max) * (float)sum + rightArea[b + 1] * (float)rightCount[b + 1];
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestSplit = b;
 			}
 		}
+	}
 
-		node->numTriangles = 0;
-		delete[] node->triangles;
-		node->triangles = 0;
+	// Cost relative to testing every triangle of this node, one traversal step = one triangle test.
+	// Nodes with more than maxLeafTriangles are always split.
+	float nodeArea = HalfSurfaceArea(nodeMin, nodeMax);
+	bool leaf = count <= 1;
+	if (!leaf && count <= maxLeafTriangles) {
+		leaf = bestAxis < 0 || nodeArea <= 0.0f || 1.0f + bestCost / nodeArea >= (float)count;
+	}
+	if (leaf) {
+		return 0;
+	}
 
-		// Recurse
-		for (int i = 0; i < 8; ++i) {
-			SplitBVHNode(&node->children[i], model, depth);
-		}
+	BVHBuildTriangle* middle = triangles + count / 2;
+	if (bestAxis >= 0 && depth < BVH_MAX_SAH_DEPTH) {
+		float scale = binScale.asArray[bestAxis];
+		float minCentroid = centroidMin.asArray[bestAxis];
+		middle = std::partition(triangles, triangles + count, [&](const BVHBuildTriangle& t) {
+			int b = (int)((t.centroid.asArray[bestAxis] - minCentroid) * scale);
+			return ((b < BVH_SAH_BINS) ? b : BVH_SAH_BINS - 1) <= bestSplit;
+		});
 	}
+	// else all centroids are the same point or the tree is too deep, split the list in half
+
+	return (int)(middle - triangles);
 }
 
-void FreeBVHNode(BVHNode* node) {
-	if (node->children != 0) {
-		for (int i = 0; i < 8; ++i) {
-			FreeBVHNode(&node->children[i]);
+// Splits triangles [0, count) into two children. Only leaves store triangle indices.
+static void SplitBVHRange(BVHNode* node, BVHBuildTriangle* triangles, int count, int depth, int maxLeafTriangles) {
+	vec3 min, max;
+	int leftCount = PartitionBVHRange(triangles, count, depth, maxLeafTriangles, min, max);
+	node->bounds = FromMinMax(min, max);
+
+	if (leftCount == 0) {
+		node->numTriangles = count;
+		node->triangles = new int[count];
+		for (int i = 0; i < count; ++i) {
+			node->triangles[i] = triangles[i].index;
 		}
-		delete[] node->children;
-		node->children = 0;
+		return;
 	}
 
-	if (node->numTriangles != 0 || node->triangles != 0) {
-		delete[] node->triangles;
-		node->triangles = 0;
-		node->numTriangles = 0;
+	node->children = new BVHNode[BVH_NUM_CHILDREN];
+	SplitBVHRange(&node->children[0], triangles, leftCount, depth + 1, maxLeafTriangles);
+	SplitBVHRange(&node->children[1], triangles + leftCount, count - leftCount, depth + 1, maxLeafTriangles);
+}
+
+// A subtree that BuildLinearBVHRange left for a worker thread
+struct BVHBuildTask {
+	int placeholder; // The node it replaces
+	int first;
+	int count;
+	int depth;
+	std::vector<LinearBVHNode> nodes;
+};
+
+// Same split as SplitBVHRange, but appends depth first LinearBVHNodes. Leaves
+// reference the build records, which are in leaf order once the build is done.
+// With tasks, ranges of at most taskSize triangles are left as a placeholder
+// node and a task, to be built on their own.
+static void BuildLinearBVHRange(std::vector<LinearBVHNode>& nodes, BVHBuildTriangle* triangles, int first, int count, int depth, int maxLeafTriangles, std::vector<BVHBuildTask>* tasks, int taskSize) {
+	int index = (int)nodes.size();
+	nodes.push_back(LinearBVHNode());
+
+	if (tasks != 0 && count <= taskSize) {
+		tasks->push_back(BVHBuildTask());
+		BVHBuildTask& task = tasks->back();
+		task.placeholder = index;
+		task.first = first;
+		task.count = count;
+		task.depth = depth;
+		return;
+	}
+
+	vec3 min, max;
+	int leftCount = PartitionBVHRange(triangles + first, count, depth, maxLeafTriangles, min, max);
+	nodes[index].min = min;
+	nodes[index].max = max;
+
+	if (leftCount == 0) {
+		nodes[index].numTriangles = count;
+		nodes[index].offset = first;
+		return;
 	}
+
+	BuildLinearBVHRange(nodes, triangles, first, leftCount, depth + 1, maxLeafTriangles, tasks, taskSize);
+	BuildLinearBVHRange(nodes, triangles, first + leftCount, count - leftCount, depth + 1, maxLeafTriangles, tasks, taskSize);
+	nodes[index].numTriangles = 0;
+	nodes[index].offset = (int)nodes.size();
 }
 
-bool MeshAABB(const Mesh& mesh, const AABB& aabb) {
-	if (mesh.accelerator == 0) {
-		for (int i = 0; i < mesh.numTriangles; ++i) {
-			if (TriangleAABB(mesh.triangles[i], aabb)) {
-				return true;
-			}
+// Builds the subtrees in parallel and puts them where their placeholders are,
+// so the nodes are in the same depth first order as a serial build.
+static void BuildLinearBVHTasks(std::vector<LinearBVHNode>& nodes, BVHBuildTriangle* triangles, int maxLeafTriangles, std::vector<BVHBuildTask>& tasks) {
+	ParallelFor((int)tasks.size(), 1, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			BVHBuildTask& task = tasks[i];
+			task.nodes.reserve(task.count * 2);
+			BuildLinearBVHRange(task.nodes, triangles, task.first, task.count, task.depth, maxLeafTriangles, 0, 0);
 		}
+	});
+
+	std::vector<int> shift;
+	SpliceBuildTasks(nodes, tasks, [](LinearBVHNode& node) {
+		return (node.numTriangles > 0) ? (int*)0 : &node.offset; // Leaves link to triangles
+	}, &shift);
+}
+
+static void GetBVHBuildTriangle(const Triangle& t, int index, BVHBuildTriangle* outRecord) {
+	outRecord->min = t.a;
+	outRecord->max = t.a;
+	GrowBounds(outRecord->min, outRecord->max, t.b, t.b);
+	GrowBounds(outRecord->min, outRecord->max, t.c, t.c);
+	outRecord->centroid = (outRecord->min + outRecord->max) * 0.5f;
+	outRecord->index = index;
+}
+
+void SplitBVHNode(BVHNode* node, const Mesh& model, int maxLeafTriangles) {
+	if (node->children != 0 || node->numTriangles == 0) {
+		return;
+	}
+
+	std::vector<BVHBuildTriangle> triangles(node->numTriangles);
+	for (int i = 0; i < node->numTriangles; ++i) {
+		GetBVHBuildTriangle(GetTriangle(model, node->triangles[i]), node->triangles[i], &triangles[i]);
+	}
+
+	delete[] node->triangles;
+	node->triangles = 0;
+	node->numTriangles = 0;
+	SplitBVHRange(node, &triangles[0], (int)triangles.size(), 0, (maxLeafTriangles < 1) ? 1 : maxLeafTriangles);
+}
+
+// Nodes are 32 bytes, aligned so no node straddles a cache line
+static LinearBVHNode* AllocateBVHNodes(int count) {
+#ifdef SIMD_SSE
+	return (LinearBVHNode*)_mm_malloc(sizeof(LinearBVHNode) * count, 64);
+#else
+	return new LinearBVHNode[count];
+#endif
+}
+
+static void FreeBVHNodes(LinearBVHNode* nodes) {
+#ifdef SIMD_SSE
+	_mm_free(nodes);
+#else
+	delete[] nodes;
+#endif
+}
+
+// Bounds of a compressed node are quantized inside its parent's decoded bounds,
+// scale is (max - min) / 254 of the parent, so the top code reaches a bit past
+// the parent max and rounding can't make a child smaller than it is.
+static inline vec3 GetQuantizationScale(const vec3& min, const vec3& max) {
+	return (max - min) * (1.0f / 254.0f);
+}
+
+static inline float DecodeBVHBound(float min, float scale, unsigned char q) {
+	return min + (float)q * scale;
+}
+
+// Children of an interior node, with their bounds, for the traversals that keep
+// a stack. A compressed node's bounds are only known once its parent is decoded.
+struct LinearBVHChildren {
+	const LinearBVHNode* nodes;
+
+	inline LinearBVHNode GetRoot() const {
+		return nodes[0];
+	}
+
+	inline void Get(int index, const LinearBVHNode&, int* left, LinearBVHNode* leftNode, int* right, LinearBVHNode* rightNode) const {
+		*left = index + 1;
+		*leftNode = nodes[*left];
+		*right = (leftNode->numTriangles > 0) ? *left + 1 : leftNode->offset;
+		*rightNode = nodes[*right];
+	}
+};
+
+struct CompressedBVHChildren {
+	const CompressedBVH* bvh;
+
+	inline void Decode(int index, const vec3& parentMin, const vec3& scale, LinearBVHNode* outNode) const {
+		const CompressedBVHNode& node = bvh->nodes[index];
+		outNode->min = vec3(DecodeBVHBound(parentMin.x, scale.x, node.min[0]), DecodeBVHBound(parentMin.y, scale.y, node.min[1]), DecodeBVHBound(parentMin.z, scale.z, node.min[2]));
+		outNode->max = vec3(DecodeBVHBound(parentMin.x, scale.x, node.max[0]), DecodeBVHBound(parentMin.y, scale.y, node.max[1]), DecodeBVHBound(parentMin.z, scale.z, node.max[2]));
+		outNode->numTriangles = node.numTriangles;
+		outNode->offset = (int)node.offset;
+	}
+
+	inline LinearBVHNode GetRoot() const {
+		LinearBVHNode root;
+		root.min = bvh->min;
+		root.max = bvh->max;
+		root.numTriangles = bvh->nodes[0].numTriangles;
+		root.offset = (int)bvh->nodes[0].offset;
+		return root;
+	}
+
+	inline void Get(int index, const LinearBVHNode& node, int* left, LinearBVHNode* leftNode, int* right, LinearBVHNode* rightNode) const {
+		vec3 scale = GetQuantizationScale(node.min, node.max);
+		*left = index + 1;
+		Decode(*left, node.min, scale, leftNode);
+		*right = (leftNode->numTriangles > 0) ? *left + 1 : leftNode->offset;
+		Decode(*right, node.min, scale, rightNode);
+	}
+};
+
+void AccelerateMesh(Mesh& mesh) {
+	AccelerateMesh(mesh, BVH_DEFAULT_LEAF_SIZE);
+}
+
+void AccelerateMesh(Mesh& mesh, int maxLeafTriangles) {
+	if (mesh.accelerator != 0 || mesh.compressed != 0 || mesh.numTriangles == 0) {
+		return;
+	}
+
+	std::vector<LinearBVHNode> nodes;
+	std::vector<int> order;
+	BuildLinearBVH(mesh, maxLeafTriangles, &nodes, &order);
+	AccelerateMesh(mesh, nodes, order);
+}
+
+// Builds the tree over build records that are already filled in
+static void BuildLinearBVH(std::vector<BVHBuildTriangle>& records, int maxLeafTriangles, std::vector<LinearBVHNode>* outNodes, std::vector<int>* outOrder) {
+	int numTriangles = (int)records.size();
+
+	// The top of the tree is split serially (binning in parallel), until the ranges
+	// are small enough for every worker to get several subtrees. Any task size
+	// builds the same tree, so the result doesn't depend on the thread count.
+	maxLeafTriangles = (maxLeafTriangles < 1) ? 1 : maxLeafTriangles;
+	int workers = GetWorkerCount();
+	if (workers <= 1 || numTriangles <= BVH_PARALLEL_CHUNK) {
+		outNodes->reserve(numTriangles * 2);
+		BuildLinearBVHRange(*outNodes, &records[0], 0, numTriangles, 0, maxLeafTriangles, 0, 0);
 	}
 	else {
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-
-		// Recursivley walk the BVH tree
-		while (!toProcess.empty()) {
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
-
-			if (iterator->numTriangles >= 0) {
-				// Iterate trough all triangles of the node
-				for (int i = 0; i < iterator->numTriangles; ++i) {
-					// Triangle indices in BVHNode index the mesh
-					if (TriangleAABB(mesh.triangles[iterator->triangles[i]], aabb)) {
-						return true;
-					}
-				}
-			}
+		int taskSize = std::max(numTriangles / (workers * 8), BVH_PARALLEL_CHUNK / 4);
+		std::vector<BVHBuildTask> tasks;
+		BuildLinearBVHRange(*outNodes, &records[0], 0, numTriangles, 0, maxLeafTriangles, &tasks, taskSize);
+		BuildLinearBVHTasks(*outNodes, &records[0], maxLeafTriangles, tasks);
+	}
 
-			if (iterator->children != 0) {
-				for (int i = 8 - 1; i >= 0; --i) {
-					// Only push children whos bounds intersect the test geometry
-					if (AABBAABB(iterator->children[i].bounds, aabb)) {
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
-			}
+	for (int i = 0; i < numTriangles; ++i) {
+		(*outOrder)[i] = records[i].index;
+	}
+}
+
+void BuildLinearBVH(const Triangle* triangles, int numTriangles, int maxLeafTriangles, std::vector<LinearBVHNode>* outNodes, std::vector<int>* outOrder) {
+	outNodes->clear();
+	outOrder->resize(numTriangles);
+	if (numTriangles == 0) {
+		return;
+	}
+
+	std::vector<BVHBuildTriangle> records(numTriangles);
+	ParallelFor(numTriangles, BVH_PARALLEL_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			GetBVHBuildTriangle(triangles[i], i, &records[i]);
 		}
+	});
+	BuildLinearBVH(records, maxLeafTriangles, outNodes, outOrder);
+}
+
+void BuildLinearBVH(const Mesh& mesh, int maxLeafTriangles, std::vector<LinearBVHNode>* outNodes, std::vector<int>* outOrder) {
+	outNodes->clear();
+	outOrder->resize(mesh.numTriangles);
+	if (mesh.numTriangles == 0) {
+		return;
 	}
-	return false;
+
+	std::vector<BVHBuildTriangle> records(mesh.numTriangles);
+	ParallelFor(mesh.numTriangles, BVH_PARALLEL_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			GetBVHBuildTriangle(GetTriangle(mesh, i), i, &records[i]);
+		}
+	});
+	BuildLinearBVH(records, maxLeafTriangles, outNodes, outOrder);
 }
 
-bool Linetest(const Mesh& mesh, const Line& line) {
-	if (mesh.accelerator == 0) {
+void AccelerateMesh(Mesh& mesh, const std::vector<LinearBVHNode>& nodes, const std::vector<int>& order) {
+	FreeAccelerator(mesh);
+	if (nodes.size() == 0 || (int)order.size() != mesh.numTriangles) {
+		return;
+	}
+
+	// Move the triangles into leaf order, leaves reference contiguous ranges
+	if (IsIndexed(mesh)) {
+		std::vector<unsigned int> sorted(mesh.numTriangles * 3);
 		for (int i = 0; i < mesh.numTriangles; ++i) {
-			if (Linetest(mesh.triangles[i], line)) {
-				return true;
+			for (int j = 0; j < 3; ++j) {
+				sorted[i * 3 + j] = mesh.indices[order[i] * 3 + j];
 			}
 		}
+		std::copy(sorted.begin(), sorted.end(), mesh.indices);
 	}
 	else {
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-
-		// Recursivley walk the BVH tree
-		while (!toProcess.empty()) {
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
-
-			if (iterator->numTriangles >= 0) {
-				// Iterate trough all triangles of the node
-				for (int i = 0; i < iterator->numTriangles; ++i) {
-					// Triangle indices in BVHNode index the mesh
-					if (Linetest(mesh.triangles[iterator->triangles[i]], line)) {
-						return true;
-					}
-				}
-			}
-
-			if (iterator->children != 0) {
-				for (int i = 8 - 1; i >= 0; --i) {
-					// Only push children whos bounds intersect the test geometry
-					if (Linetest(iterator->children[i].bounds, line)) {
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
-			}
+		std::vector<Triangle> sorted(mesh.numTriangles);
+		for (int i = 0; i < mesh.numTriangles; ++i) {
+			sorted[i] = mesh.triangles[order[i]];
 		}
+		std::copy(sorted.begin(), sorted.end(), mesh.triangles);
+	}
+
+	mesh.numNodes = (int)nodes.size();
+	mesh.accelerator = AllocateBVHNodes(mesh.numNodes);
+	for (int i = 0; i < mesh.numNodes; ++i) {
+		mesh.accelerator[i] = nodes[i];
 	}
-	return false;
 }
 
-bool MeshSphere(const Mesh& mesh, const Sphere& sphere) {
+// Children come after their parent in the array, so walking it backwards
+// visits every node after its children.
+float RefitMesh(Mesh& mesh) {
 	if (mesh.accelerator == 0) {
-		for (int i = 0; i < mesh.numTriangles; ++i) {
-			if (TriangleSphere(mesh.triangles[i], sphere)) {
-				return true;
+		return 0.0f;
+	}
+
+	for (int i = mesh.numNodes - 1; i >= 0; --i) {
+		LinearBVHNode& node = mesh.accelerator[i];
+		if (node.numTriangles > 0) {
+			node.min = GetTriangle(mesh, node.offset).a;
+			node.max = node.min;
+			for (int j = node.offset; j < node.offset + node.numTriangles; ++j) {
+				Triangle t = GetTriangle(mesh, j);
+				GrowBounds(node.min, node.max, t.a, t.a);
+				GrowBounds(node.min, node.max, t.b, t.b);
+				GrowBounds(node.min, node.max, t.c, t.c);
 			}
 		}
+		else {
+			const LinearBVHNode& left = mesh.accelerator[i + 1];
+			const LinearBVHNode& right = mesh.accelerator[(left.numTriangles > 0) ? i + 2 : left.offset];
+			node.min = left.min;
+			node.max = left.max;
+			GrowBounds(node.min, node.max, right.min, right.max);
+		}
 	}
-	else {
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-
-		// Recursivley walk the BVH tree
-		while (!toProcess.empty()) {
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
-
-			if (iterator->numTriangles >= 0) {
-				// Iterate trough all triangles of the node
-				for (int i = 0; i < iterator->numTriangles; ++i) {
-					// Triangle indices in BVHNode index the mesh
-					if (TriangleSphere(mesh.triangles[iterator->triangles[i]], sphere)) {
-						return true;
-					}
-				}
-			}
 
-			if (iterator->children != 0) {
-				for (int i = 8 - 1; i >= 0; --i) {
-					// Only push children whos bounds intersect the test geometry
-					if (SphereAABB(sphere, iterator->children[i].bounds)) {
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
+	return GetBVHCost(mesh);
+}
+
+float GetBVHCost(const Mesh& mesh) {
+	if (mesh.accelerator == 0) {
+		return (float)mesh.numTriangles;
+	}
+
+	float rootArea = HalfSurfaceArea(mesh.accelerator[0].min, mesh.accelerator[0].max);
+	if (rootArea <= 0.0f) {
+		return (float)mesh.numTriangles;
+	}
+
+	// Same costs as the builder, one traversal step = one triangle test
+	float cost = 0.0f;
+	for (int i = 0; i < mesh.numNodes; ++i) {
+		const LinearBVHNode& node = mesh.accelerator[i];
+		float area = HalfSurfaceArea(node.min, node.max);
+		cost += area * (float)((node.numTriangles > 0) ? node.numTriangles : 1);
+	}
+	return cost / rootArea;
+}
+
+void FreeAccelerator(Mesh& mesh) {
+	if (mesh.accelerator != 0) {
+		FreeBVHNodes(mesh.accelerator);
+	}
+	mesh.accelerator = 0;
+	mesh.numNodes = 0;
+
+	if (mesh.compressed != 0) {
+		delete[] mesh.compressed->nodes;
+		delete mesh.compressed;
+	}
+	mesh.compressed = 0;
+}
+
+// Smallest quantized box that still contains [min, max], inside the decoded
+// parent box. The margin covers decoding that rounds differently.
+static void QuantizeBVHBounds(const vec3& parentMin, const vec3& scale, const vec3& min, const vec3& max, CompressedBVHNode* outNode) {
+	for (int axis = 0; axis < 3; ++axis) {
+		float origin = parentMin.asArray[axis];
+		float s = scale.asArray[axis];
+		float margin = s * 0.001f;
+		int qMin = 0, qMax = 255;
+		if (s > 0.0f) {
+			qMin = std::max(0, std::min(255, (int)floorf((min.asArray[axis] - origin) / s)));
+			qMax = std::max(0, std::min(255, (int)ceilf((max.asArray[axis] - origin) / s)));
+			while (qMin > 0 && DecodeBVHBound(origin, s, (unsigned char)qMin) > min.asArray[axis] - margin) {
+				qMin -= 1;
+			}
+			while (qMax < 255 && DecodeBVHBound(origin, s, (unsigned char)qMax) < max.asArray[axis] + margin) {
+				qMax += 1;
 			}
 		}
+		outNode->min[axis] = (unsigned char)qMin;
+		outNode->max[axis] = (unsigned char)qMax;
 	}
-	return false;
 }
 
-bool MeshOBB(const Mesh& mesh, const OBB& obb) {
+bool CompressAccelerator(Mesh& mesh) {
 	if (mesh.accelerator == 0) {
-		for (int i = 0; i < mesh.numTriangles; ++i) {
-			if (TriangleOBB(mesh.triangles[i], obb)) {
-				return true;
-			}
+		return mesh.compressed != 0;
+	}
+	// CompressedBVHNode counts triangles in 16 bits, larger leaves stay uncompressed
+	for (int i = 0; i < mesh.numNodes; ++i) {
+		if (mesh.accelerator[i].numTriangles > BVH_MAX_COMPRESSED_LEAF) {
+			return false;
 		}
 	}
-	else {
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-
-		// Recursivley walk the BVH tree
-		while (!toProcess.empty()) {
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
-
-			if (iterator->numTriangles >= 0) {
-				// Iterate trough all triangles of the node
-				for (int i = 0; i < iterator->numTriangles; ++i) {
-					// Triangle indices in BVHNode index the mesh
-					if (TriangleOBB(mesh.triangles[iterator->triangles[i]], obb)) {
-						return true;
-					}
-				}
-			}
 
-			if (iterator->children != 0) {
-				for (int i = 8 - 1; i >= 0; --i) {
-					// Only push children whos bounds intersect the test geometry
-					if (AABBOBB(iterator->children[i].bounds, obb)) {
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
-			}
+	CompressedBVH* bvh = new CompressedBVH();
+	bvh->min = mesh.accelerator[0].min;
+	bvh->max = mesh.accelerator[0].max;
+	bvh->numNodes = mesh.numNodes;
+	bvh->nodes = new CompressedBVHNode[mesh.numNodes];
+
+	// Parents come before their children, so every node is quantized inside the
+	// bounds its parent decodes to, which is what the traversal will see
+	std::vector<LinearBVHNode> decoded(mesh.numNodes);
+	decoded[0] = mesh.accelerator[0];
+	CompressedBVHChildren children = { bvh };
+	for (int i = 0; i < mesh.numNodes; ++i) {
+		const LinearBVHNode& node = mesh.accelerator[i];
+		CompressedBVHNode& compressed = bvh->nodes[i];
+		compressed.numTriangles = (unsigned short)node.numTriangles;
+		compressed.offset = (unsigned int)node.offset;
+		if (i == 0) {
+			compressed.min[0] = compressed.min[1] = compressed.min[2] = 0;
+			compressed.max[0] = compressed.max[1] = compressed.max[2] = 255;
+		}
+		if (node.numTriangles > 0) {
+			continue;
 		}
+
+		int left = i + 1;
+		int right = (mesh.accelerator[left].numTriangles > 0) ? left + 1 : mesh.accelerator[left].offset;
+		vec3 scale = GetQuantizationScale(decoded[i].min, decoded[i].max);
+		QuantizeBVHBounds(decoded[i].min, scale, mesh.accelerator[left].min, mesh.accelerator[left].max, &bvh->nodes[left]);
+		QuantizeBVHBounds(decoded[i].min, scale, mesh.accelerator[right].min, mesh.accelerator[right].max, &bvh->nodes[right]);
+		bvh->nodes[left].numTriangles = (unsigned short)mesh.accelerator[left].numTriangles;
+		bvh->nodes[left].offset = (unsigned int)mesh.accelerator[left].offset;
+		bvh->nodes[right].numTriangles = (unsigned short)mesh.accelerator[right].numTriangles;
+		bvh->nodes[right].offset = (unsigned int)mesh.accelerator[right].offset;
+		children.Decode(left, decoded[i].min, scale, &decoded[left]);
+		children.Decode(right, decoded[i].min, scale, &decoded[right]);
+	}
+
+	FreeBVHNodes(mesh.accelerator);
+	mesh.accelerator = 0;
+	mesh.compressed = bvh;
+	return true;
+}
+
+void FreeBVHNode(BVHNode* node) {
+	if (node->children != 0) {
+		for (int i = 0; i < BVH_NUM_CHILDREN; ++i) {
+			FreeBVHNode(&node->children[i]);
+		}
+		delete[] node->children;
+		node->children = 0;
+	}
+
+	if (node->numTriangles != 0 || node->triangles != 0) {
+		delete[] node->triangles;
+		node->triangles = 0;
+		node->numTriangles = 0;
 	}
-	return false;
 }
 
-bool MeshPlane(const Mesh& mesh, const Plane& plane) {
-	if (mesh.accelerator == 0) {
-		for (int i = 0; i < mesh.numTriangles; ++i) {
-			if (TrianglePlane(mesh.triangles[i], plane)) {
-				return true;
-			}
+// Triangles [first, first + count), the test gets every triangle and its index
+template<typename TriangleTest>
+static inline bool AnyTriangle(const Mesh& mesh, int first, int count, TriangleTest triangleTest) {
+	for (int j = first; j < first + count; ++j) {
+		if (triangleTest(GetTriangle(mesh, j), j)) {
+			return true;
 		}
 	}
-	else {
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-
-		// Recursivley walk the BVH tree
-		while (!toProcess.empty()) {
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
-
-			if (iterator->numTriangles >= 0) {
-				// Iterate trough all triangles of the node
-				for (int i = 0; i < iterator->numTriangles; ++i) {
-					// Triangle indices in BVHNode index the mesh
-					if (TrianglePlane(mesh.triangles[iterator->triangles[i]], plane)) {
-						return true;
-					}
-				}
-			}
+	return false;
+}
 
-			if (iterator->children != 0) {
-				for (int i = 8 - 1; i >= 0; --i) {
-					// Only push children whos bounds intersect the test geometry
-					if (AABBPlane(iterator->children[i].bounds, plane)) {
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
+// Depth first walk with a stack of decoded nodes
+template<typename Children, typename BoundsTest, typename TriangleTest>
+static bool MeshAnyTriangleStack(const Mesh& mesh, const Children& children, BoundsTest boundsTest, TriangleTest triangleTest) {
+	int stack[BVH_STACK_SIZE];
+	LinearBVHNode stackNode[BVH_STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize] = 0;
+	stackNode[stackSize++] = children.GetRoot();
+
+	while (stackSize > 0) {
+		stackSize -= 1;
+		int i = stack[stackSize];
+		LinearBVHNode node = stackNode[stackSize];
+		if (!boundsTest(node)) {
+			continue;
+		}
+		if (node.numTriangles > 0) {
+			if (AnyTriangle(mesh, node.offset, node.numTriangles, triangleTest)) {
+				return true;
 			}
+			continue;
 		}
+
+		// Right first, so the left child is visited first like the stackless walk
+		int left, right;
+		LinearBVHNode leftNode, rightNode;
+		children.Get(i, node, &left, &leftNode, &right, &rightNode);
+		stack[stackSize] = right;
+		stackNode[stackSize++] = rightNode;
+		stack[stackSize] = left;
+		stackNode[stackSize++] = leftNode;
 	}
 	return false;
 }
 
-bool MeshTriangle(const Mesh& mesh, const Triangle& triangle) {
+// Stackless walk of the flattened tree, nodes are visited depth first. A node
+// that misses (or a leaf that was tested) continues at the node after its
+// subtree, which is the next node for leaves and offset for interior nodes.
+template<typename BoundsTest, typename TriangleTest>
+static bool MeshAnyTriangle(const Mesh& mesh, BoundsTest boundsTest, TriangleTest triangleTest) {
+	if (mesh.compressed != 0) {
+		CompressedBVHChildren children = { mesh.compressed };
+		return MeshAnyTriangleStack(mesh, children, boundsTest, triangleTest);
+	}
 	if (mesh.accelerator == 0) {
-		for (int i = 0; i < mesh.numTriangles; ++i) {
-			if (TriangleTriangle(mesh.triangles[i], triangle)) {
-				return true;
-			}
+		return AnyTriangle(mesh, 0, mesh.numTriangles, triangleTest);
+	}
+
+	int i = 0;
+	while (i < mesh.numNodes) {
+		const LinearBVHNode& node = mesh.accelerator[i];
+		if (!boundsTest(node)) {
+			i = (node.numTriangles > 0) ? i + 1 : node.offset;
+			continue;
 		}
+		if (node.numTriangles > 0 && AnyTriangle(mesh, node.offset, node.numTriangles, triangleTest)) {
+			return true;
+		}
+		i += 1; // Leaf: next subtree, interior node: left child
 	}
-	else {
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-
-		// Recursivley walk the BVH tree
-		while (!toProcess.empty()) {
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
-
-			if (iterator->numTriangles >= 0) {
-				// Iterate trough all triangles of the node
-				for (int i = 0; i < iterator->numTriangles; ++i) {
-					// Triangle indices in BVHNode index the mesh
-					if (TriangleTriangle(mesh.triangles[iterator->triangles[i]], triangle)) {
-						return true;
-					}
-				}
-			}
+	return false;
+}
 
-			if (iterator->children != 0) {
-				for (int i = 8 - 1; i >= 0; --i) {
-					// Only push children whos bounds intersect the test geometry
-					if (TriangleAABB(triangle, iterator->children[i].bounds)) {
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
+bool MeshAABB(const Mesh& mesh, const AABB& aabb) {
+	vec3 min = GetMin(aabb);
+	vec3 max = GetMax(aabb);
+	return MeshAnyTriangle(mesh,
+		[&](const LinearBVHNode& node) { return BoundsOverlap(node, min, max); },
+		[&](const Triangle& t, int) { return TriangleAABB(t, aabb); });
+}
+
+bool Linetest(const Mesh& mesh, const Line& line) {
+	Ray ray(line.start, line.end - line.start);
+	vec3 invDirection = GetInverseDirection(ray);
+	float length = Length(line);
+	float entry;
+	return MeshAnyTriangle(mesh,
+		[&](const LinearBVHNode& node) { return RayBounds(node, ray.origin, invDirection, length, &entry); },
+		[&](const Triangle& t, int) { return Linetest(t, line); });
+}
+
+bool MeshSphere(const Mesh& mesh, const Sphere& sphere) {
+	float radiusSq = sphere.radius * sphere.radius;
+	return MeshAnyTriangle(mesh,
+		[&](const LinearBVHNode& node) {
+			float distSq = 0.0f; // From the sphere center to the closest point of the node
+			for (int i = 0; i < 3; ++i) {
+				float p = sphere.position.asArray[i];
+				float d = fmaxf(fmaxf(node.min.asArray[i] - p, p - node.max.asArray[i]), 0.0f);
+				distSq += d * d;
 			}
+			return distSq <= radiusSq;
+		},
+		[&](const Triangle& t, int) { return TriangleSphere(t, sphere); });
+}
+
+bool MeshOBB(const Mesh& mesh, const OBB& obb) {
+	return MeshAnyTriangle(mesh,
+		[&](const LinearBVHNode& node) { return AABBOBB(FromMinMax(node.min, node.max), obb); },
+		[&](const Triangle& t, int) { return TriangleOBB(t, obb); });
+}
+
+bool MeshPlane(const Mesh& mesh, const Plane& plane) {
+	return MeshAnyTriangle(mesh,
+		[&](const LinearBVHNode& node) { return AABBPlane(FromMinMax(node.min, node.max), plane); },
+		[&](const Triangle& t, int) { return TrianglePlane(t, plane); });
+}
+
+bool MeshTriangle(const Mesh& mesh, const Triangle& triangle) {
+	vec3 min = triangle.a, max = triangle.a;
+	GrowBounds(min, max, triangle.b, triangle.b);
+	GrowBounds(min, max, triangle.c, triangle.c);
+	return MeshAnyTriangle(mesh,
+		[&](const LinearBVHNode& node) { return BoundsOverlap(node, min, max) && TriangleAABB(triangle, FromMinMax(node.min, node.max)); },
+		[&](const Triangle& t, int) { return TriangleTriangle(t, triangle); });
+}
+
+static bool TriangleBoundsAABB(const Triangle& t, const vec3& min, const vec3& max) {
+	for (int i = 0; i < 3; ++i) {
+		float tMin = fminf(t.a.asArray[i], fminf(t.b.asArray[i], t.c.asArray[i]));
+		float tMax = fmaxf(t.a.asArray[i], fmaxf(t.b.asArray[i], t.c.asArray[i]));
+		if (tMax < min.asArray[i] || tMin > max.asArray[i]) {
+			return false;
 		}
 	}
-	return false;
+	return true;
+}
+
+void MeshQueryTriangles(const Mesh& mesh, const AABB& aabb, std::vector<int>* outTriangles) {
+	vec3 min = GetMin(aabb);
+	vec3 max = GetMax(aabb);
+	MeshAnyTriangle(mesh,
+		[&](const LinearBVHNode& node) { return BoundsOverlap(node, min, max); },
+		[&](const Triangle& t, int index) {
+			if (TriangleBoundsAABB(t, min, max)) {
+				outTriangles->push_back(index);
+			}
+			return false; // Keep going, every triangle is wanted
+		});
 }
 
 float Raycast(const Mesh& mesh, const Ray& ray) {
@@ -1594,51 +2029,105 @@ float Raycast(const Model& mesh, const Ray& ray) {
 }
 
 float MeshRay(const Mesh& mesh, const Ray& ray) {
-	if (mesh.accelerator == 0) {
-		for (int i = 0; i < mesh.numTriangles; ++i) {
-			RaycastResult raycast;
-			Raycast(mesh.triangles[i], ray, &raycast);
-			float result = raycast.t;
-			if (result >= 0) {
-				return result;
-			}
+	RaycastResult result;
+	MeshRay(mesh, ray, &result);
+	return result.t;
+}
+
+static inline void RaycastTriangles(const Mesh& mesh, int first, int count, const Ray& ray, RaycastResult* closest, float* closestT) {
+	for (int j = first; j < first + count; ++j) {
+		RaycastResult raycast;
+		if (Raycast(GetTriangle(mesh, j), ray, &raycast) && raycast.t < *closestT) {
+			*closest = raycast;
+			closest->triangle = j;
+			*closestT = raycast.t;
 		}
 	}
-	else {
-		std::list<BVHNode*> toProcess;
-		toProcess.push_front(mesh.accelerator);
-
-		// Recursivley walk the BVH tree
-		while (!toProcess.empty()) {
-			BVHNode* iterator = *(toProcess.begin());
-			toProcess.erase(toProcess.begin());
-
-			if (iterator->numTriangles >= 0) {
-				// Iterate trough all triangles of the node
-				for (int i = 0; i < iterator->numTriangles; ++i) {
-					// Triangle indices in BVHNode index the mesh
-					RaycastResult raycast;
-					Raycast(mesh.triangles[iterator->triangles[i]], ray, &raycast);
-					float r = raycast.t;
-					if (r >= 0) {
-						return r;
-					}
-				}
+}
+
+// Visits the closer child first, the other one only if it starts before the closest hit
+template<typename Children>
+static void MeshRayTree(const Mesh& mesh, const Children& children, const Ray& ray, RaycastResult* closest, float* closestT) {
+	vec3 invDirection = GetInverseDirection(ray);
+	float entry;
+	// Far children that still have to be visited, and where the ray enters them
+	int stack[BVH_STACK_SIZE];
+	LinearBVHNode stackNode[BVH_STACK_SIZE];
+	float stackEntry[BVH_STACK_SIZE];
+	int stackSize = 0;
+
+	LinearBVHNode node = children.GetRoot();
+	int i = RayBounds(node, ray.origin, invDirection, *closestT, &entry) ? 0 : -1;
+	while (i >= 0) {
+		if (node.numTriangles > 0) {
+			RaycastTriangles(mesh, node.offset, node.numTriangles, ray, closest, closestT);
+			i = -1;
+		}
+		else {
+			int left, right;
+			LinearBVHNode leftNode, rightNode;
+			children.Get(i, node, &left, &leftNode, &right, &rightNode);
+			float leftEntry, rightEntry;
+			bool hitLeft = RayBounds(leftNode, ray.origin, invDirection, *closestT, &leftEntry);
+			bool hitRight = RayBounds(rightNode, ray.origin, invDirection, *closestT, &rightEntry);
+
+			if (hitLeft && hitRight) {
+				bool leftFirst = leftEntry <= rightEntry;
+				stack[stackSize] = leftFirst ? right : left;
+				stackNode[stackSize] = leftFirst ? rightNode : leftNode;
+				stackEntry[stackSize++] = leftFirst ? rightEntry : leftEntry;
+				i = leftFirst ? left : right;
+				node = leftFirst ? leftNode : rightNode;
+			}
+			else {
+				i = hitLeft ? left : (hitRight ? right : -1);
+				node = hitLeft ? leftNode : rightNode;
 			}
+		}
 
-			if (iterator->children != 0) {
-				for (int i = 8 - 1; i >= 0; --i) {
-					// Only push children whos bounds intersect the test geometry
-					RaycastResult raycast;
-					Raycast(iterator->children[i].bounds, ray, &raycast);
-					if (raycast.t >= 0) {
-						toProcess.push_front(&iterator->children[i]);
-					}
-				}
+		while (i < 0 && stackSize > 0) {
+			stackSize -= 1;
+			if (stackEntry[stackSize] <= *closestT) {
+				i = stack[stackSize];
+				node = stackNode[stackSize];
 			}
 		}
 	}
-	return -1;
+}
+
+bool MeshRay(const Mesh& mesh, const Ray& ray, RaycastResult* outResult) {
+	ResetRaycastResult(outResult);
+	RaycastResult closest;
+	ResetRaycastResult(&closest);
+	float closestT = FLT_MAX;
+
+	if (mesh.compressed != 0) {
+		CompressedBVHChildren children = { mesh.compressed };
+		MeshRayTree(mesh, children, ray, &closest, &closestT);
+	}
+	else if (mesh.accelerator != 0) {
+		LinearBVHChildren children = { mesh.accelerator };
+		MeshRayTree(mesh, children, ray, &closest, &closestT);
+	}
+	else {
+		RaycastTriangles(mesh, 0, mesh.numTriangles, ray, &closest, &closestT);
+	}
+
+	if (closest.hit && outResult != 0) {
+		*outResult = closest;
+	}
+	return closest.hit;
+}
+
+bool MeshRayAny(const Mesh& mesh, const Ray& ray, float maxT) {
+	vec3 invDirection = GetInverseDirection(ray);
+	float entry;
+	return MeshAnyTriangle(mesh,
+		[&](const LinearBVHNode& node) { return RayBounds(node, ray.origin, invDirection, maxT, &entry); },
+		[&](const Triangle& t, int) {
+			RaycastResult raycast;
+			return Raycast(t, ray, &raycast) && raycast.t <= maxT;
+		});
 }
 
 bool TrianglePlane(const Triangle& t, const Plane& p) {
@@ -1667,26 +2156,92 @@ bool TrianglePlane(const Triangle& t, const Plane& p) {
 void Model::SetContent(Mesh* mesh) {
 	content = mesh;
 	if (content != 0) {
-		vec3 min = mesh->vertices[0];
-		vec3 max = mesh->vertices[0];
-
-		for (int i = 1; i < mesh->numTriangles * 3; ++i) {
-			min.x = fminf(mesh->vertices[i].x, min.x);
-			min.y = fminf(mesh->vertices[i].y, min.y);
-			min.z = fminf(mesh->vertices[i].z, min.z);
-
-			max.x = fmaxf(mesh->vertices[i].x, max.x);
-			max.y = fmaxf(mesh->vertices[i].y, max.y);
-			max.z = fmaxf(mesh->vertices[i].z, max.z);
+		// Every vertex of an indexed mesh is stored once
+		const Point* vertices = IsIndexed(*mesh) ? mesh->positions : mesh->vertices;
+		int numVertices = IsIndexed(*mesh) ? mesh->numPositions : mesh->numTriangles * 3;
+		vec3 min = vertices[0];
+		vec3 max = vertices[0];
+
+		for (int i = 1; i < numVertices; ++i) {
+			min.x = fminf(vertices[i].x, min.x);
+			min.y = fminf(vertices[i].y, min.y);
+			min.z = fminf(vertices[i].z, min.z);
+
+			max.x = fmaxf(vertices[i].x, max.x);
+			max.y = fmaxf(vertices[i].y, max.y);
+			max.z = fmaxf(vertices[i].z, max.z);
 		}
 		bounds = FromMinMax(min, max);
 	}
+	cached = false;
 }
 
-mat4 GetWorldMatrix(const Model& model) {
+// Exact, a model that moved by less than the epsilon still moved
+static bool IsSameVector(const vec3& a, const vec3& b) {
+	return a.x == b.x && a.y == b.y && a.z == b.z;
+}
+
+bool Model::IsWorldCached() const {
+	if (!cached || parent != cachedParent || !IsSameVector(position, cachedPosition) || !IsSameVector(rotation, cachedRotation)) {
+		return false;
+	}
+	return parent == 0 || (parent->version == cachedParentVersion && parent->IsWorldCached());
+}
+
+static mat4 GetLocalMatrix(const Model& model) {
 	mat4 translation = Translation(model.position);
 	mat4 rotation = Rotation(model.rotation.x, model.rotation.y, model.rotation.z);
-	mat4 localMat = /* Scale * */ rotation * translation;
+	return /* Scale * */ rotation * translation;
+}
+
+// World space box around an OBB
+static AABB GetWorldAABB(const OBB& obb) {
+	const float* o = obb.orientation.asArray;
+	vec3 extents;
+	for (int i = 0; i < 3; ++i) {
+		extents.asArray[i] = fabsf(o[0 * 3 + i]) * obb.size.x +
+			fabsf(o[1 * 3 + i]) * obb.size.y +
+			fabsf(o[2 * 3 + i]) * obb.size.z;
+	}
+	return AABB(obb.position, extents);
+}
+
+static OBB GetOBB(const AABB& aabb, const mat4& world) {
+	OBB obb;
+	obb.size = aabb.size;
+	obb.position = MultiplyPoint(aabb.position, world);
+	obb.orientation = Cut(world, 3, 3);
+	return obb;
+}
+
+bool Model::UpdateWorldCache() {
+	if (IsWorldCached()) {
+		return false;
+	}
+
+	mat4 parentMat;
+	if (parent != 0) {
+		parent->UpdateWorldCache();
+		parentMat = parent->world;
+		cachedParentVersion = parent->version;
+	}
+	world = GetLocalMatrix(*this) * parentMat;
+	worldBounds = GetWorldAABB(::GetOBB(bounds, world));
+
+	cachedPosition = position;
+	cachedRotation = rotation;
+	cachedParent = parent;
+	cached = true;
+	++version;
+	return true;
+}
+
+mat4 GetWorldMatrix(const Model& model) {
+	if (model.IsWorldCached()) {
+		return model.GetCachedWorldMatrix();
+	}
+
+	mat4 localMat = GetLocalMatrix(model);
 	
 	mat4 parentMat;
 	if (model.parent != 0) {
@@ -1697,15 +2252,14 @@ mat4 GetWorldMatrix(const Model& model) {
 }
 
 OBB GetOBB(const Model& model) {
-	mat4 world = GetWorldMatrix(model);
-	AABB aabb = model.GetBounds();
-	OBB obb;
-
-	obb.size = aabb.size;
-	obb.position = MultiplyPoint(aabb.position, world);
-	obb.orientation = Cut(world, 3, 3);
+	return GetOBB(model.GetBounds(), GetWorldMatrix(model));
+}
 
-	return obb;
+AABB GetWorldAABB(const Model& model) {
+	if (model.IsWorldCached()) {
+		return model.GetCachedWorldBounds();
+	}
+	return GetWorldAABB(GetOBB(model));
 }
 
 float ModelRay(const Model& model, const Ray& ray) {
@@ -1721,6 +2275,34 @@ float ModelRay(const Model& model, const Ray& ray) {
 	return -1;
 }
 
+bool ModelRay(const Model& model, const Ray& ray, RaycastResult* outResult) {
+	ResetRaycastResult(outResult);
+	if (model.GetMesh() == 0) {
+		return false;
+	}
+
+	mat4 world = GetWorldMatrix(model);
+	mat4 inv = Inverse(world);
+	Ray local;
+	local.origin = MultiplyPoint(ray.origin, inv);
+	local.direction = MultiplyVector(ray.direction, inv);
+	local.NormalizeDirection();
+
+	RaycastResult raycast;
+	if (!MeshRay(*(model.GetMesh()), local, &raycast)) {
+		return false;
+	}
+
+	// Back to world space, the world matrix has no scale
+	if (outResult != 0) {
+		*outResult = raycast;
+		outResult->point = MultiplyPoint(raycast.point, world);
+		outResult->normal = Normalized(MultiplyVector(raycast.normal, world));
+		outResult->t = Magnitude(outResult->point - ray.origin);
+	}
+	return true;
+}
+
 bool Linetest(const Model& model, const Line& line) {
 	mat4 world = GetWorldMatrix(model);
 	mat4 inv = Inverse(world);
@@ -1904,8 +2486,18 @@ float Classify(const AABB& aabb, const Plane& plane) {
 	return d - r;
 }
 
+// The normal along the axes of the box, the rows of its orientation
+static inline vec3 GetLocalNormal(const OBB& obb, const vec3& normal) {
+	const float* o = obb.orientation.asArray;
+	return vec3(
+		Dot(normal, vec3(o[0], o[1], o[2])),
+		Dot(normal, vec3(o[3], o[4], o[5])),
+		Dot(normal, vec3(o[6], o[7], o[8]))
+	);
+}
+
 float Classify(const OBB& obb, const Plane& plane) {
-	vec3 normal = MultiplyVector(plane.normal, obb.orientation);
+	vec3 normal = GetLocalNormal(obb, plane.normal);
 
 	// maximum extent in direction of plane normal 
 	float r = fabsf(obb.size.x * normal.x)
@@ -1946,6 +2538,69 @@ bool Intersects(const Frustum& f, const AABB& aabb) {
 	return true;
 }
 
+// -1 behind the plane, 0 in front of it, 1 crossing it. Touching is not
+// behind, like Classify. r is the extent of the box along the normal.
+static inline int ClassifyPlane(float d, float r) {
+	if (d < -r) {
+		return -1;
+	}
+	return (d < r) ? 1 : 0;
+}
+
+static inline int ClassifyPlane(const AABB& aabb, const Plane& plane) {
+	float r = fabsf(aabb.size.x * plane.normal.x)
+		+ fabsf(aabb.size.y * plane.normal.y)
+		+ fabsf(aabb.size.z * plane.normal.z);
+	return ClassifyPlane(Dot(plane.normal, aabb.position) + plane.distance, r);
+}
+
+int ClassifyPlanes(const Frustum& f, const AABB& aabb, int planeMask, int* lastPlane) {
+	int result = 0;
+	if (lastPlane != 0 && (planeMask & (1 << *lastPlane)) != 0) {
+		int side = ClassifyPlane(aabb, f.planes[*lastPlane]);
+		if (side < 0) {
+			return FRUSTUM_OUTSIDE;
+		}
+		result |= side << *lastPlane;
+		planeMask &= ~(1 << *lastPlane);
+	}
+
+	for (int i = 0; i < 6; ++i) {
+		if ((planeMask & (1 << i)) == 0) {
+			continue;
+		}
+		int side = ClassifyPlane(aabb, f.planes[i]);
+		if (side < 0) {
+			if (lastPlane != 0) {
+				*lastPlane = i;
+			}
+			return FRUSTUM_OUTSIDE;
+		}
+		result |= side << i;
+	}
+	return result;
+}
+
+int ClassifyPlanes(const Frustum& f, const OBB& obb, int planeMask) {
+	int result = 0;
+	for (int i = 0; i < 6; ++i) {
+		if ((planeMask & (1 << i)) == 0) {
+			continue;
+		}
+		const Plane& plane = f.planes[i];
+		vec3 normal = GetLocalNormal(obb, plane.normal);
+		float r = fabsf(obb.size.x * normal.x)
+			+ fabsf(obb.size.y * normal.y)
+			+ fabsf(obb.size.z * normal.z);
+		int side = ClassifyPlane(Dot(plane.normal, obb.position) + plane.distance, r);
+		if (side < 0) {
+			return FRUSTUM_OUTSIDE;
+		}
+		result |= side << i;
+	}
+	return result;
+}
+
 vec3 Unproject(const vec3& viewportPoint, const vec2& viewportOrigin, const vec2& viewportSize, const mat4& view, const mat4& projection) {
 	// Step 1, Normalize the input vector to the view port
 	float normalized[4] = {
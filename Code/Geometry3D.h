@@ -94,6 +94,17 @@ typedef struct Triangle {
 		a(_p1), b(_p2), c(_p3) { }
 } Triangle;
 
+// Binary tree, children is either 0 or an array of BVH_NUM_CHILDREN nodes.
+// Only leaves have triangles, every triangle is in exactly one leaf. Meshes
+// use the flattened LinearBVHNode array instead, built with the same splits.
+#define BVH_NUM_CHILDREN		2
+#define BVH_DEFAULT_LEAF_SIZE	4 // Max triangles per leaf
+#define BVH_SAH_BINS			16
+#define BVH_MAX_SAH_DEPTH		64 // Deeper nodes are split in half, which bounds the tree depth
+#define BVH_STACK_SIZE			128 // Enough for BVH_MAX_SAH_DEPTH + 32 levels of halving
+#define BVH_PARALLEL_CHUNK		16384 // Triangles per work item of the parallel build
+#define BVH_MAX_COMPRESSED_LEAF	65535 // Largest leaf CompressAccelerator can store
+
 typedef struct BVHNode {
 	AABB bounds;
 	BVHNode* children;
@@ -103,6 +114,39 @@ typedef struct BVHNode {
 	BVHNode() : children(0), numTriangles(0), triangles(0) {}
 } BVHNode;
 
+// Flattened BVH, the nodes of the tree in depth first order. The left child
+// of an interior node is the next node, offset is the node after its subtree
+// (the right child is the node after the left subtree). Leaves have offset
+// as the first of their numTriangles triangles, AccelerateMesh moves the
+// mesh triangles so every leaf is one range.
+typedef struct LinearBVHNode {
+	vec3 min;
+	int numTriangles; // 0 for interior nodes
+	vec3 max;
+	int offset;
+} LinearBVHNode;
+
+// LinearBVHNode in 12 bytes, for meshes that don't move. The bounds are
+// quantized to 8 bits per axis inside the (decoded) bounds of the parent,
+// always rounded outwards, so a node never decodes smaller than it is.
+typedef struct CompressedBVHNode {
+	unsigned char min[3];
+	unsigned char max[3];
+	unsigned short numTriangles;
+	unsigned int offset;
+} CompressedBVHNode;
+
+typedef struct CompressedBVH {
+	vec3 min; // Root bounds, nodes[0] is the root
+	vec3 max;
+	int numNodes;
+	CompressedBVHNode* nodes;
+} CompressedBVH;
+
+// Either a triangle soup (triangles, 3 vertices per triangle) or an indexed
+// mesh, where triangles is 0 and triangle i is made of the positions at
+// indices[i * 3 + 0], [i * 3 + 1] and [i * 3 + 2]. Use GetTriangle to read
+// triangles from either.
 typedef struct Mesh {
 	int numTriangles;
 	union {
@@ -110,22 +154,54 @@ typedef struct Mesh {
 		Point* vertices;
 		float* values;
 	};
-	BVHNode* accelerator;
+	LinearBVHNode* accelerator;
+	int numNodes;
+	CompressedBVH* compressed; // Replaces accelerator after CompressAccelerator
+
+	// Indexed mesh
+	int numPositions;
+	Point* positions;
+	unsigned int* indices;
 
-	Mesh() : numTriangles(0), values(0), accelerator(0) {}
+	Mesh() : numTriangles(0), values(0), accelerator(0), numNodes(0), compressed(0), numPositions(0), positions(0), indices(0) {}
 } Mesh;
 
+inline bool IsIndexed(const Mesh& mesh) {
+	return mesh.indices != 0;
+}
+
+inline Triangle GetTriangle(const Mesh& mesh, int index) {
+	if (mesh.indices == 0) {
+		return mesh.triangles[index];
+	}
+	const unsigned int* i = mesh.indices + index * 3;
+	return Triangle(mesh.positions[i[0]], mesh.positions[i[1]], mesh.positions[i[2]]);
+}
+
 class Model {
 protected:
 	Mesh* content;
 	AABB bounds;
+
+	// World space cache. It is current while position, rotation and parent
+	// still match what it was built from and every parent's cache is current
+	// and unchanged since, so moving a parent invalidates all its children.
+	mat4 world;
+	AABB worldBounds;
+	vec3 cachedPosition;
+	vec3 cachedRotation;
+	const Model* cachedParent;
+	unsigned int cachedParentVersion;
+	unsigned int version; // Bumped every time the cache is rebuilt
+	bool cached;
 public:
 	vec3 position;
 	vec3 rotation;
 	bool flag;
+	unsigned int lastQuery; // Stamp of the last Scene query that visited it
 	Model* parent;
 
-	inline Model() : parent(0), content(0), flag(false) { }
+	inline Model() : content(0), cachedParent(0), cachedParentVersion(0), version(0), cached(false), flag(false), lastQuery(0), parent(0) { }
 	inline Mesh* GetMesh() const {
 		return content;
 	}
@@ -134,6 +210,58 @@ public:
 	}
 
 	void SetContent(Mesh* mesh);
+
+	bool IsWorldCached() const;
+	// Rebuilds the cache of the parents and then this model if they are out
+	// of date, returns true if this one changed. Only the cache is written,
+	// but don't call it while other threads query the model.
+	bool UpdateWorldCache();
+	// Only valid while IsWorldCached, GetWorldMatrix and GetWorldAABB check it
+	inline const mat4& GetCachedWorldMatrix() const {
+		return world;
+	}
+	inline const AABB& GetCachedWorldBounds() const {
+		return worldBounds;
+	}
+};
+
+// Gets every model a query finds, return false from Visit to stop the query
+class ModelVisitor {
+public:
+	inline virtual ~ModelVisitor() { }
+	virtual bool Visit(Model* model) = 0;
+};
+
+// Appends every model to a vector
+class ModelVectorVisitor : public ModelVisitor {
+protected:
+	std::vector<Model*>* models;
+public:
+	inline ModelVectorVisitor(std::vector<Model*>* outModels) : models(outModels) { }
+	inline bool Visit(Model* model) {
+		models->push_back(model);
+		return true;
+	}
+};
+
+// Writes models into a buffer and stops the query once it is full
+class ModelBufferVisitor : public ModelVisitor {
+protected:
+	Model** models;
+	int maxModels;
+	int count;
+public:
+	inline ModelBufferVisitor(Model** outModels, int size) : models(outModels), maxModels(size), count(0) { }
+	inline bool Visit(Model* model) {
+		if (count >= maxModels) {
+			return false;
+		}
+		models[count++] = model;
+		return count < maxModels;
+	}
+	inline int Count() const {
+		return count;
+	}
 };
 
 typedef struct Interval {
@@ -162,6 +290,7 @@ typedef struct RaycastResult {
 	vec3 normal;
 	float t;
 	bool hit;
+	int triangle; // Mesh raycasts only, index of the hit triangle
 } RaycastResult;
 
 void ResetRaycastResult(RaycastResult* outResult);
@@ -314,8 +443,32 @@ bool TrianglePlane(const Triangle& t, const Plane& p);
 vec3 SatCrossEdge(const vec3& a, const vec3& b, const vec3& c, const vec3& d);
 vec3 Barycentric(const Point& p, const Triangle& t);
 
+// Builds the flattened BVH, this reorders the mesh triangles (the index
+// triplets of an indexed mesh, its positions are left alone)
 void AccelerateMesh(Mesh& mesh);
-void SplitBVHNode(BVHNode* node, const Mesh& model, int depth);
+void AccelerateMesh(Mesh& mesh, int maxLeafTriangles);
+void FreeAccelerator(Mesh& mesh);
+// Swaps the accelerator for a CompressedBVH, less than half the memory. Queries
+// work the same, but the tree can't be refit and ray packets trace single rays.
+// Returns false, and keeps the accelerator, if a leaf has more than
+// BVH_MAX_COMPRESSED_LEAF triangles.
+bool CompressAccelerator(Mesh& mesh);
+// The build on its own, triangle outOrder[i] goes to index i of the accelerated mesh.
+// Large meshes are built on the worker threads, the tree is the same for any thread count.
+void BuildLinearBVH(const Triangle* triangles, int numTriangles, int maxLeafTriangles, std::vector<LinearBVHNode>* outNodes, std::vector<int>* outOrder);
+void BuildLinearBVH(const Mesh& mesh, int maxLeafTriangles, std::vector<LinearBVHNode>* outNodes, std::vector<int>* outOrder);
+// Replaces the mesh accelerator with a tree from BuildLinearBVH, reorders the mesh triangles
+void AccelerateMesh(Mesh& mesh, const std::vector<LinearBVHNode>& nodes, const std::vector<int>& order);
+
+// Recomputes the node bounds after the triangles moved, keeping the tree and
+// the triangle order. Returns GetBVHCost of the refit tree.
+float RefitMesh(Mesh& mesh);
+// Surface area heuristic cost of the tree relative to its root, the expected number
+// of node and triangle tests per ray. Grows as refits stretch the nodes.
+float GetBVHCost(const Mesh& mesh);
+// Surface area heuristic split with binned centroids. Nodes with more than
+// maxLeafTriangles triangles are always split, smaller ones only if it's cheaper.
+void SplitBVHNode(BVHNode* node, const Mesh& model, int maxLeafTriangles);
 void FreeBVHNode(BVHNode* node);
 
 bool Linetest(const Mesh& mesh, const Line& line);
@@ -324,14 +477,26 @@ bool MeshAABB(const Mesh& mesh, const AABB& aabb);
 bool MeshOBB(const Mesh& mesh, const OBB& obb);
 bool MeshPlane(const Mesh& mesh, const Plane& plane);
 bool MeshTriangle(const Mesh& mesh, const Triangle& triangle);
+// Appends the index of every triangle whose bounds overlap aabb, each once, in
+// the order the tree stores them (not sorted)
+void MeshQueryTriangles(const Mesh& mesh, const AABB& aabb, std::vector<int>* outTriangles);
+// Closest hit, children are visited front to back and skipped once they
+// start behind the closest hit so far. Returns -1 on a miss.
 float MeshRay(const Mesh& mesh, const Ray& ray);
+bool MeshRay(const Mesh& mesh, const Ray& ray, RaycastResult* outResult);
+// Any hit closer than maxT, for shadow and visibility rays
+bool MeshRayAny(const Mesh& mesh, const Ray& ray, float maxT);
 float Raycast(const Mesh& mesh, const Ray& ray);
 float Raycast(const Model& mesh, const Ray& ray);
 
+// Both read the world cache when it is current and compute from scratch otherwise
 mat4 GetWorldMatrix(const Model& model);
 OBB GetOBB(const Model& model);
+// World space box around the OBB of the model
+AABB GetWorldAABB(const Model& model);
 
 float ModelRay(const Model& model, const Ray& ray);
+bool ModelRay(const Model& model, const Ray& ray, RaycastResult* outResult);
 bool Linetest(const Model& model, const Line& line);
 bool ModelSphere(const Model& model, const Sphere& sphere);
 bool ModelAABB(const Model& model, const AABB& aabb);
@@ -347,6 +512,17 @@ bool Intersects(const Frustum& f, const Sphere& s);
 bool Intersects(const Frustum& f, const AABB& aabb);
 bool Intersects(const Frustum& f, const OBB& obb);
 
+#define FRUSTUM_ALL_PLANES 0x3f
+#define FRUSTUM_OUTSIDE -1
+
+// Hierarchical culling, only the planes in planeMask are tested. Returns
+// FRUSTUM_OUTSIDE if the box is behind one of them, otherwise the planes it
+// crosses, so 0 means it is inside the frustum and so is anything inside it.
+// lastPlane (may be 0) is tested first and set to the plane that rejects the
+// box, from one frame to the next that is usually the same plane.
+int ClassifyPlanes(const Frustum& f, const AABB& aabb, int planeMask, int* lastPlane);
+int ClassifyPlanes(const Frustum& f, const OBB& obb, int planeMask);
+
 vec3 Unproject(const vec3& viewportPoint, const vec2& viewportOrigin, const vec2& viewportSize, const mat4& view, const mat4& projection);
 Ray GetPickRay(const vec2& viewportPoint, const vec2& viewportOrigin, const vec2& viewportSize, const mat4& view, const mat4& projection);
 
@@ -0,0 +1,382 @@
+#include "LinearOctree.h"
+#include "Threading.h"
+#include "TreeBuild.h"
+#include <algorithm>
+#include <cstring>
+#include <cmath>
+#include <cfloat>
+
+#define LINEAR_OCTREE_RADIX_BITS 10 // Three passes over 30 bit codes
+#define LINEAR_OCTREE_SORT_CHUNK 8192 // Models per histogram
+#define LINEAR_OCTREE_PARALLEL_CHUNK 4096
+
+// Spreads the low 10 bits of x so there are two zero bits after each one
+static inline unsigned int SpreadBits(unsigned int x) {
+	x &= 0x000003ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+unsigned int LinearOctree::GetCode(const vec3& point) const {
+	const float last = (float)((1 << LINEAR_OCTREE_LEVELS) - 1);
+	unsigned int cell[3];
+	for (int i = 0; i < 3; ++i) {
+		// Clamped to the border cells, NaN goes to 0
+		float f = (point.asArray[i] - regionMin.asArray[i]) * cellScale.asArray[i];
+		f = (f > 0.0f) ? ((f < last) ? f : last) : 0.0f;
+		cell[i] = (unsigned int)f;
+	}
+	return SpreadBits(cell[0]) | (SpreadBits(cell[1]) << 1) | (SpreadBits(cell[2]) << 2);
+}
+
+// Least significant digit first. Every chunk counts its digits, the counts
+// are turned into a write cursor per chunk and digit, and the chunks scatter
+// in parallel. Chunks keep their order, so every pass is stable.
+void LinearOctree::SortCodes() {
+	const int radix = 1 << LINEAR_OCTREE_RADIX_BITS;
+	const unsigned int mask = radix - 1;
+	int count = (int)codes.size();
+	int numChunks = (count + LINEAR_OCTREE_SORT_CHUNK - 1) / LINEAR_OCTREE_SORT_CHUNK;
+	tempCodes.resize(count);
+	tempOrder.resize(count);
+	histograms.resize(numChunks * radix);
+
+	for (int shift = 0; shift < LINEAR_OCTREE_LEVELS * 3; shift += LINEAR_OCTREE_RADIX_BITS) {
+		ParallelFor(numChunks, 1, [&](int begin, int end) {
+			for (int chunk = begin; chunk < end; ++chunk) {
+				int* histogram = &histograms[chunk * radix];
+				memset(histogram, 0, sizeof(int) * radix);
+				int last = std::min(count, (chunk + 1) * LINEAR_OCTREE_SORT_CHUNK);
+				for (int i = chunk * LINEAR_OCTREE_SORT_CHUNK; i < last; ++i) {
+					histogram[(codes[i] >> shift) & mask] += 1;
+				}
+			}
+		});
+
+		int sum = 0;
+		for (int digit = 0; digit < radix; ++digit) {
+			for (int chunk = 0; chunk < numChunks; ++chunk) {
+				int digitCount = histograms[chunk * radix + digit];
+				histograms[chunk * radix + digit] = sum;
+				sum += digitCount;
+			}
+		}
+
+		ParallelFor(numChunks, 1, [&](int begin, int end) {
+			for (int chunk = begin; chunk < end; ++chunk) {
+				int* cursor = &histograms[chunk * radix];
+				int last = std::min(count, (chunk + 1) * LINEAR_OCTREE_SORT_CHUNK);
+				for (int i = chunk * LINEAR_OCTREE_SORT_CHUNK; i < last; ++i) {
+					int index = cursor[(codes[i] >> shift) & mask]++;
+					tempCodes[index] = codes[i];
+					tempOrder[index] = order[i];
+				}
+			}
+		});
+
+		codes.swap(tempCodes);
+		order.swap(tempOrder);
+	}
+}
+
+struct LinearOctreeTask {
+	int placeholder; // The node it replaces
+	int first;
+	int count;
+	int level;
+	std::vector<LinearOctreeNode> nodes;
+};
+
+// Models [first, first + count) share the top 3 * level bits of their codes.
+// With tasks, spans of at most taskSize models are left as a placeholder
+// node and a task, to be built on their own, like BuildLinearBVHRange.
+static int BuildLinearOctreeRange(std::vector<LinearOctreeNode>& nodes, const unsigned int* codes, const AABB* bounds, int first, int count, int level, std::vector<LinearOctreeTask>* tasks, int taskSize) {
+	int end = first + count;
+	int index = (int)nodes.size();
+	nodes.push_back(LinearOctreeNode());
+
+	vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
+	vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+	if (tasks != 0 && count <= taskSize) {
+		tasks->push_back(LinearOctreeTask());
+		LinearOctreeTask& task = tasks->back();
+		task.placeholder = index;
+		task.first = first;
+		task.count = count;
+		task.level = level;
+	}
+	else {
+		// Levels where every model is in the same child get no node
+		while (count > LINEAR_OCTREE_LEAF_SIZE && level < LINEAR_OCTREE_LEVELS) {
+			int shift = 3 * (LINEAR_OCTREE_LEVELS - 1 - level);
+			if ((codes[first] >> shift) != (codes[end - 1] >> shift)) {
+				break;
+			}
+			++level;
+		}
+
+		if (count <= LINEAR_OCTREE_LEAF_SIZE || level >= LINEAR_OCTREE_LEVELS) {
+			for (int i = first; i < end; ++i) {
+				GrowBounds(min, max, GetMin(bounds[i]), GetMax(bounds[i]));
+			}
+		}
+		else {
+			// Codes are sorted, so every child is the span up to the next digit
+			int shift = 3 * (LINEAR_OCTREE_LEVELS - 1 - level);
+			for (int child = first; child < end;) {
+				unsigned int limit = ((codes[child] >> shift) + 1) << shift;
+				int childEnd = (int)(std::lower_bound(codes + child, codes + end, limit) - codes);
+				int childIndex = BuildLinearOctreeRange(nodes, codes, bounds, child, childEnd - child, level + 1, tasks, taskSize);
+				GrowBounds(min, max, nodes[childIndex].min, nodes[childIndex].max);
+				child = childEnd;
+			}
+		}
+	}
+
+	LinearOctreeNode& node = nodes[index];
+	node.min = min;
+	node.max = max;
+	node.first = first;
+	node.count = count;
+	node.next = (int)nodes.size();
+	return index;
+}
+
+// Builds the subtrees in parallel and puts them where their placeholders are,
+// so the nodes are in the same order as a serial build. The top of the tree
+// was bounded before the subtrees existed, its bounds are redone after.
+static void BuildLinearOctreeTasks(std::vector<LinearOctreeNode>& nodes, const unsigned int* codes, const AABB* bounds, std::vector<LinearOctreeTask>& tasks) {
+	ParallelFor((int)tasks.size(), 1, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			LinearOctreeTask& task = tasks[i];
+			task.nodes.reserve(task.count);
+			BuildLinearOctreeRange(task.nodes, codes, bounds, task.first, task.count, task.level, 0, 0);
+		}
+	});
+
+	int numTop = (int)nodes.size();
+	std::vector<int> shift;
+	SpliceBuildTasks(nodes, tasks, [](LinearOctreeNode& node) {
+		return &node.next;
+	}, &shift);
+
+	// Children come after their parent, so going backwards every child is done first
+	for (int i = numTop - 1, t = (int)tasks.size() - 1; i >= 0; --i) {
+		if (t >= 0 && tasks[t].placeholder == i) {
+			t -= 1;
+			continue;
+		}
+		int index = i + shift[i];
+		LinearOctreeNode& node = nodes[index];
+		if (node.next == index + 1) {
+			continue;
+		}
+		node.min = vec3(FLT_MAX, FLT_MAX, FLT_MAX);
+		node.max = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (int child = index + 1; child < node.next; child = nodes[child].next) {
+			GrowBounds(node.min, node.max, nodes[child].min, nodes[child].max);
+		}
+	}
+}
+
+void LinearOctree::Build(Model* const* sceneModels, int numModels, const AABB& region) {
+	regionMin = GetMin(region);
+	vec3 extent = GetMax(region) - regionMin;
+	float cells = (float)(1 << LINEAR_OCTREE_LEVELS);
+	for (int i = 0; i < 3; ++i) {
+		cellScale.asArray[i] = (extent.asArray[i] > 0.0f) ? cells / extent.asArray[i] : 0.0f;
+	}
+
+	nodes.clear();
+	models.resize(numModels);
+	bounds.resize(numModels);
+	codes.resize(numModels);
+	order.resize(numModels);
+	if (numModels == 0) {
+		return;
+	}
+
+	// Bounds in scene order until the sort is done, then gathered
+	std::vector<AABB>& unsorted = tempBounds;
+	unsorted.resize(numModels);
+	ParallelFor(numModels, LINEAR_OCTREE_PARALLEL_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			unsorted[i] = GetWorldAABB(*sceneModels[i]);
+			codes[i] = GetCode(unsorted[i].position);
+			order[i] = i;
+		}
+	});
+
+	SortCodes();
+
+	ResizeCullList(&cullBounds, numModels);
+	ParallelFor(numModels, LINEAR_OCTREE_PARALLEL_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			models[i] = sceneModels[order[i]];
+			bounds[i] = unsorted[order[i]];
+			SetCullEntry(&cullBounds, i, bounds[i]);
+		}
+	});
+
+	// Same split as the mesh BVH build, any task size builds the same tree
+	int workers = GetWorkerCount();
+	if (workers <= 1 || numModels <= LINEAR_OCTREE_PARALLEL_CHUNK) {
+		nodes.reserve(numModels);
+		BuildLinearOctreeRange(nodes, &codes[0], &bounds[0], 0, numModels, 0, 0, 0);
+	}
+	else {
+		int taskSize = std::max(numModels / (workers * 8), LINEAR_OCTREE_PARALLEL_CHUNK / 4);
+		std::vector<LinearOctreeTask> tasks;
+		BuildLinearOctreeRange(nodes, &codes[0], &bounds[0], 0, numModels, 0, &tasks, taskSize);
+		BuildLinearOctreeTasks(nodes, &codes[0], &bounds[0], tasks);
+	}
+}
+
+// Every query walks the nodes in order. A node that is missed is skipped
+// with next, otherwise the following node is either its first child or,
+// for a leaf, the node after it.
+Model* LinearOctree::Raycast(const Ray& ray) const {
+	vec3 invDirection = GetInverseDirection(ray);
+
+	Model* closest = 0;
+	float closestT = FLT_MAX;
+	for (int i = 0, size = (int)nodes.size(); i < size;) {
+		const LinearOctreeNode& node = nodes[i];
+		float entry;
+		if (!RayBounds(node, ray.origin, invDirection, closestT, &entry)) {
+			i = node.next;
+			continue;
+		}
+		if (IsLeaf(i)) {
+			for (int j = node.first, last = node.first + node.count; j < last; ++j) {
+				float t = ModelRay(*models[j], ray);
+				if (t >= 0 && t < closestT) {
+					closest = models[j];
+					closestT = t;
+				}
+			}
+		}
+		++i;
+	}
+	return closest;
+}
+
+bool LinearOctree::Query(const Sphere& sphere, ModelVisitor* visitor) const {
+	vec3 reach(sphere.radius, sphere.radius, sphere.radius);
+	vec3 min = sphere.position - reach;
+	vec3 max = sphere.position + reach;
+	for (int i = 0, size = (int)nodes.size(); i < size;) {
+		const LinearOctreeNode& node = nodes[i];
+		if (!BoundsOverlap(node, min, max) || !SphereAABB(sphere, FromMinMax(node.min, node.max))) {
+			i = node.next;
+			continue;
+		}
+		if (IsLeaf(i)) {
+			for (int j = node.first, last = node.first + node.count; j < last; ++j) {
+				if (SphereAABB(sphere, bounds[j]) && SphereOBB(sphere, GetOBB(*models[j]))) {
+					if (!visitor->Visit(models[j])) {
+						return false;
+					}
+				}
+			}
+		}
+		++i;
+	}
+	return true;
+}
+
+bool LinearOctree::Query(const AABB& aabb, ModelVisitor* visitor) const {
+	vec3 min = GetMin(aabb);
+	vec3 max = GetMax(aabb);
+	for (int i = 0, size = (int)nodes.size(); i < size;) {
+		const LinearOctreeNode& node = nodes[i];
+		if (!BoundsOverlap(node, min, max)) {
+			i = node.next;
+			continue;
+		}
+		if (IsLeaf(i)) {
+			for (int j = node.first, last = node.first + node.count; j < last; ++j) {
+				if (AABBAABB(aabb, bounds[j]) && AABBOBB(aabb, GetOBB(*models[j]))) {
+					if (!visitor->Visit(models[j])) {
+						return false;
+					}
+				}
+			}
+		}
+		++i;
+	}
+	return true;
+}
+
+// Interior nodes push the planes they cross until the walk passes their
+// next. A node inside the frustum adds its whole span and is skipped.
+bool LinearOctree::Cull(const Frustum& f, ModelVisitor* visitor) const {
+	int planeStack[LINEAR_OCTREE_LEVELS + 2];
+	int endStack[LINEAR_OCTREE_LEVELS + 2];
+	int depth = 0;
+
+	for (int i = 0, size = (int)nodes.size(); i < size;) {
+		while (depth > 0 && i >= endStack[depth - 1]) {
+			--depth;
+		}
+
+		const LinearOctreeNode& node = nodes[i];
+		int planes = (depth > 0) ? planeStack[depth - 1] : FRUSTUM_ALL_PLANES;
+		planes = ClassifyPlanes(f, FromMinMax(node.min, node.max), planes, 0);
+		if (planes == FRUSTUM_OUTSIDE) {
+			i = node.next;
+			continue;
+		}
+		if (planes == 0) {
+			for (int j = node.first, last = node.first + node.count; j < last; ++j) {
+				if (!visitor->Visit(models[j])) {
+					return false;
+				}
+			}
+			i = node.next;
+			continue;
+		}
+
+		if (IsLeaf(i)) {
+			// World boxes of the leaf at once, the OBBs of the ones that pass one by one
+			const CullList& c = cullBounds;
+			for (int j = node.first, last = node.first + node.count; j < last; j += 32) {
+				int count = (last - j < 32) ? last - j : 32;
+				unsigned int visible;
+				FrustumAABBs(f, planes, &c.x[j], &c.y[j], &c.z[j], &c.sizeX[j], &c.sizeY[j], &c.sizeZ[j], count, &visible);
+				for (int k = 0; k < count; ++k) {
+					if ((visible & (1u << k)) != 0 && ClassifyPlanes(f, GetOBB(*models[j + k]), planes) != FRUSTUM_OUTSIDE) {
+						if (!visitor->Visit(models[j + k])) {
+							return false;
+						}
+					}
+				}
+			}
+		}
+		else {
+			planeStack[depth] = planes;
+			endStack[depth] = node.next;
+			++depth;
+		}
+		++i;
+	}
+	return true;
+}
+
+void LinearOctree::Query(const Sphere& sphere, std::vector<Model*>* outModels) const {
+	ModelVectorVisitor visitor(outModels);
+	Query(sphere, &visitor);
+}
+
+void LinearOctree::Query(const AABB& aabb, std::vector<Model*>* outModels) const {
+	ModelVectorVisitor visitor(outModels);
+	Query(aabb, &visitor);
+}
+
+void LinearOctree::Cull(const Frustum& f, std::vector<Model*>* outModels) const {
+	ModelVectorVisitor visitor(outModels);
+	Cull(f, &visitor);
+}
@@ -0,0 +1,80 @@
+#ifndef _H_LINEAR_OCTREE_
+#define _H_LINEAR_OCTREE_
+
+#include "Geometry3D.h"
+#include "FrustumCull.h"
+#include <vector>
+
+// Octree without pointers, rebuilt from scratch every frame. Models are
+// keyed by the Morton code of their center inside the region and radix
+// sorted by it, so every node of the tree is one contiguous span of models.
+// The nodes are stored depth first like LinearBVHNode and their bounds are
+// the union of the world bounds of their models, so a model centered
+// outside of the region is still found, it just shares a border cell.
+//
+// Build reads GetWorldAABB of every model from several threads, refresh the
+// world caches first (Scene::UpdateModels does) or every build recomputes them.
+
+#define LINEAR_OCTREE_LEVELS 10 // Bits per axis of the Morton codes
+#define LINEAR_OCTREE_LEAF_SIZE 8 // Larger nodes are split until the last level
+
+// Nodes with a single non empty child are skipped, the child takes their
+// place. A node is a leaf if next is the node right after it, otherwise
+// that one is its first child and every child's next is its next sibling.
+typedef struct LinearOctreeNode {
+	vec3 min;
+	int first; // Models [first, first + count) are in the subtree
+	vec3 max;
+	int count;
+	int next; // Node after the subtree
+} LinearOctreeNode;
+
+class LinearOctree {
+protected:
+	vec3 regionMin;
+	vec3 cellScale; // Cells per unit on each axis
+	std::vector<LinearOctreeNode> nodes;
+	std::vector<Model*> models; // Sorted by code
+	std::vector<AABB> bounds; // World bounds, in model order
+	CullList cullBounds; // The same bounds for FrustumAABBs
+
+	// Build scratch, kept between builds
+	std::vector<unsigned int> codes;
+	std::vector<int> order;
+	std::vector<unsigned int> tempCodes;
+	std::vector<int> tempOrder;
+	std::vector<AABB> tempBounds;
+	std::vector<int> histograms;
+protected:
+	unsigned int GetCode(const vec3& point) const;
+	void SortCodes();
+public:
+	inline LinearOctree() : cellScale(1.0f, 1.0f, 1.0f) { }
+
+	void Build(Model* const* models, int numModels, const AABB& region);
+
+	inline int NumNodes() const {
+		return (int)nodes.size();
+	}
+	inline const LinearOctreeNode& GetNode(int index) const {
+		return nodes[index];
+	}
+	inline bool IsLeaf(int index) const {
+		return nodes[index].next == index + 1;
+	}
+	inline Model* GetModel(int index) const {
+		return models[index];
+	}
+
+	// Every model is reported once. The visitor versions allocate nothing and
+	// return false if the visitor stopped the query.
+	Model* Raycast(const Ray& ray) const;
+	bool Query(const Sphere& sphere, ModelVisitor* visitor) const;
+	bool Query(const AABB& aabb, ModelVisitor* visitor) const;
+	bool Cull(const Frustum& f, ModelVisitor* visitor) const;
+	void Query(const Sphere& sphere, std::vector<Model*>* outModels) const;
+	void Query(const AABB& aabb, std::vector<Model*>* outModels) const;
+	void Cull(const Frustum& f, std::vector<Model*>* outModels) const;
+};
+
+#endif
@@ -0,0 +1,418 @@
+#include "MeshCache.h"
+#include "ObjLoader.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <process.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define MESH_CACHE_INDEXED			1
+#define MESH_CACHE_LINEAR_BVH		2
+#define MESH_CACHE_COMPRESSED_BVH	4
+
+// Offsets are from the start of the file. The header is written last, so
+// a cache that was only partly written has no magic and is rejected.
+typedef struct MeshCacheHeader {
+	char magic[4];
+	unsigned int version;
+	unsigned int flags;
+	unsigned int nodeSize; // Catches node layout changes without a version bump
+	long long sourceSize;
+	long long sourceTime;
+	int numTriangles;
+	int numPositions;
+	int numNodes;
+	float rootMin[3]; // Root bounds of a compressed tree
+	float rootMax[3];
+	unsigned long long vertexOffset; // Triangles, or positions of an indexed mesh
+	unsigned long long indexOffset;
+	unsigned long long nodeOffset;
+	unsigned long long size;
+} MeshCacheHeader;
+
+static const char meshCacheMagic[4] = { 'M', 'E', 'S', 'H' };
+
+static unsigned long long AlignCacheOffset(unsigned long long offset) {
+	return (offset + MESH_CACHE_ALIGNMENT - 1) & ~(unsigned long long)(MESH_CACHE_ALIGNMENT - 1);
+}
+
+static bool GetSourceStamp(const char* szSourcePath, long long* outSize, long long* outTime) {
+	*outSize = 0;
+	*outTime = 0;
+	if (szSourcePath == 0) {
+		return true;
+	}
+
+	struct stat info;
+	if (stat(szSourcePath, &info) != 0) {
+		return false;
+	}
+	*outSize = (long long)info.st_size;
+	*outTime = (long long)info.st_mtime;
+	return true;
+}
+
+// Zero pads up to offset, then writes the array there
+static bool WriteCacheArray(FILE* file, unsigned long long* position, unsigned long long offset, const void* data, size_t bytes) {
+	static const char padding[MESH_CACHE_ALIGNMENT] = { 0 };
+	while (*position < offset) {
+		size_t count = (size_t)((offset - *position < MESH_CACHE_ALIGNMENT) ? offset - *position : MESH_CACHE_ALIGNMENT);
+		if (fwrite(padding, 1, count, file) != count) {
+			return false;
+		}
+		*position += count;
+	}
+	if (bytes > 0 && fwrite(data, 1, bytes, file) != bytes) {
+		return false;
+	}
+	*position += bytes;
+	return true;
+}
+
+// In the same directory as the cache, so the rename never crosses file
+// systems, and unique per process so two writers don't share one
+static std::string GetCacheTempPath(const char* szFilePath) {
+	char suffix[32];
+#ifdef _WIN32
+	sprintf(suffix, ".%d.tmp", (int)_getpid());
+#else
+	sprintf(suffix, ".%d.tmp", (int)getpid());
+#endif
+	return std::string(szFilePath) + suffix;
+}
+
+// Atomic, a reader opens either the whole old file or the whole new one. If
+// the system refuses to replace a file that is still mapped, the write fails
+// and the old cache is kept.
+static bool ReplaceCacheFile(const char* szTempPath, const char* szFilePath) {
+#ifdef _WIN32
+	return MoveFileExA(szTempPath, szFilePath, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(szTempPath, szFilePath) == 0;
+#endif
+}
+
+bool WriteMeshCache(const char* szFilePath, const Mesh& mesh, const char* szSourcePath) {
+	if (szFilePath == 0) {
+		return false;
+	}
+
+	MeshCacheHeader header;
+	memset(&header, 0, sizeof(MeshCacheHeader));
+	header.version = MESH_CACHE_VERSION;
+	if (!GetSourceStamp(szSourcePath, &header.sourceSize, &header.sourceTime)) {
+		return false;
+	}
+	header.numTriangles = mesh.numTriangles;
+
+	const void* vertices = mesh.triangles;
+	size_t vertexBytes = sizeof(Triangle) * mesh.numTriangles;
+	size_t indexBytes = 0;
+	if (IsIndexed(mesh)) {
+		header.flags |= MESH_CACHE_INDEXED;
+		header.numPositions = mesh.numPositions;
+		vertices = mesh.positions;
+		vertexBytes = sizeof(Point) * mesh.numPositions;
+		indexBytes = sizeof(unsigned int) * 3 * mesh.numTriangles;
+	}
+
+	const void* nodes = 0;
+	size_t nodeBytes = 0;
+	if (mesh.compressed != 0) {
+		header.flags |= MESH_CACHE_COMPRESSED_BVH;
+		header.nodeSize = sizeof(CompressedBVHNode);
+		header.numNodes = mesh.compressed->numNodes;
+		for (int i = 0; i < 3; ++i) {
+			header.rootMin[i] = mesh.compressed->min.asArray[i];
+			header.rootMax[i] = mesh.compressed->max.asArray[i];
+		}
+		nodes = mesh.compressed->nodes;
+	}
+	else if (mesh.accelerator != 0) {
+		header.flags |= MESH_CACHE_LINEAR_BVH;
+		header.nodeSize = sizeof(LinearBVHNode);
+		header.numNodes = mesh.numNodes;
+		nodes = mesh.accelerator;
+	}
+	nodeBytes = (size_t)header.nodeSize * header.numNodes;
+
+	header.vertexOffset = AlignCacheOffset(sizeof(MeshCacheHeader));
+	header.indexOffset = AlignCacheOffset(header.vertexOffset + vertexBytes);
+	header.nodeOffset = AlignCacheOffset(header.indexOffset + indexBytes);
+	header.size = header.nodeOffset + nodeBytes;
+
+	// Other processes, or this one, may have the old cache mapped. Truncating
+	// it under them would crash them, so the new one is written next to it and
+	// renamed over it once complete, the old mappings keep the old file.
+	std::string tempPath = GetCacheTempPath(szFilePath);
+	FILE* file = fopen(tempPath.c_str(), "wb");
+	if (file == 0) {
+		return false;
+	}
+
+	// Header without the magic first, the real one once everything is on disk
+	unsigned long long position = 0;
+	bool written = WriteCacheArray(file, &position, 0, &header, sizeof(MeshCacheHeader)) &&
+		WriteCacheArray(file, &position, header.vertexOffset, vertices, vertexBytes) &&
+		WriteCacheArray(file, &position, header.indexOffset, mesh.indices, indexBytes) &&
+		WriteCacheArray(file, &position, header.nodeOffset, nodes, nodeBytes);
+
+	if (written) {
+		memcpy(header.magic, meshCacheMagic, sizeof(meshCacheMagic));
+		written = fflush(file) == 0 && fseek(file, 0, SEEK_SET) == 0 &&
+			fwrite(&header, sizeof(MeshCacheHeader), 1, file) == 1;
+	}
+	written = (fclose(file) == 0) && written;
+
+	written = written && ReplaceCacheFile(tempPath.c_str(), szFilePath);
+	if (!written) {
+		remove(tempPath.c_str());
+	}
+	return written;
+}
+
+static void* MapCacheFile(const char* szFilePath, size_t* outSize, void** outMapping) {
+#ifdef _WIN32
+	// Sharing delete lets WriteMeshCache rename a new cache over this one
+	HANDLE file = CreateFileA(szFilePath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+	if (file == INVALID_HANDLE_VALUE) {
+		return 0;
+	}
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+		CloseHandle(file);
+		return 0;
+	}
+
+	// The mapping keeps the file open
+	HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+	CloseHandle(file);
+	if (mapping == 0) {
+		return 0;
+	}
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if (data == 0) {
+		CloseHandle(mapping);
+		return 0;
+	}
+
+	*outSize = (size_t)size.QuadPart;
+	*outMapping = mapping;
+	return data;
+#else
+	int file = open(szFilePath, O_RDONLY);
+	if (file < 0) {
+		return 0;
+	}
+	struct stat info;
+	if (fstat(file, &info) != 0 || info.st_size == 0) {
+		close(file);
+		return 0;
+	}
+
+	void* data = mmap(0, (size_t)info.st_size, PROT_READ, MAP_SHARED, file, 0);
+	close(file);
+	if (data == MAP_FAILED) {
+		return 0;
+	}
+
+	*outSize = (size_t)info.st_size;
+	*outMapping = 0;
+	return data;
+#endif
+}
+
+#ifdef _WIN32
+static void UnmapCacheFile(void* data, size_t, void* mapping) {
+	UnmapViewOfFile(data);
+	CloseHandle((HANDLE)mapping);
+}
+#else
+static void UnmapCacheFile(void* data, size_t size, void*) {
+	munmap(data, size);
+}
+#endif
+
+static bool IsCacheArrayInside(unsigned long long offset, unsigned long long bytes, size_t size) {
+	return offset <= size && bytes <= size - offset;
+}
+
+static bool IsCacheValid(const MeshCacheHeader& header, size_t size, const char* szSourcePath) {
+	if (memcmp(header.magic, meshCacheMagic, sizeof(meshCacheMagic)) != 0 || header.version != MESH_CACHE_VERSION || header.size != size) {
+		return false;
+	}
+	if (header.numTriangles < 0 || header.numPositions < 0 || header.numNodes < 0) {
+		return false;
+	}
+
+	unsigned long long nodeSize = 0;
+	if (header.flags & MESH_CACHE_LINEAR_BVH) {
+		nodeSize = sizeof(LinearBVHNode);
+	}
+	else if (header.flags & MESH_CACHE_COMPRESSED_BVH) {
+		nodeSize = sizeof(CompressedBVHNode);
+	}
+	if (header.nodeSize != nodeSize) {
+		return false;
+	}
+
+	bool indexed = (header.flags & MESH_CACHE_INDEXED) != 0;
+	unsigned long long vertexBytes = indexed ? sizeof(Point) * (unsigned long long)header.numPositions : sizeof(Triangle) * (unsigned long long)header.numTriangles;
+	unsigned long long indexBytes = indexed ? sizeof(unsigned int) * 3ull * header.numTriangles : 0;
+	if (!IsCacheArrayInside(header.vertexOffset, vertexBytes, size) ||
+		!IsCacheArrayInside(header.indexOffset, indexBytes, size) ||
+		!IsCacheArrayInside(header.nodeOffset, nodeSize * header.numNodes, size)) {
+		return false;
+	}
+
+	if (szSourcePath != 0) {
+		long long sourceSize, sourceTime;
+		if (!GetSourceStamp(szSourcePath, &sourceSize, &sourceTime) || sourceSize != header.sourceSize || sourceTime != header.sourceTime) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// Returns the node after the subtree of index, -1 if the subtree is broken.
+// The nodes must be in the depth first order the traversals assume (left
+// child next, an interior node's offset the end of its subtree), every leaf
+// inside the triangles, and the tree shallow enough for their stacks.
+template<typename Node>
+static int CheckCacheSubtree(const Node* nodes, int numNodes, int numTriangles, int index, int depth) {
+	if (index >= numNodes || depth >= BVH_STACK_SIZE - 1) {
+		return -1;
+	}
+	long long count = (long long)nodes[index].numTriangles;
+	long long offset = (long long)nodes[index].offset;
+	if (count > 0) {
+		return (offset >= 0 && offset + count <= (long long)numTriangles) ? index + 1 : -1;
+	}
+	if (count < 0) {
+		return -1;
+	}
+
+	int leftEnd = CheckCacheSubtree(nodes, numNodes, numTriangles, index + 1, depth + 1);
+	if (leftEnd < 0) {
+		return -1;
+	}
+	int rightEnd = CheckCacheSubtree(nodes, numNodes, numTriangles, leftEnd, depth + 1);
+	return (rightEnd >= 0 && offset == (long long)rightEnd) ? rightEnd : -1;
+}
+
+template<typename Node>
+static bool IsCacheTreeValid(const Node* nodes, int numNodes, int numTriangles) {
+	return numNodes > 0 && CheckCacheSubtree(nodes, numNodes, numTriangles, 0, 0) == numNodes;
+}
+
+// The header only says the arrays fit in the file, this checks what is in
+// them before a traversal follows any index out of the mapping
+static bool IsCacheDataValid(const MeshCacheHeader& header, const char* data) {
+	if (header.flags & MESH_CACHE_INDEXED) {
+		const unsigned int* indices = (const unsigned int*)(data + header.indexOffset);
+		for (long long i = 0, count = 3ll * header.numTriangles; i < count; ++i) {
+			if (indices[i] >= (unsigned int)header.numPositions) {
+				return false;
+			}
+		}
+	}
+	if (header.flags & MESH_CACHE_LINEAR_BVH) {
+		return IsCacheTreeValid((const LinearBVHNode*)(data + header.nodeOffset), header.numNodes, header.numTriangles);
+	}
+	if (header.flags & MESH_CACHE_COMPRESSED_BVH) {
+		return IsCacheTreeValid((const CompressedBVHNode*)(data + header.nodeOffset), header.numNodes, header.numTriangles);
+	}
+	return true;
+}
+
+bool OpenMeshCache(const char* szFilePath, const char* szSourcePath, MappedMesh* outMesh) {
+	if (szFilePath == 0 || outMesh == 0) {
+		return false;
+	}
+
+	size_t size = 0;
+	void* mapping = 0;
+	char* data = (char*)MapCacheFile(szFilePath, &size, &mapping);
+	if (data == 0) {
+		return false;
+	}
+	const MeshCacheHeader& header = *(const MeshCacheHeader*)data;
+	if (size < sizeof(MeshCacheHeader) || !IsCacheValid(header, size, szSourcePath) || !IsCacheDataValid(header, data)) {
+		UnmapCacheFile(data, size, mapping);
+		return false;
+	}
+
+	// The mesh points straight into the mapping
+	outMesh->data = data;
+	outMesh->size = size;
+	outMesh->mapping = mapping;
+	outMesh->mesh = Mesh();
+	outMesh->mesh.numTriangles = header.numTriangles;
+	if (header.flags & MESH_CACHE_INDEXED) {
+		outMesh->mesh.numPositions = header.numPositions;
+		outMesh->mesh.positions = (Point*)(data + header.vertexOffset);
+		outMesh->mesh.indices = (unsigned int*)(data + header.indexOffset);
+	}
+	else {
+		outMesh->mesh.triangles = (Triangle*)(data + header.vertexOffset);
+	}
+
+	if (header.flags & MESH_CACHE_LINEAR_BVH) {
+		outMesh->mesh.numNodes = header.numNodes;
+		outMesh->mesh.accelerator = (LinearBVHNode*)(data + header.nodeOffset);
+	}
+	else if (header.flags & MESH_CACHE_COMPRESSED_BVH) {
+		outMesh->compressed.min = vec3(header.rootMin[0], header.rootMin[1], header.rootMin[2]);
+		outMesh->compressed.max = vec3(header.rootMax[0], header.rootMax[1], header.rootMax[2]);
+		outMesh->compressed.numNodes = header.numNodes;
+		outMesh->compressed.nodes = (CompressedBVHNode*)(data + header.nodeOffset);
+		outMesh->mesh.compressed = &outMesh->compressed;
+	}
+	return true;
+}
+
+void CloseMeshCache(MappedMesh* mesh) {
+	if (mesh->data != 0) {
+		UnmapCacheFile(mesh->data, mesh->size, mesh->mapping);
+	}
+	else {
+		FreeMesh(&mesh->mesh); // Loaded without a cache, the arrays are on the heap
+	}
+	mesh->mesh = Mesh();
+	mesh->data = 0;
+	mesh->size = 0;
+	mesh->mapping = 0;
+}
+
+bool LoadCachedMesh(const char* szObjPath, const char* szCachePath, float weldDistance, MappedMesh* outMesh) {
+	if (OpenMeshCache(szCachePath, szObjPath, outMesh)) {
+		return true;
+	}
+
+	Mesh mesh;
+	if (!StreamIndexedMesh(szObjPath, &mesh, weldDistance)) {
+		FreeMesh(&mesh);
+		return false;
+	}
+	AccelerateMesh(mesh);
+	if (WriteMeshCache(szCachePath, mesh, szObjPath) && OpenMeshCache(szCachePath, szObjPath, outMesh)) {
+		FreeMesh(&mesh);
+		return true;
+	}
+
+	// The cache can't be written (read only directory, full disk, or the old
+	// cache is still mapped on Windows), keep the mesh that was just loaded.
+	// data stays 0, which tells CloseMeshCache to FreeMesh it.
+	outMesh->mesh = mesh;
+	return true;
+}
@@ -0,0 +1,44 @@
+#ifndef _H_MESH_CACHE_
+#define _H_MESH_CACHE_
+
+#include "Geometry3D.h"
+#include <cstddef>
+
+// Binary cache of a loaded and accelerated mesh. The file holds the vertex
+// arrays and the flattened BVH laid out exactly like they are in memory, so
+// opening a cache maps the file read only and points a Mesh into it, nothing
+// is parsed or copied. Every process that maps the same file shares its pages.
+//
+// The header records the format version, the node layout and the size and
+// modification time of the file the mesh was loaded from. A cache that
+// doesn't match any of them is rejected, and LoadCachedMesh rebuilds it.
+
+#define MESH_CACHE_VERSION 1
+#define MESH_CACHE_ALIGNMENT 64 // Every array starts on a cache line
+
+// A mesh mapped from a cache file. The arrays are read only, don't accelerate,
+// refit or FreeMesh the mesh, and don't copy this struct (mesh may point into it).
+// If LoadCachedMesh couldn't write the cache, data is 0 and mesh is a regular
+// heap mesh instead. Either way CloseMeshCache releases it.
+typedef struct MappedMesh {
+	Mesh mesh;
+	CompressedBVH compressed;
+	void* data;
+	size_t size;
+	void* mapping; // Platform handle of the mapping
+
+	MappedMesh() : data(0), size(0), mapping(0) {}
+} MappedMesh;
+
+// szSourcePath is the file the mesh was loaded from, 0 if the cache should
+// not be tied to a source file
+bool WriteMeshCache(const char* szFilePath, const Mesh& mesh, const char* szSourcePath);
+bool OpenMeshCache(const char* szFilePath, const char* szSourcePath, MappedMesh* outMesh);
+void CloseMeshCache(MappedMesh* mesh);
+
+// Opens szCachePath if it is up to date, otherwise loads the OBJ with
+// StreamIndexedMesh, accelerates it, writes the cache and opens that. Only
+// fails if the OBJ can't be loaded, a cache that can't be written is skipped.
+bool LoadCachedMesh(const char* szObjPath, const char* szCachePath, float weldDistance, MappedMesh* outMesh);
+
+#endif
@@ -1,6 +1,11 @@
 #define TINYOBJLOADER_IMPLEMENTATION 
 #include "tiny_obj_loader.h"
 #include "ObjLoader.h"
+#include "SpatialHash.h"
+#include "Threading.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 
 bool LoadMesh(const char* szFilePath, Mesh* mesh) {
 	if (szFilePath == 0 || mesh == 0) {
@@ -58,11 +63,342 @@ bool LoadMesh(const char* szFilePath, Mesh* mesh) {
 	return true;
 }
 
+// Every position is mapped to the first earlier position within weldDistance,
+// outRemap[i] is the new index of position i. Returns the number of positions
+// left, they are moved to the front of positions.
+static int WeldPositions(std::vector<vec3>& positions, float weldDistance, std::vector<unsigned int>* outRemap) {
+	int numPositions = (int)positions.size();
+	outRemap->resize(numPositions);
+	if (numPositions == 0) {
+		return 0;
+	}
+
+	// Equal positions only need small cells, any size finds them
+	float cellSize = weldDistance;
+	if (cellSize <= 0.0f) {
+		vec3 min = positions[0], max = positions[0];
+		for (int i = 1; i < numPositions; ++i) {
+			for (int j = 0; j < 3; ++j) {
+				min.asArray[j] = fminf(min.asArray[j], positions[i].asArray[j]);
+				max.asArray[j] = fmaxf(max.asArray[j], positions[i].asArray[j]);
+			}
+		}
+		cellSize = fmaxf(fmaxf(max.x - min.x, max.y - min.y), fmaxf(max.z - min.z, 1.0f)) * 0.0001f;
+	}
+
+	SpatialHash hash;
+	hash.Build(&positions[0], numPositions, cellSize);
+	float distanceSq = weldDistance * weldDistance;
+	std::vector<int> weldedTo(numPositions); // Position every position is welded to, itself if kept
+	int numWelded = 0;
+
+	for (int i = 0; i < numPositions; ++i) {
+		weldedTo[i] = i;
+		int cell[3];
+		hash.GetCell(positions[i], cell);
+		for (int x = cell[0] - 1; x <= cell[0] + 1; ++x) {
+			for (int y = cell[1] - 1; y <= cell[1] + 1; ++y) {
+				for (int z = cell[2] - 1; z <= cell[2] + 1; ++z) {
+					unsigned int bucket = hash.Bucket(x, y, z);
+					for (int e = hash.BucketStart(bucket), end = hash.BucketEnd(bucket); e < end; ++e) {
+						int j = hash.Entry(e);
+						// Only positions that were kept, so welds don't chain
+						if (j < weldedTo[i] && weldedTo[j] == j && hash.EntryInCell(e, x, y, z) && MagnitudeSq(hash.EntryPoint(e) - positions[i]) <= distanceSq) {
+							weldedTo[i] = j;
+						}
+					}
+				}
+			}
+		}
+
+		if (weldedTo[i] == i) {
+			(*outRemap)[i] = numWelded;
+			positions[numWelded++] = positions[i];
+		}
+		else {
+			(*outRemap)[i] = (*outRemap)[weldedTo[i]];
+		}
+	}
+
+	positions.resize(numWelded);
+	return numWelded;
+}
+
+bool LoadIndexedMesh(const char* szFilePath, Mesh* mesh, float weldDistance) {
+	if (szFilePath == 0 || mesh == 0) {
+		return false;
+	}
+
+	tinyobj::attrib_t attrib;
+	std::vector<tinyobj::shape_t> shapes;
+	std::vector<tinyobj::material_t> materials;
+	std::string err;
+
+	if (!tinyobj::LoadObj(&attrib, &shapes, &materials, &err, szFilePath)) {
+		return false;
+	}
+
+	// Reset mesh, assume it's fresh!
+	mesh->numTriangles = 0;
+	mesh->triangles = 0;
+	mesh->numPositions = 0;
+	mesh->positions = 0;
+	mesh->indices = 0;
+
+	std::vector<unsigned int> indices;
+	for (int s = 0; s < shapes.size(); s++) { // Loop over shapes
+		int index_offset = 0; // Loop over faces(polygon)
+		for (int f = 0; f < shapes[s].mesh.num_face_vertices.size(); f++) {
+			int fv = shapes[s].mesh.num_face_vertices[f];
+			if (fv != 3) { // Not triangle!
+				return false;
+			}
+
+			for (int v = 0; v < fv; v++) { // Loop over vertices in the face.
+				indices.push_back(shapes[s].mesh.indices[index_offset + v].vertex_index);
+			}
+			index_offset += fv;
+		}
+	}
+
+	std::vector<vec3> positions(attrib.vertices.size() / 3);
+	for (int i = 0; i < positions.size(); ++i) {
+		positions[i] = vec3(attrib.vertices[3 * i + 0], attrib.vertices[3 * i + 1], attrib.vertices[3 * i + 2]);
+	}
+	attrib.vertices.clear();
+
+	if (weldDistance >= 0.0f) {
+		std::vector<unsigned int> remap;
+		WeldPositions(positions, weldDistance, &remap);
+		for (int i = 0; i < indices.size(); ++i) {
+			indices[i] = remap[indices[i]];
+		}
+	}
+
+	mesh->numTriangles = (int)indices.size() / 3;
+	mesh->numPositions = (int)positions.size();
+	mesh->positions = new Point[mesh->numPositions];
+	mesh->indices = new unsigned int[indices.size()];
+	std::copy(positions.begin(), positions.end(), mesh->positions);
+	std::copy(indices.begin(), indices.end(), mesh->indices);
+
+	return true;
+}
+
+// What one worker parsed from its part of a chunk. Negative (relative) OBJ
+// indices depend on how many positions the earlier parts had, the slots
+// holding them are listed in relative and fixed up once that is known.
+struct ObjStreamRange {
+	const char* begin;
+	const char* end;
+	std::vector<vec3> positions;
+	std::vector<unsigned int> indices;
+	std::vector<int> relative;
+	bool failed;
+};
+
+static inline const char* SkipObjSpaces(const char* c, const char* end) {
+	while (c < end && (*c == ' ' || *c == '\t')) {
+		++c;
+	}
+	return c;
+}
+
+// Parses the v and f lines of [range.begin, range.end), which is whole lines
+static void ParseObjRange(ObjStreamRange& range) {
+	range.failed = false;
+	std::vector<int> corners;
+	std::vector<bool> cornerRelative;
+	const char* c = range.begin;
+
+	while (c < range.end) {
+		const char* lineEnd = (const char*)memchr(c, '\n', range.end - c);
+		lineEnd = (lineEnd == 0) ? range.end : lineEnd;
+		c = SkipObjSpaces(c, lineEnd);
+
+		if (lineEnd - c > 1 && c[0] == 'v' && (c[1] == ' ' || c[1] == '\t')) {
+			// The buffer ends in a 0, but strtof skips whitespace, newlines too,
+			// so a short line would read on into the next one without this check
+			vec3 position;
+			const char* next = c + 1;
+			for (int i = 0; i < 3; ++i) {
+				char* end;
+				position.asArray[i] = strtof(next, &end);
+				if (end == next || end > lineEnd) {
+					range.failed = true;
+					return;
+				}
+				next = end;
+			}
+			range.positions.push_back(position);
+		}
+		else if (lineEnd - c > 1 && c[0] == 'f' && (c[1] == ' ' || c[1] == '\t')) {
+			corners.clear();
+			cornerRelative.clear();
+			const char* token = SkipObjSpaces(c + 1, lineEnd);
+			while (token < lineEnd && *token != '\r') {
+				char* next;
+				long index = strtol(token, &next, 10);
+				if (next == token || index == 0) {
+					range.failed = true;
+					return;
+				}
+				// Only the position of v/vt/vn
+				corners.push_back((index > 0) ? (int)(index - 1) : (int)range.positions.size() + (int)index);
+				cornerRelative.push_back(index < 0);
+				token = next;
+				while (token < lineEnd && *token != ' ' && *token != '\t' && *token != '\r') {
+					++token;
+				}
+				token = SkipObjSpaces(token, lineEnd);
+			}
+			if (corners.size() < 3) {
+				range.failed = true;
+				return;
+			}
+
+			// Polygons are triangulated as a fan around the first corner
+			for (int i = 1; i + 1 < (int)corners.size(); ++i) {
+				int triangle[3] = { 0, i, i + 1 };
+				for (int j = 0; j < 3; ++j) {
+					if (cornerRelative[triangle[j]]) {
+						range.relative.push_back((int)range.indices.size());
+					}
+					range.indices.push_back((unsigned int)corners[triangle[j]]);
+				}
+			}
+		}
+		c = lineEnd + 1;
+	}
+}
+
+bool StreamIndexedMesh(const char* szFilePath, Mesh* mesh, float weldDistance) {
+	if (szFilePath == 0 || mesh == 0) {
+		return false;
+	}
+	FILE* file = fopen(szFilePath, "rb");
+	if (file == 0) {
+		return false;
+	}
+
+	// Reset mesh, assume it's fresh!
+	mesh->numTriangles = 0;
+	mesh->triangles = 0;
+	mesh->numPositions = 0;
+	mesh->positions = 0;
+	mesh->indices = 0;
+
+	std::vector<vec3> positions;
+	std::vector<unsigned int> indices;
+	std::vector<char> buffer(OBJ_STREAM_CHUNK + 1);
+	std::vector<ObjStreamRange> ranges(GetWorkerCount());
+	size_t carry = 0; // Bytes of an unfinished line, moved to the front of the buffer
+	bool failed = false;
+
+	while (!failed) {
+		size_t read = fread(&buffer[carry], 1, buffer.size() - 1 - carry, file);
+		size_t size = carry + read;
+		if (size == 0) {
+			break;
+		}
+
+		// Parse whole lines only, unless the file ended
+		size_t parsed = size;
+		if (read > 0) {
+			while (parsed > 0 && buffer[parsed - 1] != '\n') {
+				--parsed;
+			}
+			if (parsed == 0) { // A line longer than the buffer
+				buffer.resize(buffer.size() * 2);
+				carry = size;
+				continue;
+			}
+		}
+		char saved = buffer[parsed];
+		buffer[parsed] = 0;
+
+		// Every worker gets a part of the chunk, split at line boundaries
+		const char* chunk = &buffer[0];
+		const char* begin = chunk;
+		for (int r = 0, numRanges = (int)ranges.size(); r < numRanges; ++r) {
+			const char* end = chunk + parsed * (r + 1) / numRanges;
+			end = (end < begin) ? begin : end;
+			while (end > chunk && end < chunk + parsed && end[-1] != '\n') {
+				++end;
+			}
+			ranges[r].begin = begin;
+			ranges[r].end = end;
+			ranges[r].positions.clear();
+			ranges[r].indices.clear();
+			ranges[r].relative.clear();
+			begin = end;
+		}
+		ParallelFor((int)ranges.size(), 1, [&](int first, int last) {
+			for (int r = first; r < last; ++r) {
+				ParseObjRange(ranges[r]);
+			}
+		});
+
+		// Append in file order, relative indices count from the positions before the range
+		for (int r = 0, numRanges = (int)ranges.size(); r < numRanges && !failed; ++r) {
+			ObjStreamRange& range = ranges[r];
+			failed = range.failed;
+			unsigned int base = (unsigned int)positions.size();
+			unsigned int first = (unsigned int)indices.size();
+			positions.insert(positions.end(), range.positions.begin(), range.positions.end());
+			indices.insert(indices.end(), range.indices.begin(), range.indices.end());
+			for (int i = 0, size = (int)range.relative.size(); i < size; ++i) {
+				indices[first + range.relative[i]] += base;
+			}
+		}
+
+		buffer[parsed] = saved;
+		carry = size - parsed;
+		memmove(&buffer[0], &buffer[parsed], carry);
+	}
+	fclose(file);
+
+	for (int i = 0, size = (int)indices.size(); i < size && !failed; ++i) {
+		failed = indices[i] >= positions.size();
+	}
+	if (failed) {
+		return false;
+	}
+
+	if (weldDistance >= 0.0f) {
+		std::vector<unsigned int> remap;
+		WeldPositions(positions, weldDistance, &remap);
+		for (int i = 0, size = (int)indices.size(); i < size; ++i) {
+			indices[i] = remap[indices[i]];
+		}
+	}
+
+	mesh->numTriangles = (int)indices.size() / 3;
+	mesh->numPositions = (int)positions.size();
+	mesh->positions = new Point[mesh->numPositions];
+	std::copy(positions.begin(), positions.end(), mesh->positions);
+	std::vector<vec3>().swap(positions);
+	mesh->indices = new unsigned int[indices.size()];
+	std::copy(indices.begin(), indices.end(), mesh->indices);
+
+	return true;
+}
+
 void FreeMesh(Mesh* mesh) {
+	FreeAccelerator(*mesh);
 	if (mesh->triangles != 0) {
 		delete[] mesh->triangles;
 	}
+	if (mesh->positions != 0) {
+		delete[] mesh->positions;
+	}
+	if (mesh->indices != 0) {
+		delete[] mesh->indices;
+	}
 
 	mesh->triangles = 0;
 	mesh->numTriangles = 0;
+	mesh->positions = 0;
+	mesh->numPositions = 0;
+	mesh->indices = 0;
 }
\ No newline at end of file
@@ -3,7 +3,18 @@
 
 #include "Geometry3D.h"
 
+#define OBJ_STREAM_CHUNK (16 * 1024 * 1024) // Bytes of text parsed at once
+
 bool LoadMesh(const char* szFilePath, Mesh* mesh);
+// Loads an indexed mesh (see Mesh). Positions closer than weldDistance are
+// merged into one, 0 merges equal positions, a negative distance keeps the
+// positions of the file as they are.
+bool LoadIndexedMesh(const char* szFilePath, Mesh* mesh, float weldDistance);
+// Same as LoadIndexedMesh, but the file is read OBJ_STREAM_CHUNK bytes at a
+// time and every chunk is parsed on the worker threads, so neither the whole
+// text nor tinyobj's copy of it is ever in memory. Polygons are triangulated
+// as fans, normals, texture coordinates and materials are skipped.
+bool StreamIndexedMesh(const char* szFilePath, Mesh* mesh, float weldDistance);
 void FreeMesh(Mesh* mesh);
 
 #endif 
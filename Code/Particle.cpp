@@ -7,55 +7,41 @@ Particle::Particle() {
 	friction = 0.95f;
 	bounce = 0.7f;
 	gravity = vec3(0.0f, -9.82f, 0.0f);
-
-#ifdef EULER_INTEGRATION
 	mass = 1.0f;
-#endif
 }
 
-void Particle::Update(float deltaTime) {
-#ifdef EULER_INTEGRATION
+template<int INTEGRATOR>
+void Particle::UpdateKernel(float deltaTime) {
+	if (INTEGRATOR == INTEGRATOR_VERLET) {
+		vec3 displacement = position - oldPosition;
+		oldPosition = position;
+		float deltaSquare = deltaTime * deltaTime;
+		position = position + (displacement * friction + forces * deltaSquare);
+		return;
+	}
+
 	oldPosition = position;
 	vec3 acceleration = forces *InvMass();
-	#ifdef ACCURATE_EULER_INTEGRATION
+	if (INTEGRATOR == INTEGRATOR_ACCURATE_EULER) {
 		vec3 oldVelocity = velocity;
 		velocity = velocity * friction + acceleration * deltaTime;
 		position = position + (oldVelocity + velocity) * 0.5f * deltaTime;
-	#else
+	}
+	else {
 		velocity = velocity * friction + acceleration * deltaTime;
 		position = position + velocity * deltaTime;
-	#endif
-#else
-	vec3 velocity = position - oldPosition;
-	oldPosition = position;
-	float deltaSquare = deltaTime * deltaTime;
-	position = position + (velocity * friction + forces * deltaSquare);
-#endif
-}
-
-void Particle::Render() {
-	Sphere visual(position, 0.1f);
-	::Render(visual);
-}
-
-void Particle::ApplyForces() {
-#ifdef EULER_INTEGRATION
-	forces = gravity *mass;
-#else
-	forces = gravity *mass;
-#endif
+	}
 }
 
-void Particle::SolveConstraints(const std::vector<OBB>& constraints) {
+template<int INTEGRATOR>
+void Particle::SolveConstraintsKernel(const std::vector<OBB>& constraints) {
 	int size = constraints.size();
 	for (int i = 0; i < size; ++i) {
 		Line traveled(oldPosition, position);
 		if (Linetest(constraints[i], traveled)) {
 			//if (PointInOBB(position, constraints[i])) {
-#ifndef EULER_INTEGRATION
-			vec3 velocity = position - oldPosition;
-#endif
-			vec3 direction = Normalized(velocity);
+			vec3 traveledVelocity = GetVelocityKernel<INTEGRATOR>();
+			vec3 direction = Normalized(traveledVelocity);
 			Ray ray(oldPosition, direction);
 			RaycastResult result;
 
@@ -63,21 +49,70 @@ void Particle::SolveConstraints(const std::vector<OBB>& constraints) {
 				// Place object just a little above collision result
 				position = result.point + result.normal * 0.003f;
 
-				vec3 vn = result.normal * Dot(result.normal, velocity);
-				vec3 vt = velocity - vn;
+				vec3 vn = result.normal * Dot(result.normal, traveledVelocity);
+				vec3 vt = traveledVelocity - vn;
 
-#ifdef EULER_INTEGRATION
-				oldPosition = position;
-				velocity = vt - vn * bounce;
-#else
-				oldPosition = position - (vt - vn * bounce);
-#endif
+				if (INTEGRATOR == INTEGRATOR_VERLET) {
+					oldPosition = position - (vt - vn * bounce);
+				}
+				else {
+					oldPosition = position;
+					velocity = vt - vn * bounce;
+				}
 				break;
 			}
 		}
 	}
 }
 
+template<int INTEGRATOR>
+void Particle::AddImpulseKernel(const vec3& impulse) {
+	if (INTEGRATOR == INTEGRATOR_VERLET) {
+		vec3 velocity = position - oldPosition;
+		velocity = velocity + impulse;
+		oldPosition = position - velocity;
+	}
+	else {
+		velocity = velocity + impulse;
+	}
+}
+
+template<int INTEGRATOR>
+vec3 Particle::GetVelocityKernel() {
+	if (INTEGRATOR == INTEGRATOR_VERLET) {
+		return position - oldPosition;
+	}
+	return velocity;
+}
+
+// One specialized set of kernels per integration model
+#define INSTANTIATE_PARTICLE_KERNELS(I) \
+	template void Particle::UpdateKernel<I>(float deltaTime); \
+	template void Particle::SolveConstraintsKernel<I>(const std::vector<OBB>& constraints); \
+	template void Particle::AddImpulseKernel<I>(const vec3& impulse); \
+	template vec3 Particle::GetVelocityKernel<I>();
+
+INSTANTIATE_PARTICLE_KERNELS(INTEGRATOR_EULER)
+INSTANTIATE_PARTICLE_KERNELS(INTEGRATOR_ACCURATE_EULER)
+INSTANTIATE_PARTICLE_KERNELS(INTEGRATOR_VERLET)
+
+void Particle::Update(float deltaTime) {
+	UpdateKernel<INTEGRATOR_DEFAULT>(deltaTime);
+}
+
+void Particle::Render() {
+	Sphere visual(position, 0.1f);
+	::Render(visual);
+}
+
+void Particle::ApplyForces() {
+	forces = gravity *mass;
+}
+
+void Particle::SolveConstraints(const std::vector<OBB>& constraints) {
+	SolveConstraintsKernel<INTEGRATOR_DEFAULT>(constraints);
+}
+
 void Particle::SetPosition(const vec3& pos) {
 	position = pos;
 	oldPosition = pos;
@@ -96,13 +131,7 @@ float Particle::GetBounce() {
 }
 
 void Particle::AddImpulse(const vec3& impulse) {
-#ifdef EULER_INTEGRATION
-	velocity = velocity + impulse;
-#else
-	vec3 velocity = position - oldPosition;
-	velocity = velocity + impulse;
-	oldPosition = position - velocity;
-#endif
+	AddImpulseKernel<INTEGRATOR_DEFAULT>(impulse);
 }
 
 float Particle::InvMass() {
@@ -115,11 +144,7 @@ void Particle::SetMass(float m) {
 }
 
 vec3 Particle::GetVelocity() {
-#ifdef EULER_INTEGRATION
-	return velocity;
-#else
-	return position - oldPosition;
-#endif
+	return GetVelocityKernel<INTEGRATOR_DEFAULT>();
 }
 
 void Particle::SetFriction(float f) {
@@ -1,20 +1,28 @@
 #ifndef _H_PARTICLE_
 #define _H_PARTICLE_
 
-#include "Rigidbody.h";
+#include "Rigidbody.h"
 
-// The particles will either use euler or verlet integration
-// If EULER_INTEGRATION is defined, euler integration will
-// be used. Otherwise, verlet integration is the default
+// The particles will either use euler or verlet integration.
+// The integration model is a template parameter of the particle
+// kernels (UpdateKernel, SolveConstraintsKernel, ...) so a single
+// binary holds a specialized version of each model. PhysicsSystem
+// picks one per world at runtime, see PhysicsSystem::Integrator.
 
-// If ACCURATE_EULER_INTEGRATION is defined, a slightly more
-// accurate integration model is used. This should help 
-// keep the simulation stable over long periods of time
+// INTEGRATOR_ACCURATE_EULER is a slightly more accurate euler
+// integration model. This should help keep the simulation
+// stable over long periods of time
 
-#define EULER_INTEGRATION
-//#define ACCURATE_EULER_INTEGRATION
+#define INTEGRATOR_EULER			0
+#define INTEGRATOR_ACCURATE_EULER	1
+#define INTEGRATOR_VERLET			2
+
+// Model used by the non-template (virtual) interface
+#define INTEGRATOR_DEFAULT		INTEGRATOR_EULER
 
 class Particle : public Rigidbody {
+	friend class Cloth; // Cloth solves self collision on the raw particle state
+
 	vec3 position;
 	vec3 oldPosition;
 	vec3 forces;
@@ -23,9 +31,7 @@ class Particle : public Rigidbody {
 	float friction;
 	float bounce;
 
-#ifdef EULER_INTEGRATION
-	vec3 velocity;
-#endif
+	vec3 velocity; // Only used by the euler models
 	float mass;
 public:
 	Particle();
@@ -35,6 +41,11 @@ public:
 	void ApplyForces();
 	void SolveConstraints(const std::vector<OBB>& constraints);
 
+	template<int INTEGRATOR> void UpdateKernel(float deltaTime);
+	template<int INTEGRATOR> void SolveConstraintsKernel(const std::vector<OBB>& constraints);
+	template<int INTEGRATOR> void AddImpulseKernel(const vec3& impulse);
+	template<int INTEGRATOR> vec3 GetVelocityKernel();
+
 	void SetPosition(const vec3& pos);
 	vec3 GetPosition();
 
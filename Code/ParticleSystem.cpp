@@ -0,0 +1,361 @@
+#include "ParticleSystem.h"
+#include "Simd.h"
+#include "glad/glad.h"
+#include <cmath>
+#include <cfloat>
+
+ParticleSystem::ParticleSystem() {
+	numParticles = 0;
+	gravity = vec3(0.0f, -9.82f, 0.0f);
+	friction = 0.95f;
+	bounce = 0.7f;
+}
+
+void ParticleSystem::Reserve(int count) {
+	positionX.reserve(count); positionY.reserve(count); positionZ.reserve(count);
+	oldPositionX.reserve(count); oldPositionY.reserve(count); oldPositionZ.reserve(count);
+	velocityX.reserve(count); velocityY.reserve(count); velocityZ.reserve(count);
+	invMass.reserve(count);
+}
+
+int ParticleSystem::AddParticle(const vec3& position, float mass) {
+	positionX.push_back(position.x); positionY.push_back(position.y); positionZ.push_back(position.z);
+	oldPositionX.push_back(position.x); oldPositionY.push_back(position.y); oldPositionZ.push_back(position.z);
+	velocityX.push_back(0.0f); velocityY.push_back(0.0f); velocityZ.push_back(0.0f);
+	invMass.push_back((mass == 0.0f) ? 0.0f : 1.0f / mass);
+	return numParticles++;
+}
+
+void ParticleSystem::Clear() {
+	numParticles = 0;
+	positionX.clear(); positionY.clear(); positionZ.clear();
+	oldPositionX.clear(); oldPositionY.clear(); oldPositionZ.clear();
+	velocityX.clear(); velocityY.clear(); velocityZ.clear();
+	invMass.clear();
+}
+
+vec3 ParticleSystem::GetPosition(int index) const {
+	return vec3(positionX[index], positionY[index], positionZ[index]);
+}
+
+void ParticleSystem::SetPosition(int index, const vec3& position) {
+	positionX[index] = oldPositionX[index] = position.x;
+	positionY[index] = oldPositionY[index] = position.y;
+	positionZ[index] = oldPositionZ[index] = position.z;
+}
+
+void ParticleSystem::SetMass(int index, float mass) {
+	invMass[index] = (mass == 0.0f) ? 0.0f : 1.0f / mass;
+}
+
+template<int INTEGRATOR>
+void ParticleSystem::UpdateKernel(float deltaTime) {
+	float* px = positionX.size() > 0 ? &positionX[0] : 0;
+	float* py = positionY.size() > 0 ? &positionY[0] : 0;
+	float* pz = positionZ.size() > 0 ? &positionZ[0] : 0;
+	float* ox = oldPositionX.size() > 0 ? &oldPositionX[0] : 0;
+	float* oy = oldPositionY.size() > 0 ? &oldPositionY[0] : 0;
+	float* oz = oldPositionZ.size() > 0 ? &oldPositionZ[0] : 0;
+	float* vx = velocityX.size() > 0 ? &velocityX[0] : 0;
+	float* vy = velocityY.size() > 0 ? &velocityY[0] : 0;
+	float* vz = velocityZ.size() > 0 ? &velocityZ[0] : 0;
+	const float* im = invMass.size() > 0 ? &invMass[0] : 0;
+
+	// Same as Particle, forces = gravity * mass, so massless particles don't fall
+	float dt = deltaTime;
+	float dtSq = deltaTime * deltaTime;
+	int i = 0;
+
+#ifdef SIMD_SSE
+	__m128 gx4 = _mm_set1_ps(gravity.x), gy4 = _mm_set1_ps(gravity.y), gz4 = _mm_set1_ps(gravity.z);
+	__m128 fx4 = _mm_set1_ps(force.x), fy4 = _mm_set1_ps(force.y), fz4 = _mm_set1_ps(force.z);
+	__m128 friction4 = _mm_set1_ps(friction);
+	__m128 dt4 = _mm_set1_ps(dt);
+	__m128 dtSq4 = _mm_set1_ps(dtSq);
+	__m128 half4 = _mm_set1_ps(0.5f);
+	__m128 zero4 = _mm_setzero_ps();
+
+	for (; i + 4 <= numParticles; i += 4) {
+		__m128 w = _mm_loadu_ps(im + i);
+		__m128 hasMass = _mm_cmpgt_ps(w, zero4);
+		__m128 ax = _mm_add_ps(_mm_and_ps(hasMass, gx4), _mm_mul_ps(fx4, w));
+		__m128 ay = _mm_add_ps(_mm_and_ps(hasMass, gy4), _mm_mul_ps(fy4, w));
+		__m128 az = _mm_add_ps(_mm_and_ps(hasMass, gz4), _mm_mul_ps(fz4, w));
+
+		__m128 x = _mm_loadu_ps(px + i), y = _mm_loadu_ps(py + i), z = _mm_loadu_ps(pz + i);
+
+		if (INTEGRATOR == INTEGRATOR_VERLET) {
+			__m128 dx = _mm_sub_ps(x, _mm_loadu_ps(ox + i));
+			__m128 dy = _mm_sub_ps(y, _mm_loadu_ps(oy + i));
+			__m128 dz = _mm_sub_ps(z, _mm_loadu_ps(oz + i));
+			_mm_storeu_ps(ox + i, x); _mm_storeu_ps(oy + i, y); _mm_storeu_ps(oz + i, z);
+			x = _mm_add_ps(x, _mm_add_ps(_mm_mul_ps(dx, friction4), _mm_mul_ps(ax, dtSq4)));
+			y = _mm_add_ps(y, _mm_add_ps(_mm_mul_ps(dy, friction4), _mm_mul_ps(ay, dtSq4)));
+			z = _mm_add_ps(z, _mm_add_ps(_mm_mul_ps(dz, friction4), _mm_mul_ps(az, dtSq4)));
+		}
+		else {
+			_mm_storeu_ps(ox + i, x); _mm_storeu_ps(oy + i, y); _mm_storeu_ps(oz + i, z);
+			__m128 oldVx = _mm_loadu_ps(vx + i), oldVy = _mm_loadu_ps(vy + i), oldVz = _mm_loadu_ps(vz + i);
+			__m128 newVx = _mm_add_ps(_mm_mul_ps(oldVx, friction4), _mm_mul_ps(ax, dt4));
+			__m128 newVy = _mm_add_ps(_mm_mul_ps(oldVy, friction4), _mm_mul_ps(ay, dt4));
+			__m128 newVz = _mm_add_ps(_mm_mul_ps(oldVz, friction4), _mm_mul_ps(az, dt4));
+			_mm_storeu_ps(vx + i, newVx); _mm_storeu_ps(vy + i, newVy); _mm_storeu_ps(vz + i, newVz);
+
+			if (INTEGRATOR == INTEGRATOR_ACCURATE_EULER) {
+				__m128 scale = _mm_mul_ps(half4, dt4);
+				x = _mm_add_ps(x, _mm_mul_ps(_mm_add_ps(oldVx, newVx), scale));
+				y = _mm_add_ps(y, _mm_mul_ps(_mm_add_ps(oldVy, newVy), scale));
+				z = _mm_add_ps(z, _mm_mul_ps(_mm_add_ps(oldVz, newVz), scale));
+			}
+			else {
+				x = _mm_add_ps(x, _mm_mul_ps(newVx, dt4));
+				y = _mm_add_ps(y, _mm_mul_ps(newVy, dt4));
+				z = _mm_add_ps(z, _mm_mul_ps(newVz, dt4));
+			}
+		}
+
+		_mm_storeu_ps(px + i, x); _mm_storeu_ps(py + i, y); _mm_storeu_ps(pz + i, z);
+	}
+#endif
+
+	// Scalar path, also handles the tail of the SIMD loop
+	for (; i < numParticles; ++i) {
+		float w = im[i];
+		float hasMass = (w > 0.0f) ? 1.0f : 0.0f;
+		float ax = gravity.x * hasMass + force.x * w;
+		float ay = gravity.y * hasMass + force.y * w;
+		float az = gravity.z * hasMass + force.z * w;
+
+		if (INTEGRATOR == INTEGRATOR_VERLET) {
+			float dx = px[i] - ox[i], dy = py[i] - oy[i], dz = pz[i] - oz[i];
+			ox[i] = px[i]; oy[i] = py[i]; oz[i] = pz[i];
+			px[i] += dx * friction + ax * dtSq;
+			py[i] += dy * friction + ay * dtSq;
+			pz[i] += dz * friction + az * dtSq;
+		}
+		else {
+			ox[i] = px[i]; oy[i] = py[i]; oz[i] = pz[i];
+			float oldVx = vx[i], oldVy = vy[i], oldVz = vz[i];
+			vx[i] = vx[i] * friction + ax * dt;
+			vy[i] = vy[i] * friction + ay * dt;
+			vz[i] = vz[i] * friction + az * dt;
+
+			if (INTEGRATOR == INTEGRATOR_ACCURATE_EULER) {
+				px[i] += (oldVx + vx[i]) * 0.5f * dt;
+				py[i] += (oldVy + vy[i]) * 0.5f * dt;
+				pz[i] += (oldVz + vz[i]) * 0.5f * dt;
+			}
+			else {
+				px[i] += vx[i] * dt;
+				py[i] += vy[i] * dt;
+				pz[i] += vz[i] * dt;
+			}
+		}
+	}
+}
+
+void ParticleSystem::UpdateBatchBounds() {
+	int numBatches = (numParticles + PARTICLE_SYSTEM_BATCH - 1) / PARTICLE_SYSTEM_BATCH;
+	batchBounds.resize(numBatches);
+
+	for (int b = 0; b < numBatches; ++b) {
+		int first = b * PARTICLE_SYSTEM_BATCH;
+		int last = first + PARTICLE_SYSTEM_BATCH;
+		last = (last > numParticles) ? numParticles : last;
+
+		// Bounds of the path traveled this step, not just the end points
+		vec3 min(FLT_MAX, FLT_MAX, FLT_MAX);
+		vec3 max(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+		for (int i = first; i < last; ++i) {
+			min.x = fminf(min.x, fminf(positionX[i], oldPositionX[i]));
+			min.y = fminf(min.y, fminf(positionY[i], oldPositionY[i]));
+			min.z = fminf(min.z, fminf(positionZ[i], oldPositionZ[i]));
+			max.x = fmaxf(max.x, fmaxf(positionX[i], oldPositionX[i]));
+			max.y = fmaxf(max.y, fmaxf(positionY[i], oldPositionY[i]));
+			max.z = fmaxf(max.z, fmaxf(positionZ[i], oldPositionZ[i]));
+		}
+		batchBounds[b] = FromMinMax(min, max);
+	}
+}
+
+template<int INTEGRATOR>
+void ParticleSystem::SolveConstraintsKernel(const std::vector<OBB>& constraints) {
+	if (numParticles == 0 || constraints.size() == 0) {
+		return;
+	}
+	UpdateBatchBounds();
+
+	for (int c = 0, numConstraints = constraints.size(); c < numConstraints; ++c) {
+		const OBB& obb = constraints[c];
+		vec3 axis[3];
+		AABB obbBounds(obb.position, vec3());
+		for (int i = 0; i < 3; ++i) {
+			const float* o = &obb.orientation.asArray[i * 3];
+			axis[i] = vec3(o[0], o[1], o[2]);
+			obbBounds.size.asArray[i] = fabsf(obb.orientation.asArray[0 * 3 + i]) * obb.size.x +
+				fabsf(obb.orientation.asArray[1 * 3 + i]) * obb.size.y +
+				fabsf(obb.orientation.asArray[2 * 3 + i]) * obb.size.z;
+		}
+
+		for (int b = 0, numBatches = batchBounds.size(); b < numBatches; ++b) {
+			if (!AABBAABB(batchBounds[b], obbBounds)) {
+				continue;
+			}
+
+			int last = (b + 1) * PARTICLE_SYSTEM_BATCH;
+			last = (last > numParticles) ? numParticles : last;
+			for (int i = b * PARTICLE_SYSTEM_BATCH; i < last; ++i) {
+				vec3 oldPosition(oldPositionX[i], oldPositionY[i], oldPositionZ[i]);
+				vec3 position(positionX[i], positionY[i], positionZ[i]);
+
+				// Segment against the box slabs, in box space
+				vec3 start = oldPosition - obb.position;
+				vec3 delta = position - oldPosition;
+				float tEnter = 0.0f;
+				float tExit = 1.0f;
+				int enterAxis = -1;
+				float enterSign = 1.0f;
+				bool miss = false;
+
+				for (int a = 0; a < 3 && !miss; ++a) {
+					float s = Dot(start, axis[a]);
+					float d = Dot(delta, axis[a]);
+					float e = obb.size.asArray[a];
+
+					if (fabsf(d) < 0.0000001f) {
+						miss = (s < -e || s > e);
+						continue;
+					}
+
+					float t1 = (-e - s) / d;
+					float t2 = (e - s) / d;
+					float sign = -1.0f; // Entered trough the negative face
+					if (t1 > t2) {
+						float t = t1; t1 = t2; t2 = t;
+						sign = 1.0f;
+					}
+					if (t1 > tEnter) {
+						tEnter = t1;
+						enterAxis = a;
+						enterSign = sign;
+					}
+					tExit = (t2 < tExit) ? t2 : tExit;
+					miss = tEnter > tExit;
+				}
+
+				if (miss) {
+					continue;
+				}
+
+				vec3 normal;
+				vec3 contact;
+				if (enterAxis >= 0) {
+					normal = axis[enterAxis] * enterSign;
+					contact = oldPosition + delta * tEnter;
+				}
+				else if (tExit < 1.0f) {
+					continue; // Started inside and is leaving the box
+				}
+				else {
+					// Started and ended inside, which happens when an earlier
+					// constraint moved the particle. Push out trough the closest face.
+					vec3 local = position - obb.position;
+					float depth = FLT_MAX;
+					for (int a = 0; a < 3; ++a) {
+						float p = Dot(local, axis[a]);
+						float d = obb.size.asArray[a] - fabsf(p);
+						if (d < depth) {
+							depth = d;
+							normal = axis[a] * ((p < 0.0f) ? -1.0f : 1.0f);
+						}
+					}
+					contact = position + normal * depth;
+				}
+
+				vec3 velocity = GetVelocityKernel<INTEGRATOR>(i);
+
+				// Place object just a little above collision result
+				position = contact + normal * 0.003f;
+
+				// Only reflect the part moving into the box
+				vec3 vn = normal * fminf(Dot(normal, velocity), 0.0f);
+				vec3 vt = velocity - vn;
+				vec3 response = vt - vn * bounce;
+
+				positionX[i] = position.x; positionY[i] = position.y; positionZ[i] = position.z;
+				if (INTEGRATOR == INTEGRATOR_VERLET) {
+					oldPositionX[i] = position.x - response.x;
+					oldPositionY[i] = position.y - response.y;
+					oldPositionZ[i] = position.z - response.z;
+				}
+				else {
+					oldPositionX[i] = position.x; oldPositionY[i] = position.y; oldPositionZ[i] = position.z;
+					velocityX[i] = response.x; velocityY[i] = response.y; velocityZ[i] = response.z;
+				}
+			}
+		}
+	}
+}
+
+template<int INTEGRATOR>
+void ParticleSystem::AddImpulseKernel(int index, const vec3& impulse) {
+	if (INTEGRATOR == INTEGRATOR_VERLET) {
+		oldPositionX[index] -= impulse.x;
+		oldPositionY[index] -= impulse.y;
+		oldPositionZ[index] -= impulse.z;
+	}
+	else {
+		velocityX[index] += impulse.x;
+		velocityY[index] += impulse.y;
+		velocityZ[index] += impulse.z;
+	}
+}
+
+template<int INTEGRATOR>
+vec3 ParticleSystem::GetVelocityKernel(int index) const {
+	if (INTEGRATOR == INTEGRATOR_VERLET) {
+		return vec3(positionX[index] - oldPositionX[index],
+			positionY[index] - oldPositionY[index],
+			positionZ[index] - oldPositionZ[index]);
+	}
+	return vec3(velocityX[index], velocityY[index], velocityZ[index]);
+}
+
+#define INSTANTIATE_PARTICLE_SYSTEM_KERNELS(I) \
+	template void ParticleSystem::UpdateKernel<I>(float deltaTime); \
+	template void ParticleSystem::SolveConstraintsKernel<I>(const std::vector<OBB>& constraints); \
+	template void ParticleSystem::AddImpulseKernel<I>(int index, const vec3& impulse); \
+	template vec3 ParticleSystem::GetVelocityKernel<I>(int index) const;
+
+INSTANTIATE_PARTICLE_SYSTEM_KERNELS(INTEGRATOR_EULER)
+INSTANTIATE_PARTICLE_SYSTEM_KERNELS(INTEGRATOR_ACCURATE_EULER)
+INSTANTIATE_PARTICLE_SYSTEM_KERNELS(INTEGRATOR_VERLET)
+
+void ParticleSystem::FillRenderBuffer() {
+	renderVertices.resize(numParticles * 3);
+	for (int i = 0; i < numParticles; ++i) {
+		renderVertices[i * 3 + 0] = positionX[i];
+		renderVertices[i * 3 + 1] = positionY[i];
+		renderVertices[i * 3 + 2] = positionZ[i];
+	}
+}
+
+void ParticleSystem::Render() {
+	if (numParticles == 0) {
+		return;
+	}
+	FillRenderBuffer();
+
+	GLboolean status;
+	glGetBooleanv(GL_LIGHTING, &status);
+	glDisable(GL_LIGHTING);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, GetRenderVertices());
+	glDrawArrays(GL_POINTS, 0, numParticles);
+	glDisableClientState(GL_VERTEX_ARRAY);
+
+	if (status) {
+		glEnable(GL_LIGHTING);
+	}
+}
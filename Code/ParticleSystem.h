@@ -0,0 +1,61 @@
+#ifndef _H_PARTICLE_SYSTEM_
+#define _H_PARTICLE_SYSTEM_
+
+#include "Particle.h"
+#include <vector>
+
+// Large particle sets stored as structure of arrays. Unlike Particle
+// there is no per particle object or virtual call; the whole set is
+// integrated by one SIMD kernel and registered with PhysicsSystem as
+// a single unit. Integration models are the ones from Particle.h.
+
+// Particles are culled against constraints in batches of this size
+#define PARTICLE_SYSTEM_BATCH	256
+
+class ParticleSystem {
+protected:
+	int numParticles;
+
+	std::vector<float> positionX, positionY, positionZ;
+	std::vector<float> oldPositionX, oldPositionY, oldPositionZ;
+	std::vector<float> velocityX, velocityY, velocityZ; // Only used by the euler models
+	std::vector<float> invMass;
+
+	std::vector<AABB> batchBounds; // Swept bounds, one per PARTICLE_SYSTEM_BATCH particles
+	std::vector<float> renderVertices; // Interleaved x, y, z
+protected:
+	void UpdateBatchBounds();
+public:
+	vec3 gravity;
+	vec3 force; // Applied to every particle, scaled by inverse mass
+	float friction;
+	float bounce;
+
+	ParticleSystem();
+
+	void Reserve(int count);
+	int AddParticle(const vec3& position, float mass);
+	void Clear();
+	inline int Size() const {
+		return numParticles;
+	}
+
+	vec3 GetPosition(int index) const;
+	void SetPosition(int index, const vec3& position);
+	void SetMass(int index, float mass);
+
+	// For Physics System
+	template<int INTEGRATOR> void UpdateKernel(float deltaTime);
+	template<int INTEGRATOR> void SolveConstraintsKernel(const std::vector<OBB>& constraints);
+	template<int INTEGRATOR> void AddImpulseKernel(int index, const vec3& impulse);
+	template<int INTEGRATOR> vec3 GetVelocityKernel(int index) const;
+
+	// Interleaved positions for glVertexPointer, works without a GL context
+	void FillRenderBuffer();
+	inline const float* GetRenderVertices() const {
+		return renderVertices.size() > 0 ? &renderVertices[0] : 0;
+	}
+	void Render();
+};
+
+#endif
@@ -1,5 +1,6 @@
 #include "PhysicsSystem.h"
 #include "RigidbodyVolume.h"
+#include "Particle.h"
 #include "FixedFunctionPrimitives.h"
 #include "glad/glad.h"
 #include <iostream>
@@ -9,6 +10,10 @@ PhysicsSystem::PhysicsSystem() {
 	PenetrationSlack = 0.01f;
 	ImpulseIteration = 5;
 
+	Integrator = INTEGRATOR_DEFAULT;
+	RotationModel = ROTATION_MODEL_DEFAULT;
+	FrictionModel = FRICTION_MODEL_DEFAULT;
+
 	DebugRender = false;
 	DoLinearProjection = true;
 	RenderRandomColors = false;
@@ -18,7 +23,41 @@ PhysicsSystem::PhysicsSystem() {
 	results.reserve(100);
 }
 
+#define PHYSICS_STEP(I) \
+	if (RotationModel == ROTATION_MODEL_LINEAR_ONLY) { \
+		if (FrictionModel == FRICTION_MODEL_DYNAMIC) { \
+			Step<I, ROTATION_MODEL_LINEAR_ONLY, FRICTION_MODEL_DYNAMIC>(deltaTime); \
+		} \
+		else { \
+			Step<I, ROTATION_MODEL_LINEAR_ONLY, FRICTION_MODEL_COULOMB>(deltaTime); \
+		} \
+	} \
+	else { \
+		if (FrictionModel == FRICTION_MODEL_DYNAMIC) { \
+			Step<I, ROTATION_MODEL_ANGULAR, FRICTION_MODEL_DYNAMIC>(deltaTime); \
+		} \
+		else { \
+			Step<I, ROTATION_MODEL_ANGULAR, FRICTION_MODEL_COULOMB>(deltaTime); \
+		} \
+	}
+
 void PhysicsSystem::Update(float deltaTime) {
+	// Pick the specialized kernels once, the loops below never branch on the model
+	if (Integrator == INTEGRATOR_VERLET) {
+		PHYSICS_STEP(INTEGRATOR_VERLET)
+	}
+	else if (Integrator == INTEGRATOR_ACCURATE_EULER) {
+		PHYSICS_STEP(INTEGRATOR_ACCURATE_EULER)
+	}
+	else {
+		PHYSICS_STEP(INTEGRATOR_EULER)
+	}
+}
+
+#undef PHYSICS_STEP
+
+template<int INTEGRATOR, int ROTATION, int FRICTION>
+void PhysicsSystem::Step(float deltaTime) {
 	colliders1.clear();
 	colliders2.clear();
 	results.clear();
@@ -89,7 +128,7 @@ void PhysicsSystem::Update(float deltaTime) {
 				if (colliders1[i]->HasVolume() && colliders2[i]->HasVolume()) {
 					RigidbodyVolume* m1 = (RigidbodyVolume*)colliders1[i];
 					RigidbodyVolume* m2 = (RigidbodyVolume*)colliders2[i];
-					ApplyImpulse(*m1, *m2, results[i], j);
+					ApplyImpulseKernel<ROTATION, FRICTION>(*m1, *m2, results[i], j);
 				}
 			}
 		}
@@ -97,12 +136,28 @@ void PhysicsSystem::Update(float deltaTime) {
 
 	// Integrate velocity and impulse of objects
 	for (int i = 0, size = bodies.size(); i < size; ++i) {
-		bodies[i]->Update(deltaTime);
+		if (bodies[i]->type == RIGIDBODY_TYPE_PARTICLE) {
+			((Particle*)bodies[i])->UpdateKernel<INTEGRATOR>(deltaTime);
+		}
+		else if (bodies[i]->HasVolume()) {
+			((RigidbodyVolume*)bodies[i])->UpdateKernel<ROTATION>(deltaTime);
+		}
+		else {
+			bodies[i]->Update(deltaTime);
+		}
 	}
 
 	// Same as above, integrate velocity and impulse of cloths
 	for (int i = 0, size = cloths.size(); i < size; ++i) {
-		cloths[i]->Update(deltaTime);
+		cloths[i]->UpdateKernel<INTEGRATOR>(deltaTime);
+	}
+
+	// Particle systems integrate all of their particles in one call
+	for (int i = 0, size = particleSystems.size(); i < size; ++i) {
+		particleSystems[i]->UpdateKernel<INTEGRATOR>(deltaTime);
+	}
+	for (int i = 0, size = springNetworks.size(); i < size; ++i) {
+		springNetworks[i]->UpdateKernel<INTEGRATOR>(deltaTime);
 	}
 
 	// Correct position to avoid sinking!
@@ -127,29 +182,58 @@ void PhysicsSystem::Update(float deltaTime) {
 			m1->position = m1->position - correction * m1->InvMass();
 			m2->position = m2->position + correction * m2->InvMass();
 
-			m1->SynchCollisionVolumes();
-			m2->SynchCollisionVolumes();
+			m1->SynchCollisionVolumesKernel<ROTATION>();
+			m2->SynchCollisionVolumesKernel<ROTATION>();
 		}
 	}
 
 	// Apply spring forces
 	for (int i = 0, size = springs.size(); i < size; ++i) {
-		springs[i].ApplyForce(deltaTime);
+		springs[i].ApplyForceKernel<INTEGRATOR>(deltaTime);
 	}
 
 	// Same as above, apply spring forces for cloths
 	for (int i = 0, size = cloths.size(); i < size; ++i) {
-		cloths[i]->ApplySpringForces(deltaTime);
+		cloths[i]->ApplySpringForcesKernel<INTEGRATOR>(deltaTime);
+	}
+
+	// Same as above, all springs of a network at once
+	for (int i = 0, size = springNetworks.size(); i < size; ++i) {
+		springNetworks[i]->ApplySpringForcesKernel<INTEGRATOR>(deltaTime);
 	}
 
 	// Solve constraints
 	for (int i = 0, size = bodies.size(); i < size; ++i) {
-		bodies[i]->SolveConstraints(constraints);
+		if (bodies[i]->type == RIGIDBODY_TYPE_PARTICLE) {
+			((Particle*)bodies[i])->SolveConstraintsKernel<INTEGRATOR>(constraints);
+		}
+		else {
+			bodies[i]->SolveConstraints(constraints);
+		}
 	}
 
 	// Same as above, solve cloth constraints
 	for (int i = 0, size = cloths.size(); i < size; ++i) {
-		cloths[i]->SolveConstraints(constraints);
+		cloths[i]->SolveConstraintsKernel<INTEGRATOR>(constraints);
+	}
+
+	// Same as above, solve particle system constraints
+	for (int i = 0, size = particleSystems.size(); i < size; ++i) {
+		particleSystems[i]->SolveConstraintsKernel<INTEGRATOR>(constraints);
+	}
+	for (int i = 0, size = springNetworks.size(); i < size; ++i) {
+		springNetworks[i]->SolveConstraintsKernel<INTEGRATOR>(constraints);
+	}
+
+	// Fluids integrate and solve constraints in their own sub steps
+	for (int i = 0, size = fluids.size(); i < size; ++i) {
+		fluids[i]->StepKernel<INTEGRATOR>(deltaTime, constraints);
+	}
+
+	// Cloths against rigidbodies (both ways) and static models
+	for (int i = 0, size = cloths.size(); i < size; ++i) {
+		cloths[i]->SolveRigidbodiesKernel<INTEGRATOR, ROTATION>(bodies);
+		cloths[i]->SolveModelsKernel<INTEGRATOR>(models);
 	}
 }
 
@@ -256,6 +340,17 @@ void PhysicsSystem::Render() {
 	for (int i = 0, size = cloths.size(); i < size; ++i) {
 		cloths[i]->Render(DebugRender);
 	}
+
+	// Render all particle systems
+	for (int i = 0, size = particleSystems.size(); i < size; ++i) {
+		particleSystems[i]->Render();
+	}
+	for (int i = 0, size = fluids.size(); i < size; ++i) {
+		fluids[i]->Render();
+	}
+	for (int i = 0, size = springNetworks.size(); i < size; ++i) {
+		springNetworks[i]->Render(DebugRender);
+	}
 }
 
 void PhysicsSystem::AddRigidbody(Rigidbody* body) {
@@ -288,4 +383,36 @@ void PhysicsSystem::AddCloth(Cloth* cloth) {
 
 void PhysicsSystem::ClearCloths() {
 	cloths.clear();
-}
\ No newline at end of file
+}
+
+void PhysicsSystem::AddModel(Model* model) {
+	models.push_back(model);
+}
+
+void PhysicsSystem::ClearModels() {
+	models.clear();
+}
+
+void PhysicsSystem::AddParticleSystem(ParticleSystem* system) {
+	particleSystems.push_back(system);
+}
+
+void PhysicsSystem::ClearParticleSystems() {
+	particleSystems.clear();
+}
+
+void PhysicsSystem::AddFluid(FluidSystem* fluid) {
+	fluids.push_back(fluid);
+}
+
+void PhysicsSystem::ClearFluids() {
+	fluids.clear();
+}
+
+void PhysicsSystem::AddSpringNetwork(SpringNetwork* network) {
+	springNetworks.push_back(network);
+}
+
+void PhysicsSystem::ClearSpringNetworks() {
+	springNetworks.clear();
+}
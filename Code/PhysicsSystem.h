@@ -1,44 +1,68 @@
-#ifndef _H_PHYSICS_SYSTEM_REFACTORED_
-#define _H_PHYSICS_SYSTEM_REFACTORED_
+#ifndef _H_PHYSICS_SYSTEM_
+#define _H_PHYSICS_SYSTEM_
 
-#include "RigidBody.h"
-#include "ElasticSpring.h"
-#include "Fabric.h"
+#include "Rigidbody.h"
+#include "Spring.h"
+#include "Cloth.h"
+#include "ParticleSystem.h"
+#include "FluidSystem.h"
+#include "SpringNetwork.h"
 
-class PhysicsSystemRefactored {
+class PhysicsSystem {
 protected:
-	std::vector<RigidBody*> dynamicBodies;
-	std::vector<Fabric*> fabricSimulations;
-	std::vector<AABB> collisionConstraints;
-	std::vector<ElasticSpring> elasticSprings;
-
-	std::vector<RigidBody*> collidingObjects1;
-	std::vector<RigidBody*> collidingObjects2;
-	std::vector<CollisionContact> collisionResults;
+	std::vector<Rigidbody*> bodies;
+	std::vector<Cloth*> cloths;
+	std::vector<OBB> constraints;
+	std::vector<Spring> springs;
+	std::vector<Model*> models; // Static mesh colliders for cloths
+	std::vector<ParticleSystem*> particleSystems;
+	std::vector<FluidSystem*> fluids;
+	std::vector<SpringNetwork*> springNetworks;
+
+	std::vector<Rigidbody*> colliders1;
+	std::vector<Rigidbody*> colliders2;
+	std::vector<CollisionManifold> results;
+protected:
+	// One specialization per model combination, selected once per Update
+	template<int INTEGRATOR, int ROTATION, int FRICTION>
+	void Step(float deltaTime);
 public:
-	float LinearProjectionFactor; // [0.2 to 0.8], Smaller = less jitter / more penetration
-	float PenetrationThreshold;   // [0.01 to 0.1], Smaller = more accuracy
-	int ImpulseResolutionIterations;
+	float LinearProjectionPercent; // [0.2 to 0.8], Smaller = less jitter / more penetration
+	float PenetrationSlack; // [0.01 to 0.1],  Smaller = more accurate
+	int ImpulseIteration;
+
+	// Simulation models, can be changed between frames
+	int Integrator; // INTEGRATOR_*, see Particle.h
+	int RotationModel; // ROTATION_MODEL_*, see RigidbodyVolume.h
+	int FrictionModel; // FRICTION_MODEL_*, see RigidbodyVolume.h
 
 	// Debug settings (not in the original book code)
-	bool EnableDebugRendering;
-	bool ApplyLinearProjection;
-	bool UseRandomColorsForRendering;
-
-	PhysicsSystemRefactored();
-
-	void UpdateSimulation(float deltaTime);
-	void RenderScene();
-    
-	void AddDynamicBody(RigidBody* body);
-	void AddFabricSimulation(Fabric* cloth);
-	void AddElasticSpring(const ElasticSpring& spring);
-	void AddCollisionConstraint(const AABB& constraint);
-
-	void ClearDynamicBodies();
-	void ClearCollisionConstraints();
-	void ClearElasticSprings();
-	void ClearFabricSimulations();
+	bool DebugRender;
+	bool DoLinearProjection;
+	bool RenderRandomColors;
+
+	PhysicsSystem();
+
+	void Update(float deltaTime);
+	void Render();
+
+	void AddRigidbody(Rigidbody* body);
+	void AddCloth(Cloth* cloth);
+	void AddSpring(const Spring& spring);
+	void AddConstraint(const OBB& constraint);
+	void AddModel(Model* model);
+	void AddParticleSystem(ParticleSystem* system);
+	void AddFluid(FluidSystem* fluid);
+	void AddSpringNetwork(SpringNetwork* network);
+
+	void ClearRigidbodys();
+	void ClearConstraints();
+	void ClearSprings();
+	void ClearCloths();
+	void ClearModels();
+	void ClearParticleSystems();
+	void ClearFluids();
+	void ClearSpringNetworks();
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,120 @@
+#include "QueryBatch.h"
+#include "RayPacket.h"
+#include "Threading.h"
+
+// The work is split over whole packets, so the same rays share a packet no
+// matter how many threads there are. The packet and single ray triangle tests
+// can disagree on an edge, a different split could change the results.
+static inline void GetPacketRange(int count, int beginPacket, int endPacket, int* outBegin, int* outEnd) {
+	*outBegin = beginPacket * RAY_PACKET_SIZE;
+	*outEnd = (endPacket * RAY_PACKET_SIZE < count) ? endPacket * RAY_PACKET_SIZE : count;
+}
+
+void MeshRaycastBatch(const Mesh& mesh, const Ray* rays, int count, RaycastResult* outResults) {
+	int numPackets = (count + RAY_PACKET_SIZE - 1) / RAY_PACKET_SIZE;
+	ParallelFor(numPackets, QUERY_BATCH_CHUNK / RAY_PACKET_SIZE, [&](int beginPacket, int endPacket) {
+		int begin, end;
+		GetPacketRange(count, beginPacket, endPacket, &begin, &end);
+		MeshRays(mesh, rays + begin, end - begin, outResults + begin);
+	});
+}
+
+void ModelRaycastBatch(const Model& model, const Ray* rays, int count, RaycastResult* outResults) {
+	int numPackets = (count + RAY_PACKET_SIZE - 1) / RAY_PACKET_SIZE;
+	ParallelFor(numPackets, QUERY_BATCH_CHUNK / RAY_PACKET_SIZE, [&](int beginPacket, int endPacket) {
+		int begin, end;
+		GetPacketRange(count, beginPacket, endPacket, &begin, &end);
+		ModelRays(model, rays + begin, end - begin, outResults + begin);
+	});
+}
+
+void MeshLinetestBatch(const Mesh& mesh, const Line* lines, int count, bool* outHits) {
+	ParallelFor(count, QUERY_BATCH_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			outHits[i] = Linetest(mesh, lines[i]);
+		}
+	});
+}
+
+void MeshSphereBatch(const Mesh& mesh, const Sphere* spheres, int count, bool* outHits) {
+	ParallelFor(count, QUERY_BATCH_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			outHits[i] = MeshSphere(mesh, spheres[i]);
+		}
+	});
+}
+
+void MeshAABBBatch(const Mesh& mesh, const AABB* boxes, int count, bool* outHits) {
+	ParallelFor(count, QUERY_BATCH_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			outHits[i] = MeshAABB(mesh, boxes[i]);
+		}
+	});
+}
+
+// The model versions move every query into model space like the single
+// query functions do, but only invert the world matrix once per batch.
+
+// A model without a mesh misses every query
+static bool ClearBatch(const Model& model, int count, bool* outHits) {
+	if (model.GetMesh() != 0) {
+		return false;
+	}
+	for (int i = 0; i < count; ++i) {
+		outHits[i] = false;
+	}
+	return true;
+}
+
+void ModelLinetestBatch(const Model& model, const Line* lines, int count, bool* outHits) {
+	if (ClearBatch(model, count, outHits)) {
+		return;
+	}
+	const Mesh& mesh = *(model.GetMesh());
+	mat4 inv = Inverse(GetWorldMatrix(model));
+
+	ParallelFor(count, QUERY_BATCH_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			Line local;
+			local.start = MultiplyPoint(lines[i].start, inv);
+			local.end = MultiplyPoint(lines[i].end, inv);
+			outHits[i] = Linetest(mesh, local);
+		}
+	});
+}
+
+void ModelSphereBatch(const Model& model, const Sphere* spheres, int count, bool* outHits) {
+	if (ClearBatch(model, count, outHits)) {
+		return;
+	}
+	const Mesh& mesh = *(model.GetMesh());
+	mat4 inv = Inverse(GetWorldMatrix(model));
+
+	ParallelFor(count, QUERY_BATCH_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			Sphere local;
+			local.position = MultiplyPoint(spheres[i].position, inv);
+			local.radius = spheres[i].radius;
+			outHits[i] = MeshSphere(mesh, local);
+		}
+	});
+}
+
+void ModelAABBBatch(const Model& model, const AABB* boxes, int count, bool* outHits) {
+	if (ClearBatch(model, count, outHits)) {
+		return;
+	}
+	const Mesh& mesh = *(model.GetMesh());
+	mat4 inv = Inverse(GetWorldMatrix(model));
+	mat3 orientation = Cut(inv, 3, 3);
+
+	ParallelFor(count, QUERY_BATCH_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			OBB local;
+			local.size = boxes[i].size;
+			local.position = MultiplyPoint(boxes[i].position, inv);
+			local.orientation = orientation;
+			outHits[i] = MeshOBB(mesh, local);
+		}
+	});
+}
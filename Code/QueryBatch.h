@@ -0,0 +1,27 @@
+#ifndef _H_QUERY_BATCH_
+#define _H_QUERY_BATCH_
+
+#include "Geometry3D.h"
+
+// Many queries against one mesh or model per call. The queries are split
+// over the worker threads (Threading.h), every thread walks the BVH with
+// its own stack. outResults / outHits must have room for count entries,
+// entry i is the answer to query i. Scene::Raycast has a batch version too.
+
+#define QUERY_BATCH_CHUNK 64 // Fewest queries a thread takes at once, a multiple of RAY_PACKET_SIZE
+
+// Closest hits, traced as ray packets (RayPacket.h)
+void MeshRaycastBatch(const Mesh& mesh, const Ray* rays, int count, RaycastResult* outResults);
+void ModelRaycastBatch(const Model& model, const Ray* rays, int count, RaycastResult* outResults);
+
+// Any hit, for line of sight. outHits[i] is true if line i is blocked.
+void MeshLinetestBatch(const Mesh& mesh, const Line* lines, int count, bool* outHits);
+void ModelLinetestBatch(const Model& model, const Line* lines, int count, bool* outHits);
+
+void MeshSphereBatch(const Mesh& mesh, const Sphere* spheres, int count, bool* outHits);
+void ModelSphereBatch(const Model& model, const Sphere* spheres, int count, bool* outHits);
+
+void MeshAABBBatch(const Mesh& mesh, const AABB* boxes, int count, bool* outHits);
+void ModelAABBBatch(const Model& model, const AABB* boxes, int count, bool* outHits);
+
+#endif
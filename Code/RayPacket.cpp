@@ -0,0 +1,232 @@
+#include "RayPacket.h"
+#include "Simd.h"
+#include "TreeBuild.h"
+#include <cmath>
+#include <cfloat>
+
+#ifdef SIMD_SSE
+
+// One ray per lane, lanes without a ray are masked out by active
+struct RayPacket {
+	__m128 originX, originY, originZ;
+	__m128 directionX, directionY, directionZ;
+	__m128 invDirectionX, invDirectionY, invDirectionZ;
+	__m128 closestT;
+	__m128i closestTriangle;
+	__m128 active;
+	vec3 directionSign; // Shared by every ray, +1 or -1 per axis
+};
+
+static inline __m128 Select(__m128 mask, __m128 a, __m128 b) {
+	return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+// Rays that enter the node before their closest hit
+static inline int PacketBounds(const RayPacket& packet, const LinearBVHNode& node) {
+	__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.min.x), packet.originX), packet.invDirectionX);
+	__m128 t2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.max.x), packet.originX), packet.invDirectionX);
+	__m128 t3 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.min.y), packet.originY), packet.invDirectionY);
+	__m128 t4 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.max.y), packet.originY), packet.invDirectionY);
+	__m128 t5 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.min.z), packet.originZ), packet.invDirectionZ);
+	__m128 t6 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(node.max.z), packet.originZ), packet.invDirectionZ);
+
+	__m128 tmin = _mm_max_ps(_mm_max_ps(_mm_min_ps(t1, t2), _mm_min_ps(t3, t4)), _mm_min_ps(t5, t6));
+	__m128 tmax = _mm_min_ps(_mm_min_ps(_mm_max_ps(t1, t2), _mm_max_ps(t3, t4)), _mm_max_ps(t5, t6));
+
+	__m128 hit = _mm_and_ps(_mm_cmpge_ps(tmax, _mm_setzero_ps()), _mm_cmple_ps(tmin, tmax));
+	hit = _mm_and_ps(hit, _mm_cmple_ps(tmin, packet.closestT));
+	return _mm_movemask_ps(_mm_and_ps(hit, packet.active));
+}
+
+// Moller-Trumbore, back faces are culled like Raycast(Triangle)
+static inline void PacketTriangle(RayPacket& packet, const Triangle& triangle, int index) {
+	vec3 e1 = triangle.b - triangle.a;
+	vec3 e2 = triangle.c - triangle.a;
+	__m128 e1x = _mm_set1_ps(e1.x), e1y = _mm_set1_ps(e1.y), e1z = _mm_set1_ps(e1.z);
+	__m128 e2x = _mm_set1_ps(e2.x), e2y = _mm_set1_ps(e2.y), e2z = _mm_set1_ps(e2.z);
+
+	// p = direction x e2
+	__m128 px = _mm_sub_ps(_mm_mul_ps(packet.directionY, e2z), _mm_mul_ps(packet.directionZ, e2y));
+	__m128 py = _mm_sub_ps(_mm_mul_ps(packet.directionZ, e2x), _mm_mul_ps(packet.directionX, e2z));
+	__m128 pz = _mm_sub_ps(_mm_mul_ps(packet.directionX, e2y), _mm_mul_ps(packet.directionY, e2x));
+	__m128 det = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, px), _mm_mul_ps(e1y, py)), _mm_mul_ps(e1z, pz));
+	__m128 mask = _mm_and_ps(packet.active, _mm_cmpgt_ps(det, _mm_setzero_ps()));
+	if (_mm_movemask_ps(mask) == 0) {
+		return;
+	}
+	__m128 invDet = _mm_div_ps(_mm_set1_ps(1.0f), det);
+
+	__m128 sx = _mm_sub_ps(packet.originX, _mm_set1_ps(triangle.a.x));
+	__m128 sy = _mm_sub_ps(packet.originY, _mm_set1_ps(triangle.a.y));
+	__m128 sz = _mm_sub_ps(packet.originZ, _mm_set1_ps(triangle.a.z));
+	__m128 u = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, px), _mm_mul_ps(sy, py)), _mm_mul_ps(sz, pz)), invDet);
+
+	// q = s x e1
+	__m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+	__m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+	__m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+	__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(packet.directionX, qx), _mm_mul_ps(packet.directionY, qy)), _mm_mul_ps(packet.directionZ, qz)), invDet);
+	__m128 t = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)), _mm_mul_ps(e2z, qz)), invDet);
+
+	__m128 zero = _mm_setzero_ps();
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(u, zero), _mm_cmpge_ps(v, zero)));
+	mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), _mm_set1_ps(1.0f)));
+	mask = _mm_and_ps(mask, _mm_and_ps(_mm_cmpge_ps(t, zero), _mm_cmplt_ps(t, packet.closestT)));
+
+	packet.closestT = Select(mask, t, packet.closestT);
+	packet.closestTriangle = _mm_castps_si128(Select(mask, _mm_castsi128_ps(_mm_set1_epi32(index)), _mm_castsi128_ps(packet.closestTriangle)));
+}
+
+// Depth first, the child on the side the rays come from is visited first
+static void TracePacket(const Mesh& mesh, RayPacket& packet) {
+	int stack[BVH_STACK_SIZE];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while (stackSize > 0) {
+		int i = stack[--stackSize];
+		const LinearBVHNode& node = mesh.accelerator[i];
+		if (PacketBounds(packet, node) == 0) {
+			continue;
+		}
+
+		if (node.numTriangles > 0) {
+			for (int j = node.offset; j < node.offset + node.numTriangles; ++j) {
+				PacketTriangle(packet, GetTriangle(mesh, j), j);
+			}
+			continue;
+		}
+
+		int left = i + 1;
+		int right = (mesh.accelerator[left].numTriangles > 0) ? left + 1 : mesh.accelerator[left].offset;
+		const LinearBVHNode& l = mesh.accelerator[left];
+		const LinearBVHNode& r = mesh.accelerator[right];
+
+		// The children were split along the axis their centers are furthest apart on
+		vec3 separation = (r.min + r.max) - (l.min + l.max);
+		int axis = (fabsf(separation.x) > fabsf(separation.y)) ? 0 : 1;
+		axis = (fabsf(separation.z) > fabsf(separation.asArray[axis])) ? 2 : axis;
+		bool leftFirst = separation.asArray[axis] * packet.directionSign.asArray[axis] >= 0.0f;
+
+		// Near child is pushed last, so it's popped first
+		stack[stackSize++] = leftFirst ? right : left;
+		stack[stackSize++] = leftFirst ? left : right;
+	}
+}
+
+// True if all rays have the same direction signs
+static bool IsCoherent(const Ray* rays, int numRays) {
+	for (int i = 1; i < numRays; ++i) {
+		for (int axis = 0; axis < 3; ++axis) {
+			if ((rays[i].direction.asArray[axis] < 0.0f) != (rays[0].direction.asArray[axis] < 0.0f)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void MeshRayPacket(const Mesh& mesh, const Ray* rays, int numRays, RaycastResult* outResults) {
+	float data[10][RAY_PACKET_SIZE];
+	float active[RAY_PACKET_SIZE];
+	for (int i = 0; i < RAY_PACKET_SIZE; ++i) {
+		const Ray& ray = rays[(i < numRays) ? i : 0]; // Unused lanes repeat the first ray
+		data[0][i] = ray.origin.x;
+		data[1][i] = ray.origin.y;
+		data[2][i] = ray.origin.z;
+		data[3][i] = ray.direction.x;
+		data[4][i] = ray.direction.y;
+		data[5][i] = ray.direction.z;
+		vec3 invDirection = GetInverseDirection(ray);
+		data[6][i] = invDirection.x;
+		data[7][i] = invDirection.y;
+		data[8][i] = invDirection.z;
+		data[9][i] = FLT_MAX;
+		active[i] = (i < numRays) ? 1.0f : 0.0f;
+	}
+
+	RayPacket packet;
+	packet.originX = _mm_loadu_ps(data[0]);
+	packet.originY = _mm_loadu_ps(data[1]);
+	packet.originZ = _mm_loadu_ps(data[2]);
+	packet.directionX = _mm_loadu_ps(data[3]);
+	packet.directionY = _mm_loadu_ps(data[4]);
+	packet.directionZ = _mm_loadu_ps(data[5]);
+	packet.invDirectionX = _mm_loadu_ps(data[6]);
+	packet.invDirectionY = _mm_loadu_ps(data[7]);
+	packet.invDirectionZ = _mm_loadu_ps(data[8]);
+	packet.closestT = _mm_loadu_ps(data[9]);
+	packet.closestTriangle = _mm_set1_epi32(-1);
+	packet.active = _mm_cmpgt_ps(_mm_loadu_ps(active), _mm_setzero_ps());
+	for (int axis = 0; axis < 3; ++axis) {
+		packet.directionSign.asArray[axis] = (rays[0].direction.asArray[axis] < 0.0f) ? -1.0f : 1.0f;
+	}
+
+	TracePacket(mesh, packet);
+
+	float closestT[RAY_PACKET_SIZE];
+	int closestTriangle[RAY_PACKET_SIZE];
+	_mm_storeu_ps(closestT, packet.closestT);
+	_mm_storeu_si128((__m128i*)closestTriangle, packet.closestTriangle);
+	for (int i = 0; i < numRays; ++i) {
+		RaycastResult* result = &outResults[i];
+		ResetRaycastResult(result);
+		if (closestTriangle[i] < 0) {
+			continue;
+		}
+		Triangle triangle = GetTriangle(mesh, closestTriangle[i]);
+		result->t = closestT[i];
+		result->hit = true;
+		result->point = rays[i].origin + rays[i].direction * closestT[i];
+		result->normal = Normalized(Cross(triangle.b - triangle.a, triangle.c - triangle.a));
+		result->triangle = closestTriangle[i];
+	}
+}
+
+#endif
+
+void MeshRays(const Mesh& mesh, const Ray* rays, int numRays, RaycastResult* outResults) {
+	for (int first = 0; first < numRays; first += RAY_PACKET_SIZE) {
+		int count = (numRays - first < RAY_PACKET_SIZE) ? numRays - first : RAY_PACKET_SIZE;
+#ifdef SIMD_SSE
+		if (mesh.accelerator != 0 && IsCoherent(rays + first, count)) {
+			MeshRayPacket(mesh, rays + first, count, outResults + first);
+			continue;
+		}
+#endif
+		for (int i = first; i < first + count; ++i) {
+			MeshRay(mesh, rays[i], &outResults[i]);
+		}
+	}
+}
+
+void ModelRays(const Model& model, const Ray* rays, int numRays, RaycastResult* outResults) {
+	if (model.GetMesh() == 0) {
+		for (int i = 0; i < numRays; ++i) {
+			ResetRaycastResult(&outResults[i]);
+		}
+		return;
+	}
+
+	mat4 world = GetWorldMatrix(model);
+	mat4 inv = Inverse(world);
+	std::vector<Ray> local(numRays);
+	for (int i = 0; i < numRays; ++i) {
+		local[i].origin = MultiplyPoint(rays[i].origin, inv);
+		local[i].direction = MultiplyVector(rays[i].direction, inv);
+		local[i].NormalizeDirection();
+	}
+
+	if (numRays > 0) {
+		MeshRays(*(model.GetMesh()), &local[0], numRays, outResults);
+	}
+
+	// Back to world space, the world matrix has no scale
+	for (int i = 0; i < numRays; ++i) {
+		if (outResults[i].hit) {
+			outResults[i].point = MultiplyPoint(outResults[i].point, world);
+			outResults[i].normal = Normalized(MultiplyVector(outResults[i].normal, world));
+			outResults[i].t = Magnitude(outResults[i].point - rays[i].origin);
+		}
+	}
+}
@@ -0,0 +1,21 @@
+#ifndef _H_RAY_PACKET_
+#define _H_RAY_PACKET_
+
+#include "Geometry3D.h"
+
+// Traces rays through the mesh BVH RAY_PACKET_SIZE at a time. A packet
+// loads every node once and tests it against all of its rays with SSE,
+// leaves use a 4 wide Moller-Trumbore test. The rays of a packet share
+// one traversal order, so they must point the same way (same direction
+// signs). Packets that don't are traced one ray at a time with MeshRay.
+
+#define RAY_PACKET_SIZE 4
+
+// Closest hit of every ray, outResults has numRays entries. Consecutive
+// rays make a packet, keep coherent rays (sensor sweeps, line of sight
+// fans) next to each other.
+void MeshRays(const Mesh& mesh, const Ray* rays, int numRays, RaycastResult* outResults);
+// Same as MeshRays, rays and results are in world space
+void ModelRays(const Model& model, const Ray* rays, int numRays, RaycastResult* outResults);
+
+#endif
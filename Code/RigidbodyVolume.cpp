@@ -6,7 +6,6 @@ void RigidbodyVolume::ApplyForces() {
 	forces = GRAVITY_CONST * mass;
 }
 
-#ifndef LINEAR_ONLY
 void  RigidbodyVolume::AddRotationalImpulse(const vec3& point, const vec3& impulse) {
 	vec3 centerOfMass = position;
 	vec3 torque = Cross(point - centerOfMass, impulse);
@@ -14,7 +13,6 @@ void  RigidbodyVolume::AddRotationalImpulse(const vec3& point, const vec3& impul
 	vec3 angAccel = MultiplyVector(torque, InvTensor());
 	angVel = angVel + angAccel;
 }
-#endif
 
 void RigidbodyVolume::AddLinearImpulse(const vec3& impulse) {
 	velocity = velocity + impulse;
@@ -27,17 +25,22 @@ float RigidbodyVolume::InvMass() {
 	return 1.0f / mass;
 }
 
-void RigidbodyVolume::SynchCollisionVolumes() {
+template<int ROTATION>
+void RigidbodyVolume::SynchCollisionVolumesKernel() {
 	sphere.position = position;
 	box.position = position;
 
-#ifndef LINEAR_ONLY
-	box.orientation = Rotation3x3(
-		RAD2DEG(orientation.x),
-		RAD2DEG(orientation.y),
-		RAD2DEG(orientation.z)
-	);
-#endif
+	if (ROTATION == ROTATION_MODEL_ANGULAR) {
+		box.orientation = Rotation3x3(
+			RAD2DEG(orientation.x),
+			RAD2DEG(orientation.y),
+			RAD2DEG(orientation.z)
+		);
+	}
+}
+
+void RigidbodyVolume::SynchCollisionVolumes() {
+	SynchCollisionVolumesKernel<ROTATION_MODEL_DEFAULT>();
 }
 
 void RigidbodyVolume::Render() {
@@ -51,7 +54,6 @@ void RigidbodyVolume::Render() {
 	}
 }
 
-#ifndef LINEAR_ONLY
 mat4 RigidbodyVolume::InvTensor() {
 	if (mass == 0) {
 		return mat4(
@@ -95,9 +97,9 @@ mat4 RigidbodyVolume::InvTensor() {
 		0, 0, iz, 0,
 		0, 0, 0, iw));
 }
-#endif
 
-void RigidbodyVolume::Update(float dt) {
+template<int ROTATION>
+void RigidbodyVolume::UpdateKernel(float dt) {
 	// Integrate velocity
 	const float damping = 0.98f;
 
@@ -115,8 +117,7 @@ void RigidbodyVolume::Update(float dt) {
 		velocity.z = 0.0f;
 	}
 
-#ifndef LINEAR_ONLY
-	if (type == RIGIDBODY_TYPE_BOX) {
+	if (ROTATION == ROTATION_MODEL_ANGULAR && type == RIGIDBODY_TYPE_BOX) {
 		vec3 angAccel = MultiplyVector(torques, InvTensor());
 		angVel = angVel + angAccel * dt;
 		angVel = angVel *  damping;
@@ -131,18 +132,24 @@ void RigidbodyVolume::Update(float dt) {
 			angVel.z = 0.0f;
 		}
 	}
-#endif
 
 	// Integrate position
 	position = position + velocity * dt;
 
-#ifndef LINEAR_ONLY
-	if (type == RIGIDBODY_TYPE_BOX) {
+	if (ROTATION == ROTATION_MODEL_ANGULAR && type == RIGIDBODY_TYPE_BOX) {
 		orientation = orientation + angVel * dt;
 	}
-#endif
 
-	SynchCollisionVolumes();
+	SynchCollisionVolumesKernel<ROTATION>();
+}
+
+template void RigidbodyVolume::UpdateKernel<ROTATION_MODEL_LINEAR_ONLY>(float dt);
+template void RigidbodyVolume::UpdateKernel<ROTATION_MODEL_ANGULAR>(float dt);
+template void RigidbodyVolume::SynchCollisionVolumesKernel<ROTATION_MODEL_LINEAR_ONLY>();
+template void RigidbodyVolume::SynchCollisionVolumesKernel<ROTATION_MODEL_ANGULAR>();
+
+void RigidbodyVolume::Update(float dt) {
+	UpdateKernel<ROTATION_MODEL_DEFAULT>(dt);
 }
 
 CollisionManifold FindCollisionFeatures(RigidbodyVolume& ra, RigidbodyVolume& rb) {
@@ -171,7 +178,8 @@ CollisionManifold FindCollisionFeatures(RigidbodyVolume& ra, RigidbodyVolume& rb
 	return result;
 }
 
-void ApplyImpulse(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifold& M, int c) {
+template<int ROTATION, int FRICTION>
+void ApplyImpulseKernel(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifold& M, int c) {
 	// Linear impulse
 	float invMass1 = A.InvMass();
 	float invMass2 = B.InvMass();
@@ -181,19 +189,20 @@ void ApplyImpulse(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifol
 		return; // Both objects have infinate mass!
 	}
 
-#ifndef LINEAR_ONLY
-	vec3 r1 = M.contacts[c] - A.position;
-	vec3 r2 = M.contacts[c] - B.position;
-	mat4 i1 = A.InvTensor();
-	mat4 i2 = B.InvTensor();
-#endif
+	vec3 r1, r2;
+	mat4 i1, i2;
+	if (ROTATION == ROTATION_MODEL_ANGULAR) {
+		r1 = M.contacts[c] - A.position;
+		r2 = M.contacts[c] - B.position;
+		i1 = A.InvTensor();
+		i2 = B.InvTensor();
+	}
 
 	// Relative velocity
-#ifndef LINEAR_ONLY
-	vec3 relativeVel = (B.velocity + Cross(B.angVel, r2)) - (A.velocity + Cross(A.angVel, r1));
-#else
 	vec3 relativeVel = B.velocity - A.velocity;
-#endif
+	if (ROTATION == ROTATION_MODEL_ANGULAR) {
+		relativeVel = (B.velocity + Cross(B.angVel, r2)) - (A.velocity + Cross(A.angVel, r1));
+	}
 	// Relative collision normal
 	vec3 relativeNorm = M.normal;
 	Normalize(relativeNorm);
@@ -207,13 +216,12 @@ void ApplyImpulse(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifol
 
 	float numerator = (-(1.0f + e) * Dot(relativeVel, relativeNorm));
 	float d1 = invMassSum;
-#ifndef LINEAR_ONLY
-	vec3 d2 = Cross(MultiplyVector(Cross(r1, relativeNorm), i1), r1);
-	vec3 d3 = Cross(MultiplyVector(Cross(r2, relativeNorm), i2), r2);
-	float denominator = d1 + Dot(relativeNorm, d2 + d3);
-#else
 	float denominator = d1;
-#endif
+	if (ROTATION == ROTATION_MODEL_ANGULAR) {
+		vec3 d2 = Cross(MultiplyVector(Cross(r1, relativeNorm), i1), r1);
+		vec3 d3 = Cross(MultiplyVector(Cross(r2, relativeNorm), i2), r2);
+		denominator = d1 + Dot(relativeNorm, d2 + d3);
+	}
 
 	float j = (denominator == 0.0f) ? 0.0f : numerator / denominator;
 	if (M.contacts.size() > 0.0f && j != 0.0f) {
@@ -224,10 +232,10 @@ void ApplyImpulse(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifol
 	A.velocity = A.velocity - impulse *  invMass1;
 	B.velocity = B.velocity + impulse *  invMass2;
 
-#ifndef LINEAR_ONLY
-	A.angVel = A.angVel - MultiplyVector(Cross(r1, impulse), i1);
-	B.angVel = B.angVel + MultiplyVector(Cross(r2, impulse), i2);
-#endif
+	if (ROTATION == ROTATION_MODEL_ANGULAR) {
+		A.angVel = A.angVel - MultiplyVector(Cross(r1, impulse), i1);
+		B.angVel = B.angVel + MultiplyVector(Cross(r2, impulse), i2);
+	}
 
 	// Friction
 	vec3 t = relativeVel - (relativeNorm * Dot(relativeVel, relativeNorm));
@@ -238,13 +246,12 @@ void ApplyImpulse(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifol
 
 	numerator = -Dot(relativeVel, t);
 	d1 = invMassSum;
-#ifndef LINEAR_ONLY
-	d2 = Cross(MultiplyVector(Cross(r1, t), i1), r1);
-	d3 = Cross(MultiplyVector(Cross(r2, t), i2), r2);
-	denominator = d1 + Dot(t, d2 + d3);
-#else
 	denominator = d1;
-#endif
+	if (ROTATION == ROTATION_MODEL_ANGULAR) {
+		vec3 d2 = Cross(MultiplyVector(Cross(r1, t), i1), r1);
+		vec3 d3 = Cross(MultiplyVector(Cross(r2, t), i2), r2);
+		denominator = d1 + Dot(t, d2 + d3);
+	}
 
 	float jt = (denominator == 0.0f) ? 0.0f : numerator / denominator;
 	if (M.contacts.size() > 0.0f && jt != 0.0f) {
@@ -256,31 +263,41 @@ void ApplyImpulse(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifol
 	}
 
 	vec3 tangentImpuse;
-#ifdef DYNAMIC_FRICTION
-	float sf = sqrtf(A.staticFriction * B.staticFriction);
-	float df = sqrtf(A.dynamicFriction * B.dynamicFriction);
-	if (fabsf(jt) < j * sf) {
-		tangentImpuse = t * jt;
+	if (FRICTION == FRICTION_MODEL_DYNAMIC) {
+		float sf = sqrtf(A.staticFriction * B.staticFriction);
+		float df = sqrtf(A.dynamicFriction * B.dynamicFriction);
+		if (fabsf(jt) < j * sf) {
+			tangentImpuse = t * jt;
+		}
+		else {
+			tangentImpuse = t * -j * df;
+		}
 	}
 	else {
-		tangentImpuse = t * -j * df;
-	}
-#else
-	float friction = sqrtf(A.friction * B.friction);
-	if (jt > j * friction) {
-		jt = j * friction;
-	}
-	else if (jt < -j * friction) {
-		jt = -j * friction;
+		float friction = sqrtf(A.friction * B.friction);
+		if (jt > j * friction) {
+			jt = j * friction;
+		}
+		else if (jt < -j * friction) {
+			jt = -j * friction;
+		}
+		tangentImpuse = t * jt;
 	}
-	tangentImpuse = t * jt;
-#endif
 
 	A.velocity = A.velocity - tangentImpuse *  invMass1;
 	B.velocity = B.velocity + tangentImpuse *  invMass2;
 
-#ifndef LINEAR_ONLY
-	A.angVel = A.angVel - MultiplyVector(Cross(r1, tangentImpuse), i1);
-	B.angVel = B.angVel + MultiplyVector(Cross(r2, tangentImpuse), i2);
-#endif
+	if (ROTATION == ROTATION_MODEL_ANGULAR) {
+		A.angVel = A.angVel - MultiplyVector(Cross(r1, tangentImpuse), i1);
+		B.angVel = B.angVel + MultiplyVector(Cross(r2, tangentImpuse), i2);
+	}
+}
+
+template void ApplyImpulseKernel<ROTATION_MODEL_LINEAR_ONLY, FRICTION_MODEL_COULOMB>(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifold& M, int c);
+template void ApplyImpulseKernel<ROTATION_MODEL_LINEAR_ONLY, FRICTION_MODEL_DYNAMIC>(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifold& M, int c);
+template void ApplyImpulseKernel<ROTATION_MODEL_ANGULAR, FRICTION_MODEL_COULOMB>(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifold& M, int c);
+template void ApplyImpulseKernel<ROTATION_MODEL_ANGULAR, FRICTION_MODEL_DYNAMIC>(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifold& M, int c);
+
+void ApplyImpulse(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifold& M, int c) {
+	ApplyImpulseKernel<ROTATION_MODEL_DEFAULT, FRICTION_MODEL_DEFAULT>(A, B, M, c);
 }
\ No newline at end of file
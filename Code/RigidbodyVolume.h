@@ -5,30 +5,43 @@
 
 #define GRAVITY_CONST vec3(0.0f, -9.82f, 0.0f)
 
+// Rotation and friction models are template parameters of the
+// volume kernels (UpdateKernel, ApplyImpulseKernel, ...) so one
+// binary holds a specialized version of every combination.
+// PhysicsSystem picks one per world at runtime.
+
+// ROTATION_MODEL_LINEAR_ONLY ignores orientation, angular velocity
+// and torque; only linear motion is simulated.
+#define ROTATION_MODEL_LINEAR_ONLY	0
+#define ROTATION_MODEL_ANGULAR		1
+
+// FRICTION_MODEL_COULOMB clamps the tangent impulse by a single
+// friction coefficient. FRICTION_MODEL_DYNAMIC uses a static
+// and a dynamic coefficient.
+#define FRICTION_MODEL_COULOMB		0
+#define FRICTION_MODEL_DYNAMIC		1
+
+// Models used by the non-template (virtual) interface
+#define ROTATION_MODEL_DEFAULT		ROTATION_MODEL_ANGULAR
+#define FRICTION_MODEL_DEFAULT		FRICTION_MODEL_COULOMB
+
 class RigidbodyVolume : public Rigidbody {
 public:
 	vec3 position;
 	vec3 velocity;
 
-#ifndef LINEAR_ONLY
 	vec3 orientation;
 	vec3 angVel;
-#endif
 
 	vec3 forces; // sumForces
-#ifndef LINEAR_ONLY
 	vec3 torques; // Sum torques
-#endif
 
 				  //vec3 inertia;
 	float mass;
 	float cor; // Coefficient of restitution
-#ifdef DYNAMIC_FRICTION
-	float staticFriction;
-	float dynamicFriction;
-#else
-	float friction;
-#endif
+	float staticFriction; // FRICTION_MODEL_DYNAMIC
+	float dynamicFriction; // FRICTION_MODEL_DYNAMIC
+	float friction; // FRICTION_MODEL_COULOMB
 
 	OBB box;
 	Sphere sphere;
@@ -36,24 +49,18 @@ public:
 
 	inline RigidbodyVolume() :
 		cor(0.5f), mass(1.0f),
-#ifdef DYNAMIC_FRICTION
 		staticFriction(0.5f),
-		dynamicFriction(0.3f)
-#else
+		dynamicFriction(0.3f),
 		friction(0.6f)
-#endif
 		{
 		type = RIGIDBODY_TYPE_BASE;
 	}
 
 	inline RigidbodyVolume(int bodyType) :
 		cor(0.5f), mass(1.0f),
-#ifdef DYNAMIC_FRICTION
 		staticFriction(0.5f),
-		dynamicFriction(0.3f)
-#else
+		dynamicFriction(0.3f),
 		friction(0.6f)
-#endif
 		{
 			type = bodyType;
 	}
@@ -64,20 +71,22 @@ public:
 	virtual void Update(float dt); // Update Position
 
 	float InvMass();
-#ifndef LINEAR_ONLY
 	mat4 InvTensor();
-#endif
 
 	virtual void ApplyForces();
 	void SynchCollisionVolumes();
 
 	virtual void AddLinearImpulse(const vec3& impulse);
-#ifndef LINEAR_ONLY
 	virtual void AddRotationalImpulse(const vec3& point, const vec3& impulse);
-#endif
+
+	template<int ROTATION> void UpdateKernel(float dt);
+	template<int ROTATION> void SynchCollisionVolumesKernel();
 };
 
 CollisionManifold FindCollisionFeatures(RigidbodyVolume& ra, RigidbodyVolume& rb);
 void ApplyImpulse(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifold& M, int c);
 
+template<int ROTATION, int FRICTION>
+void ApplyImpulseKernel(RigidbodyVolume& A, RigidbodyVolume& B, const CollisionManifold& M, int c);
+
 #endif
\ No newline at end of file
@@ -1,174 +1,824 @@
 #include "Scene.h"
+#include "Threading.h"
+#include "QueryBatch.h"
+#include "TreeBuild.h"
 #include <algorithm>
-#include <list>
+#include <cmath>
+#include <cfloat>
 
-void Scene::AddModelToScene(Model* newModel) {
-    if (std::find(sceneObjects.begin(), sceneObjects.end(), newModel) != sceneObjects.end()) {
-        // Avoid adding duplicates
-        return;
-    }
-    sceneObjects.push_back(newModel);
-}
-
-void Scene::RemoveModelFromScene(Model* modelToRemove) {
-    sceneObjects.erase(std::remove(sceneObjects.begin(), sceneObjects.end(), modelToRemove), sceneObjects.end());
-}
-
-void Scene::UpdateModelInScene(Model* modelToUpdate) {
-    // Placeholder for updating models in the scene
-}
-
-std::vector<Model*> Scene::FindChildrenOfModel(const Model* parentModel) {
-    std::vector<Model*> children;
-
-    for (int i = 0, size = sceneObjects.size(); i < size; ++i) {
-        if (sceneObjects[i] == 0 || sceneObjects[i] == parentModel) {
-            continue;
-        }
-
-        Model* iterator = sceneObjects[i]->parent;
-        if (iterator != 0) {
-            if (iterator == parentModel) {
-                children.push_back(sceneObjects[i]);
-                continue;
-            }
-            iterator = iterator->parent;
-        }
-    }
-
-    return children;
-}
-
-Model* Scene::PerformRaycast(const Ray& ray) {
-    if (sceneOctree != 0) {
-        return ::PerformRaycast(sceneOctree, ray);
-    }
-
-    Model* closestModel = 0;
-    float closestDistance = -1;
-
-    for (int i = 0, size = sceneObjects.size(); i < size; ++i) {
-        float distance = CalculateRayModelIntersection(*sceneObjects[i], ray);
-        if (closestModel == 0 && distance >= 0) {
-            closestModel = sceneObjects[i];
-            closestDistance = distance;
-        } else if (closestModel != 0 && distance < closestDistance) {
-            closestModel = sceneObjects[i];
-            closestDistance = distance;
-        }
-    }
-
-    return closestModel;
-}
-
-std::vector<Model*> Scene::QueryModels(const Sphere& sphere) {
-    if (sceneOctree != 0) {
-        return ::QueryModels(sceneOctree, sphere);
-    }
-
-    std::vector<Model*> result;
-    for (int i = 0, size = sceneObjects.size(); i < size; ++i) {
-        OBB bounds = GetObjectOBB(*sceneObjects[i]);
-        if (CheckSphereOBBIntersection(sphere, bounds)) {
-            result.push_back(sceneObjects[i]);
-        }
-    }
-    return result;
-}
-
-std::vector<Model*> Scene::QueryModels(const AABB& aabb) {
-    if (sceneOctree != 0) {
-        return ::QueryModels(sceneOctree, aabb);
-    }
-
-    std::vector<Model*> result;
-    for (int i = 0, size = sceneObjects.size(); i < size; ++i) {
-        OBB bounds = GetObjectOBB(*sceneObjects[i]);
-        if (CheckAABBOBBIntersection(aabb, bounds)) {
-            result.push_back(sceneObjects[i]);
-        }
-    }
-    return result;
-}
-
-void SplitOctree(OctreeNode* node, int depth) {
-    if (depth-- <= 0) {
-        return;
-    }
-
-    if (node->children == 0) {
-        node->children = new OctreeNode[8];
-
-        vec3 center = node->bounds.position;
-        vec3 halfExtent = node->bounds.size * 0.5f;
-
-        node->children[0].bounds = AABB(center + vec3(-halfExtent.x, halfExtent.y, -halfExtent.z), halfExtent);
-        node->children[1].bounds = AABB(center + vec3(halfExtent.x, halfExtent.y, -halfExtent.z), halfExtent);
-        node->children[2].bounds = AABB(center + vec3(-halfExtent.x, halfExtent.y, halfExtent.z), halfExtent);
-        node->children[3].bounds = AABB(center + vec3(halfExtent.x, halfExtent.y, halfExtent.z), halfExtent);
-        node->children[4].bounds = AABB(center + vec3(-halfExtent.x, -halfExtent.y, -halfExtent.z), halfExtent);
-        node->children[5].bounds = AABB(center + vec3(halfExtent.x, -halfExtent.y, -halfExtent.z), halfExtent);
-        node->children[6].bounds = AABB(center + vec3(-halfExtent.x, -halfExtent.y, halfExtent.z), halfExtent);
-        node->children[7].bounds = AABB(center + vec3(halfExtent.x, -halfExtent.y, halfExtent.z), halfExtent);
-    }
-
-    if (node->children != 0 && node->models.size() > 0) {
-        for (int i = 0; i < 8; ++i) {
-            for (int j = 0, size = node->models.size(); j < size; ++j) {
-                OBB bounds = GetObjectOBB(*node->models[j]);
-                if (CheckAABBOBBIntersection(node->children[i].bounds, bounds)) {
-                    node->children[i].models.push_back(node->models[j]);
-                }
-            }
-        }
-        node->models.clear();
-
-        for (int i = 0; i < 8; ++i) {
-            SplitOctree(&(node->children[i]), depth);
-        }
-    }
-}
-
-void InsertIntoOctree(OctreeNode* node, Model* model) {
-    OBB bounds = GetObjectOBB(*model);
-    if (CheckAABBOBBIntersection(node->bounds, bounds)) {
-        if (node->children == 0) {
-            node->models.push_back(model);
-        } else {
-            for (int i = 0; i < 8; ++i) {
-                InsertIntoOctree(&(node->children[i]), model);
-            }
-        }
-    }
-}
-
-void RemoveFromOctree(OctreeNode* node, Model* model) {
-    if (node->children == 0) {
-        std::vector<Model*>::iterator it = std::find(node->models.begin(), node->models.end(), model);
-        if (it != node->models.end()) {
-            node->models.erase(it);
-        }
-    } else {
-        for (int i = 0; i < 8; ++i) {
-            RemoveFromOctree(&(node->children[i]), model);
-        }
-    }
-}
-
-void UpdateOctree(OctreeNode* node, Model* model) {
-    RemoveFromOctree(node, model);
-    InsertIntoOctree(node, model);
-}
-
-Model* FindClosestModel(const std::vector<Model*>& modelSet, const Ray& ray) {
-    if (modelSet.size() == 0) {
-        return 0;
-    }
-
-    Model* closestModel = 0;
-    float closestT = -1;
-
-    for (int i = 0, size = modelSet.size(); i < size; ++i) {
-        float thisT = CalculateRayModelIntersection(*modelSet[i], ray);
-
-        if (thisT < 0) {
+void Scene::AddModel(Model* model) {
+	if (std::find(objects.begin(), objects.end(), model) != objects.end()) {
+		// Duplicate object, don't add
+		return;
+	}
+	objects.push_back(model);
+	model->UpdateWorldCache();
+
+	if (octree != 0) {
+		Place(model);
+	}
+	linearDirty = true;
+}
+
+void Scene::Place(Model* model) {
+	model->UpdateWorldCache();
+
+	OctreePlacement placement;
+	placement.bounds = GetWorldAABB(*model);
+	placement.node = 0;
+	if (loose) {
+		placement.node = LooseInsert(octree, model, LOOSE_OCTREE_DEPTH);
+	}
+	else {
+		::Insert(octree, model);
+	}
+	placements[model] = placement;
+}
+
+// Nothing is removed when the bounds are identical
+static AABB NoBounds() {
+	return AABB(vec3(FLT_MAX, FLT_MAX, FLT_MAX), vec3());
+}
+
+void Scene::RemoveModel(Model* model) {
+	objects.erase(std::remove(objects.begin(), objects.end(), model), objects.end());
+
+	std::unordered_map<const Model*, OctreePlacement>::iterator it = placements.find(model);
+	if (octree != 0 && it != placements.end()) {
+		if (loose) {
+			LooseRemove(it->second.node, model);
+		}
+		else {
+			// Only walks the nodes the model was placed in
+			::Update(octree, model, it->second.bounds, NoBounds());
+		}
+		placements.erase(it);
+	}
+	linearDirty = true;
+}
+
+static bool IsSameBounds(const AABB& a, const AABB& b) {
+	return a.position.x == b.position.x && a.position.y == b.position.y && a.position.z == b.position.z &&
+		a.size.x == b.size.x && a.size.y == b.size.y && a.size.z == b.size.z;
+}
+
+// Same rules as LooseInsert. A model stays in the root only while it is too
+// large for a child or centered outside of the root.
+static bool IsInLooseNode(const OctreeNode* node, const OctreeNode* root, const AABB& bounds) {
+	float radius = fmaxf(bounds.size.x, fmaxf(bounds.size.y, bounds.size.z));
+	vec3 min = GetMin(node->bounds);
+	vec3 max = GetMax(node->bounds);
+	bool inside = true;
+	for (int i = 0; i < 3; ++i) {
+		if (bounds.position.asArray[i] < min.asArray[i] || bounds.position.asArray[i] > max.asArray[i]) {
+			inside = false;
+		}
+	}
+
+	const vec3& size = node->bounds.size;
+	float smallest = fminf(size.x, fminf(size.y, size.z));
+	if (node == root) {
+		return !inside || radius > smallest * 0.5f;
+	}
+	return inside && radius <= smallest;
+}
+
+void Scene::UpdateModel(Model* model) {
+	model->UpdateWorldCache();
+	linearDirty = true;
+	if (octree == 0) {
+		return;
+	}
+
+	std::unordered_map<const Model*, OctreePlacement>::iterator it = placements.find(model);
+	if (it == placements.end()) {
+		return;
+	}
+	OctreePlacement& placement = it->second;
+	AABB bounds = GetWorldAABB(*model);
+	if (IsSameBounds(bounds, placement.bounds)) {
+		return;
+	}
+
+	if (loose) {
+		if (!IsInLooseNode(placement.node, octree, bounds)) {
+			LooseRemove(placement.node, model);
+			placement.node = LooseInsert(octree, model, LOOSE_OCTREE_DEPTH);
+		}
+	}
+	else {
+		::Update(octree, model, placement.bounds, bounds);
+	}
+	placement.bounds = bounds;
+}
+
+void Scene::UpdateModels() {
+	for (int i = 0, size = objects.size(); i < size; ++i) {
+		UpdateModel(objects[i]);
+	}
+	RebuildLinear();
+}
+
+void Scene::RebuildLinear() {
+	if (linear == 0 || !linearDirty) {
+		return;
+	}
+	linear->Build(objects.empty() ? 0 : &objects[0], (int)objects.size(), linearRegion);
+	linearDirty = false;
+}
+
+std::vector<Model*> Scene::FindChildren(const Model* model) {
+	std::vector<Model*> result;
+	ModelVectorVisitor visitor(&result);
+	FindChildren(model, &visitor);
+	return result;
+}
+
+bool Scene::FindChildren(const Model* model, ModelVisitor* visitor) {
+	for (int i = 0, size = objects.size(); i < size; ++i) {
+		// Skip null objects
+		if (objects[i] == 0 || objects[i] == model) {
+			continue;
+		}
+
+		// Any ancestor, not only the parent
+		for (Model* iterator = objects[i]->parent; iterator != 0; iterator = iterator->parent) {
+			if (iterator == model) {
+				if (!visitor->Visit(objects[i])) {
+					return false;
+				}
+				break;
+			}
+		}
+	}
+	return true;
+}
+
+int Scene::FindChildren(const Model* model, Model** outChildren, int maxChildren) {
+	ModelBufferVisitor visitor(outChildren, maxChildren);
+	FindChildren(model, &visitor);
+	return visitor.Count();
+}
+
+Model* Scene::Raycast(const Ray& ray) {
+	if (linear != 0) {
+		RebuildLinear();
+		return linear->Raycast(ray);
+	}
+	if (octree != 0) {
+		// :: lets the compiler know to look outside class scope
+		return loose ? LooseRaycast(octree, ray) : ::Raycast(octree, ray);
+	}
+
+	Model* result = 0;
+	float result_t = -1;
+
+	for (int i = 0, size = objects.size(); i < size; ++i) {
+		float t = ModelRay(*objects[i], ray);
+		if (t < 0) {
+			continue;
+		}
+		if (result == 0 || t < result_t) {
+			result = objects[i];
+			result_t = t;
+		}
+	}
+
+	return result;
+}
+
+// The octrees are only read by a raycast, the linear one is rebuilt before
+// the threads start so no single Raycast has to
+void Scene::Raycast(const Ray* rays, int count, Model** outModels) {
+	RebuildLinear();
+	ParallelFor(count, QUERY_BATCH_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			outModels[i] = Raycast(rays[i]);
+		}
+	});
+}
+
+// A regular octree has models in every leaf they touch. Every query gets a
+// new stamp and a model was passed on already if it carries it, so every
+// model is visited once and nothing has to be reset afterwards.
+class UniqueModelVisitor : public ModelVisitor {
+protected:
+	ModelVisitor* visitor;
+	unsigned int stamp;
+public:
+	inline UniqueModelVisitor(ModelVisitor* target, unsigned int queryStamp) : visitor(target), stamp(queryStamp) { }
+	inline bool Visit(Model* model) {
+		if (model->lastQuery == stamp) {
+			return true;
+		}
+		model->lastQuery = stamp;
+		return visitor->Visit(model);
+	}
+};
+
+// Shared by every Scene, so a model in several scenes never carries the
+// stamp of another scene's current query. 0 is skipped, new models have it.
+unsigned int Scene::queryCounter = 0;
+
+unsigned int Scene::NextQueryStamp() {
+	if (++queryCounter == 0) {
+		++queryCounter;
+	}
+	return queryCounter;
+}
+
+bool Scene::Query(const Sphere& sphere, ModelVisitor* visitor) {
+	if (linear != 0) {
+		RebuildLinear();
+		return linear->Query(sphere, visitor);
+	}
+	if (octree != 0) {
+		if (loose) {
+			return LooseQuery(octree, sphere, visitor);
+		}
+		UniqueModelVisitor unique(visitor, NextQueryStamp());
+		return ::Query(octree, sphere, &unique);
+	}
+
+	for (int i = 0, size = objects.size(); i < size; ++i) {
+		OBB bounds = GetOBB(*objects[i]);
+		if (SphereOBB(sphere, bounds)) {
+			if (!visitor->Visit(objects[i])) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool Scene::Query(const AABB& aabb, ModelVisitor* visitor) {
+	if (linear != 0) {
+		RebuildLinear();
+		return linear->Query(aabb, visitor);
+	}
+	if (octree != 0) {
+		if (loose) {
+			return LooseQuery(octree, aabb, visitor);
+		}
+		UniqueModelVisitor unique(visitor, NextQueryStamp());
+		return ::Query(octree, aabb, &unique);
+	}
+
+	for (int i = 0, size = objects.size(); i < size; ++i) {
+		OBB bounds = GetOBB(*objects[i]);
+		if (AABBOBB(aabb, bounds)) {
+			if (!visitor->Visit(objects[i])) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+std::vector<Model*> Scene::Query(const Sphere& sphere) {
+	std::vector<Model*> result;
+	ModelVectorVisitor visitor(&result);
+	Query(sphere, &visitor);
+	return result;
+}
+
+std::vector<Model*> Scene::Query(const AABB& aabb) {
+	std::vector<Model*> result;
+	ModelVectorVisitor visitor(&result);
+	Query(aabb, &visitor);
+	return result;
+}
+
+int Scene::Query(const Sphere& sphere, Model** outModels, int maxModels) {
+	ModelBufferVisitor visitor(outModels, maxModels);
+	Query(sphere, &visitor);
+	return visitor.Count();
+}
+
+int Scene::Query(const AABB& aabb, Model** outModels, int maxModels) {
+	ModelBufferVisitor visitor(outModels, maxModels);
+	Query(aabb, &visitor);
+	return visitor.Count();
+}
+
+bool Scene::Accelerate(const vec3& position, float size) {
+	if (octree != 0 || linear != 0) {
+		return false;
+	}
+
+	vec3 min(position.x - size, position.y - size, position.z - size);
+	vec3 max(position.x + size, position.y + size, position.z + size);
+
+	// Construct tree root
+	octree = new OctreeNode();
+	octree->bounds = FromMinMax(min, max);
+	octree->children = 0;
+	loose = false;
+
+	placements.clear();
+	for (int i = 0, size = objects.size(); i < size; ++i) {
+		objects[i]->UpdateWorldCache();
+		octree->models.push_back(objects[i]);
+
+		OctreePlacement placement;
+		placement.node = 0;
+		placement.bounds = GetWorldAABB(*objects[i]);
+		placements[objects[i]] = placement;
+	}
+
+	// Create tree
+	SplitTree(octree, 5);
+	return true;
+}
+
+bool Scene::AccelerateLoose(const vec3& position, float size) {
+	if (octree != 0 || linear != 0) {
+		return false;
+	}
+
+	vec3 min(position.x - size, position.y - size, position.z - size);
+	vec3 max(position.x + size, position.y + size, position.z + size);
+
+	octree = new OctreeNode();
+	octree->bounds = FromMinMax(min, max);
+	octree->children = 0;
+	loose = true;
+
+	placements.clear();
+	for (int i = 0, size = objects.size(); i < size; ++i) {
+		Place(objects[i]);
+	}
+	return true;
+}
+
+bool Scene::AccelerateLinear(const vec3& position, float size) {
+	if (octree != 0 || linear != 0) {
+		return false;
+	}
+
+	vec3 min(position.x - size, position.y - size, position.z - size);
+	vec3 max(position.x + size, position.y + size, position.z + size);
+
+	linear = new LinearOctree();
+	linearRegion = FromMinMax(min, max);
+	linearDirty = true;
+	RebuildLinear();
+	return true;
+}
+
+// planes are the ones the parent crosses. Models can be in several leaves,
+// they are visited once for every one of them.
+static bool CullOctree(OctreeNode* node, const Frustum& f, int planes, ModelVisitor* visitor) {
+	if (planes != 0) {
+		planes = ClassifyPlanes(f, node->bounds, planes, &node->cullPlane);
+		if (planes == FRUSTUM_OUTSIDE) {
+			return true;
+		}
+	}
+
+	if (node->children != 0) {
+		for (int i = 0; i < 8; ++i) {
+			if (!CullOctree(&node->children[i], f, planes, visitor)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	for (int i = 0, size = node->models.size(); i < size; ++i) {
+		Model* model = node->models[i];
+		if (planes == 0 || ClassifyPlanes(f, GetOBB(*model), planes) != FRUSTUM_OUTSIDE) {
+			if (!visitor->Visit(model)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool Scene::Cull(const Frustum& f, ModelVisitor* visitor) {
+	if (linear != 0) {
+		RebuildLinear();
+		return linear->Cull(f, visitor);
+	}
+	if (octree != 0) {
+		if (loose) {
+			return LooseCull(octree, f, visitor);
+		}
+		UniqueModelVisitor unique(visitor, NextQueryStamp());
+		return CullOctree(octree, f, FRUSTUM_ALL_PLANES, &unique);
+	}
+
+	// World boxes first, all at once, then the OBBs of the ones that pass
+	int count = (int)objects.size();
+	ResizeCullList(&cullList, count);
+	ParallelFor(count, FRUSTUM_CULL_CHUNK, [&](int begin, int end) {
+		for (int i = begin; i < end; ++i) {
+			SetCullEntry(&cullList, i, GetWorldAABB(*objects[i]));
+		}
+	});
+	FrustumCull(f, &cullList);
+
+	for (int i = 0; i < count; ++i) {
+		if (IsCullVisible(&cullList.visible[0], i) && Intersects(f, GetOBB(*objects[i]))) {
+			if (!visitor->Visit(objects[i])) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+std::vector<Model*> Scene::Cull(const Frustum& f) {
+	std::vector<Model*> result;
+	ModelVectorVisitor visitor(&result);
+	Cull(f, &visitor);
+	return result;
+}
+
+int Scene::Cull(const Frustum& f, Model** outModels, int maxModels) {
+	ModelBufferVisitor visitor(outModels, maxModels);
+	Cull(f, &visitor);
+	return visitor.Count();
+}
+
+void SplitTree(OctreeNode* node, int depth) {
+	if (depth-- <= 0) { // Decrements depth
+		return;
+	}
+
+	if (node->children == 0) {
+		node->children = new OctreeNode[8];
+
+		vec3 c = node->bounds.position;
+		vec3 e = node->bounds.size *0.5f;
+
+		node->children[0].bounds = AABB(c + vec3(-e.x, +e.y, -e.z), e);
+		node->children[1].bounds = AABB(c + vec3(+e.x, +e.y, -e.z), e);
+		node->children[2].bounds = AABB(c + vec3(-e.x, +e.y, +e.z), e);
+		node->children[3].bounds = AABB(c + vec3(+e.x, +e.y, +e.z), e);
+		node->children[4].bounds = AABB(c + vec3(-e.x, -e.y, -e.z), e);
+		node->children[5].bounds = AABB(c + vec3(+e.x, -e.y, -e.z), e);
+		node->children[6].bounds = AABB(c + vec3(-e.x, -e.y, +e.z), e);
+		node->children[7].bounds = AABB(c + vec3(+e.x, -e.y, +e.z), e);
+	}
+
+	if (node->children != 0 && node->models.size() > 0) {
+		for (int i = 0; i < 8; ++i) { // For each child
+			for (int j = 0, size = node->models.size(); j < size; ++j) {
+				// Placed by world bounds, so Update can find the model again from them
+				if (AABBAABB(node->children[i].bounds, GetWorldAABB(*node->models[j]))) {
+					node->children[i].models.push_back(node->models[j]);
+				}
+			}
+		}
+		node->models.clear();
+
+		// Recurse
+		for (int i = 0; i < 8; ++i) {
+			SplitTree(&(node->children[i]), depth);
+		}
+	}
+}
+
+static void Insert(OctreeNode* node, Model* model, const AABB& bounds) {
+	if (AABBAABB(node->bounds, bounds)) {
+		// Only add models to leaves
+		if (node->children == 0) {
+			node->models.push_back(model);
+		}
+		else {
+			for (int i = 0; i < 8; ++i) {
+				Insert(&(node->children[i]), model, bounds);
+			}
+		}
+	}
+}
+
+void Insert(OctreeNode* node, Model* model) {
+	Insert(node, model, GetWorldAABB(*model));
+}
+
+void Remove(OctreeNode* node, Model* model) {
+	if (node->children == 0) {
+		std::vector<Model*>::iterator it = std::find(node->models.begin(), node->models.end(), model);
+		if (it != node->models.end()) {
+			node->models.erase(it);
+		}
+	}
+	else {
+		for (int i = 0; i < 8; ++i) {
+			Remove(&(node->children[i]), model);
+		}
+	}
+}
+
+void Update(OctreeNode* node, Model* model) {
+	Remove(node, model);
+	Insert(node, model);
+}
+
+void Update(OctreeNode* node, Model* model, const AABB& from, const AABB& to) {
+	bool wasIn = AABBAABB(node->bounds, from);
+	bool isIn = AABBAABB(node->bounds, to);
+	if (!wasIn && !isIn) {
+		return;
+	}
+
+	if (node->children != 0) {
+		for (int i = 0; i < 8; ++i) {
+			Update(&(node->children[i]), model, from, to);
+		}
+	}
+	else if (wasIn && !isIn) {
+		std::vector<Model*>::iterator it = std::find(node->models.begin(), node->models.end(), model);
+		if (it != node->models.end()) {
+			*it = node->models.back();
+			node->models.pop_back();
+		}
+	}
+	else if (!wasIn && isIn) {
+		node->models.push_back(model);
+	}
+}
+
+Model* FindClosest(const std::vector<Model*>& set, const Ray& ray) {
+	if (set.size() == 0) {
+		return 0;
+	}
+
+	Model* closest = 0;
+	float closest_t = -1;
+
+	for (int i = 0, size = set.size(); i < size; ++i) {
+		float this_t = ModelRay(*set[i], ray);
+
+		if (this_t < 0) {
+			continue;
+		}
+
+		if (closest_t < 0 || this_t < closest_t) {
+			closest_t = this_t;
+			closest = set[i];
+		}
+	}
+
+	return closest;
+}
+
+static void Raycast(OctreeNode* node, const Ray& ray, Model** closest, float* closestT) {
+	RaycastResult raycast;
+	Raycast(node->bounds, ray, &raycast);
+	if (raycast.t < 0) {
+		return;
+	}
+
+	if (node->children == 0) {
+		for (int i = 0, size = node->models.size(); i < size; ++i) {
+			float t = ModelRay(*node->models[i], ray);
+			if (t >= 0 && (*closestT < 0 || t < *closestT)) {
+				*closest = node->models[i];
+				*closestT = t;
+			}
+		}
+	}
+	else {
+		for (int i = 0; i < 8; ++i) {
+			Raycast(&(node->children[i]), ray, closest, closestT);
+		}
+	}
+}
+
+Model* Raycast(OctreeNode* node, const Ray& ray) {
+	Model* closest = 0;
+	float closestT = -1;
+	Raycast(node, ray, &closest, &closestT);
+	return closest;
+}
+
+bool Query(OctreeNode* node, const Sphere& sphere, ModelVisitor* visitor) {
+	if (SphereAABB(sphere, node->bounds)) {
+		if (node->children == 0) {
+			for (int i = 0, size = node->models.size(); i < size; ++i) {
+				OBB bounds = GetOBB(*(node->models[i]));
+				if (SphereOBB(sphere, bounds) && !visitor->Visit(node->models[i])) {
+					return false;
+				}
+			}
+		}
+		else {
+			for (int i = 0; i < 8; ++i) {
+				if (!Query(&(node->children[i]), sphere, visitor)) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+bool Query(OctreeNode* node, const AABB& aabb, ModelVisitor* visitor) {
+	if (AABBAABB(aabb, node->bounds)) {
+		if (node->children == 0) {
+			for (int i = 0, size = node->models.size(); i < size; ++i) {
+				OBB bounds = GetOBB(*(node->models[i]));
+				if (AABBOBB(aabb, bounds) && !visitor->Visit(node->models[i])) {
+					return false;
+				}
+			}
+		}
+		else {
+			for (int i = 0; i < 8; ++i) {
+				if (!Query(&(node->children[i]), aabb, visitor)) {
+					return false;
+				}
+			}
+		}
+	}
+	return true;
+}
+
+std::vector<Model*> Query(OctreeNode* node, const Sphere& sphere) {
+	std::vector<Model*> result;
+	ModelVectorVisitor visitor(&result);
+	Query(node, sphere, &visitor);
+	return result;
+}
+
+std::vector<Model*> Query(OctreeNode* node, const AABB& aabb) {
+	std::vector<Model*> result;
+	ModelVectorVisitor visitor(&result);
+	Query(node, aabb, &visitor);
+	return result;
+}
+
+AABB GetLooseBounds(const OctreeNode* node) {
+	return AABB(node->bounds.position, node->bounds.size * 2.0f);
+}
+
+OctreeNode* LooseInsert(OctreeNode* node, Model* model, int depth) {
+	AABB bounds = GetWorldAABB(*model);
+	float radius = fmaxf(bounds.size.x, fmaxf(bounds.size.y, bounds.size.z));
+
+	// Models centered outside of the root stay in it
+	vec3 min = GetMin(node->bounds);
+	vec3 max = GetMax(node->bounds);
+	for (int i = 0; i < 3; ++i) {
+		if (bounds.position.asArray[i] < min.asArray[i] || bounds.position.asArray[i] > max.asArray[i]) {
+			depth = 0;
+		}
+	}
+
+	// A child reaches its own half size past its bounds, so it holds any
+	// model up to that size whose center is inside it
+	for (; depth > 0; --depth) {
+		vec3 half = node->bounds.size * 0.5f;
+		if (radius > fminf(half.x, fminf(half.y, half.z))) {
+			break;
+		}
+
+		if (node->children == 0) {
+			node->children = new OctreeNode[8];
+			vec3 c = node->bounds.position;
+			for (int i = 0; i < 8; ++i) {
+				vec3 offset((i & 1) ? half.x : -half.x, (i & 4) ? -half.y : half.y, (i & 2) ? half.z : -half.z);
+				node->children[i].bounds = AABB(c + offset, half);
+			}
+		}
+
+		// Same child order as SplitTree
+		const vec3& c = node->bounds.position;
+		int child = ((bounds.position.x >= c.x) ? 1 : 0) | ((bounds.position.z >= c.z) ? 2 : 0) | ((bounds.position.y < c.y) ? 4 : 0);
+		node = &node->children[child];
+	}
+
+	node->models.push_back(model);
+	return node;
+}
+
+void LooseRemove(OctreeNode* node, Model* model) {
+	std::vector<Model*>::iterator it = std::find(node->models.begin(), node->models.end(), model);
+	if (it != node->models.end()) {
+		*it = node->models.back();
+		node->models.pop_back();
+	}
+}
+
+// Closer children first, children that start past the closest hit are skipped
+static void LooseRaycast(OctreeNode* node, const Ray& ray, const vec3& invDirection, Model** closest, float* closestT) {
+	for (int i = 0, size = node->models.size(); i < size; ++i) {
+		float t = ModelRay(*node->models[i], ray);
+		if (t >= 0 && t < *closestT) {
+			*closest = node->models[i];
+			*closestT = t;
+		}
+	}
+	if (node->children == 0) {
+		return;
+	}
+
+	int order[8];
+	float entry[8];
+	int count = 0;
+	for (int i = 0; i < 8; ++i) {
+		AABB bounds = GetLooseBounds(&node->children[i]);
+		float t;
+		if (RayBounds(GetMin(bounds), GetMax(bounds), ray.origin, invDirection, *closestT, &t)) {
+			int j = count++;
+			for (; j > 0 && entry[j - 1] > t; --j) {
+				order[j] = order[j - 1];
+				entry[j] = entry[j - 1];
+			}
+			order[j] = i;
+			entry[j] = t;
+		}
+	}
+	for (int i = 0; i < count; ++i) {
+		if (entry[i] > *closestT) {
+			break;
+		}
+		LooseRaycast(&node->children[order[i]], ray, invDirection, closest, closestT);
+	}
+}
+
+Model* LooseRaycast(OctreeNode* node, const Ray& ray) {
+	Model* closest = 0;
+	float closestT = FLT_MAX;
+	LooseRaycast(node, ray, GetInverseDirection(ray), &closest, &closestT);
+	return closest;
+}
+
+// The node passed in was already tested (or is the root, which holds models
+// that are outside of it), only its children are tested against the shape
+bool LooseQuery(OctreeNode* node, const Sphere& sphere, ModelVisitor* visitor) {
+	for (int i = 0, size = node->models.size(); i < size; ++i) {
+		if (SphereOBB(sphere, GetOBB(*node->models[i])) && !visitor->Visit(node->models[i])) {
+			return false;
+		}
+	}
+	if (node->children != 0) {
+		for (int i = 0; i < 8; ++i) {
+			if (SphereAABB(sphere, GetLooseBounds(&node->children[i])) && !LooseQuery(&node->children[i], sphere, visitor)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool LooseQuery(OctreeNode* node, const AABB& aabb, ModelVisitor* visitor) {
+	for (int i = 0, size = node->models.size(); i < size; ++i) {
+		if (AABBOBB(aabb, GetOBB(*node->models[i])) && !visitor->Visit(node->models[i])) {
+			return false;
+		}
+	}
+	if (node->children != 0) {
+		for (int i = 0; i < 8; ++i) {
+			if (AABBAABB(aabb, GetLooseBounds(&node->children[i])) && !LooseQuery(&node->children[i], aabb, visitor)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+void LooseQuery(OctreeNode* node, const Sphere& sphere, std::vector<Model*>* outModels) {
+	ModelVectorVisitor visitor(outModels);
+	LooseQuery(node, sphere, &visitor);
+}
+
+void LooseQuery(OctreeNode* node, const AABB& aabb, std::vector<Model*>* outModels) {
+	ModelVectorVisitor visitor(outModels);
+	LooseQuery(node, aabb, &visitor);
+}
+
+// Every model is inside the loose bounds of its node, so once those are
+// inside the frustum the whole subtree is
+static bool LooseCull(OctreeNode* node, const Frustum& f, int planes, ModelVisitor* visitor) {
+	for (int i = 0, size = node->models.size(); i < size; ++i) {
+		if (planes == 0 || ClassifyPlanes(f, GetOBB(*node->models[i]), planes) != FRUSTUM_OUTSIDE) {
+			if (!visitor->Visit(node->models[i])) {
+				return false;
+			}
+		}
+	}
+	if (node->children != 0) {
+		for (int i = 0; i < 8; ++i) {
+			OctreeNode* child = &node->children[i];
+			int childPlanes = (planes == 0) ? 0 : ClassifyPlanes(f, GetLooseBounds(child), planes, &child->cullPlane);
+			if (childPlanes != FRUSTUM_OUTSIDE && !LooseCull(child, f, childPlanes, visitor)) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool LooseCull(OctreeNode* node, const Frustum& f, ModelVisitor* visitor) {
+	return LooseCull(node, f, FRUSTUM_ALL_PLANES, visitor);
+}
+
+void LooseCull(OctreeNode* node, const Frustum& f, std::vector<Model*>* outModels) {
+	ModelVectorVisitor visitor(outModels);
+	LooseCull(node, f, &visitor);
+}
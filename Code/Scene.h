@@ -2,14 +2,20 @@
 #define _H_SCENE_
 
 #include "Geometry3D.h"
+#include "LinearOctree.h"
+#include "FrustumCull.h"
 #include <vector>
+#include <unordered_map>
+
+#define LOOSE_OCTREE_DEPTH 6 // Levels below the root a loose octree grows to
 
 typedef struct OctreeNode {
 	AABB bounds;
 	OctreeNode* children;
 	std::vector<Model*> models;
+	int cullPlane; // Frustum plane that rejected the node last, tested first
 
-	inline OctreeNode() : children(0) { }
+	inline OctreeNode() : children(0), cullPlane(0) { }
 	inline ~OctreeNode() {
 		if (children != 0) {
 			delete[] children;
@@ -17,31 +23,85 @@ typedef struct OctreeNode {
 	}
 } OctreeNode;
 
+// Where a model is in the octree of a Scene
+typedef struct OctreePlacement {
+	OctreeNode* node; // Loose octree only, a regular one stores models in every leaf they touch
+	AABB bounds; // World bounds the model was placed with
+} OctreePlacement;
+
 class Scene {
 protected:
 	std::vector<Model*> objects;
 	OctreeNode* octree;
+	bool loose;
+	std::unordered_map<const Model*, OctreePlacement> placements;
+	LinearOctree* linear;
+	AABB linearRegion;
+	bool linearDirty; // Rebuilt by UpdateModels or the next query
+	CullList cullList; // World boxes of every model, Cull without a tree
+
+	static unsigned int queryCounter; // Last stamp handed out, see Model::lastQuery
+
+	void Place(Model* model);
+	void RebuildLinear();
+	static unsigned int NextQueryStamp();
 private:
 	Scene(const Scene&);
 	Scene& operator=(const Scene&);
 public:
-	inline Scene() : octree(0) { } 
+	inline Scene() : octree(0), loose(false), linear(0), linearDirty(false) { } 
 	inline ~Scene() {
 		if (octree != 0) {
 			delete octree;
 		}
+		if (linear != 0) {
+			delete linear;
+		}
 	}
 
 	void AddModel(Model* model);
 	void RemoveModel(Model* model);
+	// Rebuilds the world cache of the model and moves it in the octree only if
+	// its bounds left the nodes it is in. Children of a model that moved need
+	// their own UpdateModel, or use UpdateModels.
 	void UpdateModel(Model* model);
+	// UpdateModel for every model whose world bounds changed since it was placed.
+	// A linear octree is rebuilt from scratch instead.
+	void UpdateModels();
+	// Every model whose parent chain contains model
 	std::vector<Model*> FindChildren(const Model* model);
 
 	Model* Raycast(const Ray& ray);
+	// Raycast for every ray, split over the worker threads like the batches of
+	// QueryBatch.h. outModels has room for count entries.
+	void Raycast(const Ray* rays, int count, Model** outModels);
 	std::vector<Model*> Query(const Sphere& sphere);
 	std::vector<Model*> Query(const AABB& aabb);
 
+	// Queries that allocate nothing, every model is visited once. The visitor
+	// versions return false if the visitor stopped the query. The buffer
+	// versions stop once maxModels models were written and return how many.
+	// With a regular octree the queries stamp the models they visit (see
+	// Model::lastQuery), so a visitor must not query a Scene itself, and no
+	// two of these queries may run at the same time, on any Scene.
+	bool FindChildren(const Model* model, ModelVisitor* visitor);
+	bool Query(const Sphere& sphere, ModelVisitor* visitor);
+	bool Query(const AABB& aabb, ModelVisitor* visitor);
+	bool Cull(const Frustum& f, ModelVisitor* visitor);
+	int FindChildren(const Model* model, Model** outChildren, int maxChildren);
+	int Query(const Sphere& sphere, Model** outModels, int maxModels);
+	int Query(const AABB& aabb, Model** outModels, int maxModels);
+	int Cull(const Frustum& f, Model** outModels, int maxModels);
+
 	bool Accelerate(const vec3& position, float size); 
+	// Loose octree instead, see LooseInsert
+	bool AccelerateLoose(const vec3& position, float size);
+	// LinearOctree, for scenes where most models move every frame
+	bool AccelerateLinear(const vec3& position, float size);
+	// Nodes pass the planes they cross down to their children, the subtree of
+	// a node inside the frustum is accepted without testing it. A regular
+	// octree accepts every model in such a leaf, even if only its world AABB
+	// (not its OBB) reaches into the frustum.
 	std::vector<Model*> Cull(const Frustum& f);
 };
 
@@ -50,10 +110,35 @@ void SplitTree(OctreeNode* node, int depth);
 void Insert(OctreeNode* node, Model* model);
 void Remove(OctreeNode* node, Model* model);
 void Update(OctreeNode* node, Model* model);
+// Only visits the nodes either bounds touch and only changes the leaves the
+// model entered or left. from are the world bounds it was inserted with.
+void Update(OctreeNode* node, Model* model, const AABB& from, const AABB& to);
 
 Model* FindClosest(const std::vector<Model*>& set, const Ray& ray);
 Model* Raycast(OctreeNode* node, const Ray& ray);
 std::vector<Model*> Query(OctreeNode* node, const Sphere& sphere);
 std::vector<Model*> Query(OctreeNode* node, const AABB& aabb);
+// A model is visited once for every leaf it is in, false if the visitor stopped
+bool Query(OctreeNode* node, const Sphere& sphere, ModelVisitor* visitor);
+bool Query(OctreeNode* node, const AABB& aabb, ModelVisitor* visitor);
+
+// Loose octree. Every node reaches half its size past its bounds on each
+// side (GetLooseBounds), so a model is stored in exactly one node: the
+// deepest one that holds its center and is at least as large as it. Models
+// live in interior nodes too, and children are created as models need them.
+// Queries visit every model once, they never need to remove duplicates.
+AABB GetLooseBounds(const OctreeNode* node);
+// Returns the node the model went into, depth is how many levels may be below node
+OctreeNode* LooseInsert(OctreeNode* node, Model* model, int depth);
+// node is the one LooseInsert returned
+void LooseRemove(OctreeNode* node, Model* model);
+
+Model* LooseRaycast(OctreeNode* node, const Ray& ray);
+void LooseQuery(OctreeNode* node, const Sphere& sphere, std::vector<Model*>* outModels);
+void LooseQuery(OctreeNode* node, const AABB& aabb, std::vector<Model*>* outModels);
+void LooseCull(OctreeNode* node, const Frustum& f, std::vector<Model*>* outModels);
+bool LooseQuery(OctreeNode* node, const Sphere& sphere, ModelVisitor* visitor);
+bool LooseQuery(OctreeNode* node, const AABB& aabb, ModelVisitor* visitor);
+bool LooseCull(OctreeNode* node, const Frustum& f, ModelVisitor* visitor);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,20 @@
+#ifndef _H_SIMD_
+#define _H_SIMD_
+
+// SIMD_SSE is defined when the target supports SSE2, which
+// is always the case on x64. 32 bit builds need /arch:SSE2.
+// Every SIMD kernel keeps a scalar path for other targets.
+#if defined(_M_X64) || defined(_M_AMD64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SIMD_SSE
+#include <xmmintrin.h>
+#include <emmintrin.h>
+#endif
+
+// SIMD_AVX2 is only defined when the compiler was asked
+// to target AVX2 (/arch:AVX2, -mavx2)
+#if defined(__AVX2__)
+#define SIMD_AVX2
+#include <immintrin.h>
+#endif
+
+#endif
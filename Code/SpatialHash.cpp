@@ -0,0 +1,58 @@
+#include "SpatialHash.h"
+#include <cmath>
+
+void SpatialHash::GetCell(const vec3& point, int* outCell) const {
+	outCell[0] = (int)floorf(point.x * invCellSize);
+	outCell[1] = (int)floorf(point.y * invCellSize);
+	outCell[2] = (int)floorf(point.z * invCellSize);
+}
+
+unsigned int SpatialHash::Bucket(int x, int y, int z) const {
+	// Teschner et al. 2003, "Optimized Spatial Hashing for Collision Detection of Deformable Objects"
+	unsigned int h = ((unsigned int)x * 73856093u) ^ ((unsigned int)y * 19349663u) ^ ((unsigned int)z * 83492791u);
+	return h & tableMask;
+}
+
+void SpatialHash::Build(const vec3* points, int numPoints, float size) {
+	cellSize = size;
+	invCellSize = (size > 0.0f) ? 1.0f / size : 1.0f;
+
+	// Power of two table, about twice as many buckets as points
+	unsigned int tableSize = 64;
+	while (tableSize < (unsigned int)numPoints * 2) {
+		tableSize <<= 1;
+	}
+	tableMask = tableSize - 1;
+
+	bucketStart.assign(tableSize + 1, 0);
+	entries.resize(numPoints);
+	entryPoints.resize(numPoints);
+	entryCells.resize(numPoints * 3);
+	pointBucket.resize(numPoints);
+
+	// Count points per bucket
+	int cell[3];
+	for (int i = 0; i < numPoints; ++i) {
+		GetCell(points[i], cell);
+		unsigned int bucket = Bucket(cell[0], cell[1], cell[2]);
+		pointBucket[i] = bucket;
+		bucketStart[bucket + 1] += 1;
+	}
+
+	// Prefix sum, bucketStart[b] is now the first entry of bucket b
+	for (unsigned int i = 0; i < tableSize; ++i) {
+		bucketStart[i + 1] += bucketStart[i];
+	}
+
+	// Scatter, bucketStart[b] is used as a write cursor and restored after
+	for (int i = 0; i < numPoints; ++i) {
+		int index = bucketStart[pointBucket[i]]++;
+		entries[index] = i;
+		entryPoints[index] = points[i];
+		GetCell(points[i], &entryCells[index * 3]);
+	}
+	for (unsigned int i = tableSize; i > 0; --i) {
+		bucketStart[i] = bucketStart[i - 1];
+	}
+	bucketStart[0] = 0;
+}
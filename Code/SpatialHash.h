@@ -0,0 +1,56 @@
+#ifndef _H_SPATIAL_HASH_
+#define _H_SPATIAL_HASH_
+
+#include "vectors.h"
+#include <vector>
+
+// Hashed uniform grid over a set of points, rebuilt from scratch
+// every step. Entries are counting-sorted by bucket so every bucket
+// is one contiguous span of point indices, no per-cell allocations.
+// Different cells may share a bucket, callers must still run their
+// own distance test on the points a query returns.
+
+class SpatialHash {
+protected:
+	float cellSize;
+	float invCellSize;
+	unsigned int tableMask;
+	std::vector<int> bucketStart; // tableSize + 1 entries
+	std::vector<int> entries; // Point indices, sorted by bucket
+	std::vector<vec3> entryPoints; // Points, in entry order
+	std::vector<int> entryCells; // Cell x, y, z of every entry
+	std::vector<unsigned int> pointBucket; // Bucket of every point
+public:
+	inline SpatialHash() : cellSize(1.0f), invCellSize(1.0f), tableMask(0) { }
+
+	// The cell size should be at least the query distance,
+	// then every neighbour is found in the 27 surrounding cells
+	void Build(const vec3* points, int numPoints, float size);
+
+	void GetCell(const vec3& point, int* outCell) const;
+	unsigned int Bucket(int x, int y, int z) const;
+
+	// Entries [BucketStart, BucketEnd) of a bucket may belong to
+	// other cells that share it, filter them with EntryInCell
+	inline int BucketStart(unsigned int bucket) const {
+		return bucketStart[bucket];
+	}
+	inline int BucketEnd(unsigned int bucket) const {
+		return bucketStart[bucket + 1];
+	}
+	inline int Entry(int index) const {
+		return entries[index];
+	}
+	inline const vec3& EntryPoint(int index) const {
+		return entryPoints[index];
+	}
+	inline bool EntryInCell(int index, int x, int y, int z) const {
+		const int* cell = &entryCells[index * 3];
+		return cell[0] == x && cell[1] == y && cell[2] == z;
+	}
+	inline float GetCellSize() const {
+		return cellSize;
+	}
+};
+
+#endif
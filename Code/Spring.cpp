@@ -24,9 +24,10 @@ void Spring::SetConstants(float _k, float _b) {
 	b = _b;
 }
 
-void Spring::ApplyForce(float dt) {
+template<int INTEGRATOR>
+void Spring::ApplyForceKernel(float dt) {
 	vec3 relPos = p2->GetPosition() - p1->GetPosition();
-	vec3 relVel = p2->GetVelocity() - p1->GetVelocity();
+	vec3 relVel = p2->GetVelocityKernel<INTEGRATOR>() - p1->GetVelocityKernel<INTEGRATOR>();
 
 	// Prevent underflow
 	for (int i = 0; i < 3; ++i) {
@@ -40,6 +41,14 @@ void Spring::ApplyForce(float dt) {
 	float F = (-k * x) + (-b * v);
 
 	vec3 impulse = Normalized(relPos) * F;
-	p1->AddImpulse(impulse * p1->InvMass());
-	p2->AddImpulse(impulse*  -1.0f * p2->InvMass());
+	p1->AddImpulseKernel<INTEGRATOR>(impulse * p1->InvMass());
+	p2->AddImpulseKernel<INTEGRATOR>(impulse*  -1.0f * p2->InvMass());
+}
+
+template void Spring::ApplyForceKernel<INTEGRATOR_EULER>(float dt);
+template void Spring::ApplyForceKernel<INTEGRATOR_ACCURATE_EULER>(float dt);
+template void Spring::ApplyForceKernel<INTEGRATOR_VERLET>(float dt);
+
+void Spring::ApplyForce(float dt) {
+	ApplyForceKernel<INTEGRATOR_DEFAULT>(dt);
 }
\ No newline at end of file
@@ -25,6 +25,8 @@ public:
 	Particle* GetP2();
 	void SetConstants(float _k, float _b);
 	void ApplyForce(float dt);
+
+	template<int INTEGRATOR> void ApplyForceKernel(float dt);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,337 @@
+#include "SpringNetwork.h"
+#include "Threading.h"
+#include "Simd.h"
+#include "glad/glad.h"
+#include <algorithm>
+#include <cmath>
+
+#define SPRING_NETWORK_CHUNK	2048 // Springs per ParallelFor chunk
+
+void SpringNetwork::Clear() {
+	ParticleSystem::Clear();
+	springParticles.clear();
+	springRestLength.clear();
+	springK.clear();
+	springB.clear();
+	sortedIndex.clear();
+}
+
+int SpringNetwork::AddSpring(int particle1, int particle2, float k, float b) {
+	return AddSpring(particle1, particle2, k, b, Magnitude(GetPosition(particle2) - GetPosition(particle1)));
+}
+
+int SpringNetwork::AddSpring(int particle1, int particle2, float k, float b, float restLength) {
+	springParticles.push_back(particle1);
+	springParticles.push_back(particle2);
+	springRestLength.push_back(restLength);
+	springK.push_back(k);
+	springB.push_back(b);
+	return (int)springRestLength.size() - 1;
+}
+
+void SpringNetwork::SetSpringConstants(float k, float b) {
+	springK.assign(springK.size(), k);
+	springB.assign(springB.size(), b);
+}
+
+int SpringNetwork::GetSortedIndex(int index) const {
+	if (index < 0 || index >= (int)sortedIndex.size()) {
+		return index;
+	}
+	return sortedIndex[index];
+}
+
+template<typename T>
+static void Permute(std::vector<T>& values, const std::vector<int>& newToOld) {
+	std::vector<T> result(values.size());
+	for (int i = 0, size = newToOld.size(); i < size; ++i) {
+		result[i] = values[newToOld[i]];
+	}
+	values.swap(result);
+}
+
+void SpringNetwork::SortTopology() {
+	int numSprings = GetSpringCount();
+
+	// Adjacency lists of the particle graph, packed
+	std::vector<int> adjacencyStart(numParticles + 1, 0);
+	for (int i = 0; i < numSprings * 2; ++i) {
+		adjacencyStart[springParticles[i] + 1] += 1;
+	}
+	for (int i = 0; i < numParticles; ++i) {
+		adjacencyStart[i + 1] += adjacencyStart[i];
+	}
+	std::vector<int> adjacency(numSprings * 2);
+	std::vector<int> cursor(adjacencyStart.begin(), adjacencyStart.end() - 1);
+	for (int i = 0; i < numSprings; ++i) {
+		int a = springParticles[i * 2 + 0];
+		int b = springParticles[i * 2 + 1];
+		adjacency[cursor[a]++] = b;
+		adjacency[cursor[b]++] = a;
+	}
+
+	// Cuthill-McKee, breadth first from the lowest degree particle of every
+	// connected part, neighbours visited in order of increasing degree
+	std::vector<int> degree(numParticles);
+	std::vector<int> byDegree(numParticles);
+	for (int i = 0; i < numParticles; ++i) {
+		degree[i] = adjacencyStart[i + 1] - adjacencyStart[i];
+		byDegree[i] = i;
+	}
+	std::stable_sort(byDegree.begin(), byDegree.end(), [&](int a, int b) {
+		return degree[a] < degree[b];
+	});
+
+	std::vector<int> order; // New index to old index
+	order.reserve(numParticles);
+	std::vector<bool> visited(numParticles, false);
+	for (int start = 0; start < numParticles; ++start) {
+		if (visited[byDegree[start]]) {
+			continue;
+		}
+		visited[byDegree[start]] = true;
+		order.push_back(byDegree[start]);
+
+		for (int head = (int)order.size() - 1; head < (int)order.size(); ++head) {
+			int current = order[head];
+			int first = (int)order.size();
+			for (int j = adjacencyStart[current]; j < adjacencyStart[current + 1]; ++j) {
+				if (!visited[adjacency[j]]) {
+					visited[adjacency[j]] = true;
+					order.push_back(adjacency[j]);
+				}
+			}
+			std::stable_sort(order.begin() + first, order.end(), [&](int a, int b) {
+				return degree[a] < degree[b];
+			});
+		}
+	}
+	// Reversed, the bandwidth is the same but there is less fill in
+	std::reverse(order.begin(), order.end());
+
+	std::vector<int> oldToNew(numParticles);
+	for (int i = 0; i < numParticles; ++i) {
+		oldToNew[order[i]] = i;
+	}
+
+	Permute(positionX, order); Permute(positionY, order); Permute(positionZ, order);
+	Permute(oldPositionX, order); Permute(oldPositionY, order); Permute(oldPositionZ, order);
+	Permute(velocityX, order); Permute(velocityY, order); Permute(velocityZ, order);
+	Permute(invMass, order);
+
+	if (sortedIndex.size() == 0) {
+		sortedIndex.resize(numParticles);
+		for (int i = 0; i < numParticles; ++i) {
+			sortedIndex[i] = i;
+		}
+	}
+	for (int i = 0, size = sortedIndex.size(); i < size; ++i) {
+		sortedIndex[i] = oldToNew[sortedIndex[i]];
+	}
+
+	// Springs by lower particle, then by upper particle
+	for (int i = 0; i < numSprings; ++i) {
+		int a = oldToNew[springParticles[i * 2 + 0]];
+		int b = oldToNew[springParticles[i * 2 + 1]];
+		springParticles[i * 2 + 0] = (a < b) ? a : b;
+		springParticles[i * 2 + 1] = (a < b) ? b : a;
+	}
+	std::vector<int> springOrder(numSprings);
+	for (int i = 0; i < numSprings; ++i) {
+		springOrder[i] = i;
+	}
+	std::stable_sort(springOrder.begin(), springOrder.end(), [&](int a, int b) {
+		if (springParticles[a * 2] != springParticles[b * 2]) {
+			return springParticles[a * 2] < springParticles[b * 2];
+		}
+		return springParticles[a * 2 + 1] < springParticles[b * 2 + 1];
+	});
+
+	std::vector<int> particles(numSprings * 2);
+	for (int i = 0; i < numSprings; ++i) {
+		particles[i * 2 + 0] = springParticles[springOrder[i] * 2 + 0];
+		particles[i * 2 + 1] = springParticles[springOrder[i] * 2 + 1];
+	}
+	springParticles.swap(particles);
+	Permute(springRestLength, springOrder);
+	Permute(springK, springOrder);
+	Permute(springB, springOrder);
+}
+
+template<int INTEGRATOR>
+void SpringNetwork::ComputeSpringImpulses(int first, int last) {
+	const int* sp = &springParticles[0];
+	const float* px = &positionX[0];
+	const float* py = &positionY[0];
+	const float* pz = &positionZ[0];
+	// Verlet velocity is position - old position, see GetVelocityKernel
+	const float* vx = (INTEGRATOR == INTEGRATOR_VERLET) ? &oldPositionX[0] : &velocityX[0];
+	const float* vy = (INTEGRATOR == INTEGRATOR_VERLET) ? &oldPositionY[0] : &velocityY[0];
+	const float* vz = (INTEGRATOR == INTEGRATOR_VERLET) ? &oldPositionZ[0] : &velocityZ[0];
+	int s = first;
+
+#if defined(SIMD_AVX2)
+	__m256i stride = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+	__m256 epsilon8 = _mm256_set1_ps(0.0000001f);
+	__m256 zero8 = _mm256_setzero_ps();
+	for (; s + 8 <= last; s += 8) {
+		__m256i a = _mm256_i32gather_epi32(sp + s * 2, stride, 4);
+		__m256i b = _mm256_i32gather_epi32(sp + s * 2 + 1, stride, 4);
+
+		__m256 dx = _mm256_sub_ps(_mm256_i32gather_ps(px, b, 4), _mm256_i32gather_ps(px, a, 4));
+		__m256 dy = _mm256_sub_ps(_mm256_i32gather_ps(py, b, 4), _mm256_i32gather_ps(py, a, 4));
+		__m256 dz = _mm256_sub_ps(_mm256_i32gather_ps(pz, b, 4), _mm256_i32gather_ps(pz, a, 4));
+		__m256 dvx = _mm256_sub_ps(_mm256_i32gather_ps(vx, b, 4), _mm256_i32gather_ps(vx, a, 4));
+		__m256 dvy = _mm256_sub_ps(_mm256_i32gather_ps(vy, b, 4), _mm256_i32gather_ps(vy, a, 4));
+		__m256 dvz = _mm256_sub_ps(_mm256_i32gather_ps(vz, b, 4), _mm256_i32gather_ps(vz, a, 4));
+		if (INTEGRATOR == INTEGRATOR_VERLET) {
+			// The gathered values were old positions, subtract them from the position delta
+			dvx = _mm256_sub_ps(dx, dvx);
+			dvy = _mm256_sub_ps(dy, dvy);
+			dvz = _mm256_sub_ps(dz, dvz);
+		}
+
+		__m256 length = _mm256_sqrt_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz)));
+		__m256 valid = _mm256_cmp_ps(length, epsilon8, _CMP_GT_OQ);
+		__m256 invLength = _mm256_and_ps(valid, _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_max_ps(length, epsilon8)));
+
+		__m256 x = _mm256_sub_ps(length, _mm256_loadu_ps(&springRestLength[s]));
+		__m256 v = _mm256_mul_ps(_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dvx, dx), _mm256_mul_ps(dvy, dy)), _mm256_mul_ps(dvz, dz)), invLength);
+		__m256 force = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(zero8, _mm256_loadu_ps(&springK[s])), x), _mm256_mul_ps(_mm256_loadu_ps(&springB[s]), v));
+		__m256 scale = _mm256_mul_ps(force, invLength);
+
+		_mm256_storeu_ps(&springImpulseX[s], _mm256_mul_ps(dx, scale));
+		_mm256_storeu_ps(&springImpulseY[s], _mm256_mul_ps(dy, scale));
+		_mm256_storeu_ps(&springImpulseZ[s], _mm256_mul_ps(dz, scale));
+	}
+#endif
+
+#if defined(SIMD_SSE)
+	__m128 epsilon4 = _mm_set1_ps(0.0000001f);
+	__m128 zero4 = _mm_setzero_ps();
+	for (; s + 4 <= last; s += 4) {
+		const int* p = sp + s * 2;
+		// No gather before AVX2, the loads are scalar
+		__m128 dx = _mm_sub_ps(_mm_setr_ps(px[p[1]], px[p[3]], px[p[5]], px[p[7]]), _mm_setr_ps(px[p[0]], px[p[2]], px[p[4]], px[p[6]]));
+		__m128 dy = _mm_sub_ps(_mm_setr_ps(py[p[1]], py[p[3]], py[p[5]], py[p[7]]), _mm_setr_ps(py[p[0]], py[p[2]], py[p[4]], py[p[6]]));
+		__m128 dz = _mm_sub_ps(_mm_setr_ps(pz[p[1]], pz[p[3]], pz[p[5]], pz[p[7]]), _mm_setr_ps(pz[p[0]], pz[p[2]], pz[p[4]], pz[p[6]]));
+		__m128 dvx = _mm_sub_ps(_mm_setr_ps(vx[p[1]], vx[p[3]], vx[p[5]], vx[p[7]]), _mm_setr_ps(vx[p[0]], vx[p[2]], vx[p[4]], vx[p[6]]));
+		__m128 dvy = _mm_sub_ps(_mm_setr_ps(vy[p[1]], vy[p[3]], vy[p[5]], vy[p[7]]), _mm_setr_ps(vy[p[0]], vy[p[2]], vy[p[4]], vy[p[6]]));
+		__m128 dvz = _mm_sub_ps(_mm_setr_ps(vz[p[1]], vz[p[3]], vz[p[5]], vz[p[7]]), _mm_setr_ps(vz[p[0]], vz[p[2]], vz[p[4]], vz[p[6]]));
+		if (INTEGRATOR == INTEGRATOR_VERLET) {
+			dvx = _mm_sub_ps(dx, dvx);
+			dvy = _mm_sub_ps(dy, dvy);
+			dvz = _mm_sub_ps(dz, dvz);
+		}
+
+		__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+		__m128 valid = _mm_cmpgt_ps(length, epsilon4);
+		__m128 invLength = _mm_and_ps(valid, _mm_div_ps(_mm_set1_ps(1.0f), _mm_max_ps(length, epsilon4)));
+
+		__m128 x = _mm_sub_ps(length, _mm_loadu_ps(&springRestLength[s]));
+		__m128 v = _mm_mul_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(dvx, dx), _mm_mul_ps(dvy, dy)), _mm_mul_ps(dvz, dz)), invLength);
+		__m128 force = _mm_add_ps(_mm_mul_ps(_mm_sub_ps(zero4, _mm_loadu_ps(&springK[s])), x), _mm_mul_ps(_mm_loadu_ps(&springB[s]), v));
+		__m128 scale = _mm_mul_ps(force, invLength);
+
+		_mm_storeu_ps(&springImpulseX[s], _mm_mul_ps(dx, scale));
+		_mm_storeu_ps(&springImpulseY[s], _mm_mul_ps(dy, scale));
+		_mm_storeu_ps(&springImpulseZ[s], _mm_mul_ps(dz, scale));
+	}
+#endif
+
+	// Scalar path, also handles the tail of the SIMD loops
+	for (; s < last; ++s) {
+		int a = sp[s * 2 + 0];
+		int b = sp[s * 2 + 1];
+		float dx = px[b] - px[a], dy = py[b] - py[a], dz = pz[b] - pz[a];
+		float dvx = vx[b] - vx[a], dvy = vy[b] - vy[a], dvz = vz[b] - vz[a];
+		if (INTEGRATOR == INTEGRATOR_VERLET) {
+			dvx = dx - dvx;
+			dvy = dy - dvy;
+			dvz = dz - dvz;
+		}
+
+		float length = sqrtf(dx * dx + dy * dy + dz * dz);
+		float invLength = (length > 0.0000001f) ? 1.0f / length : 0.0f;
+		float x = length - springRestLength[s];
+		float v = (dvx * dx + dvy * dy + dvz * dz) * invLength;
+		float scale = ((-springK[s] * x) + (springB[s] * v)) * invLength;
+
+		springImpulseX[s] = dx * scale;
+		springImpulseY[s] = dy * scale;
+		springImpulseZ[s] = dz * scale;
+	}
+}
+
+template<int INTEGRATOR>
+void SpringNetwork::ApplySpringForcesKernel(float) {
+	int numSprings = GetSpringCount();
+	if (numSprings == 0) {
+		return;
+	}
+	springImpulseX.resize(numSprings);
+	springImpulseY.resize(numSprings);
+	springImpulseZ.resize(numSprings);
+
+	ParallelFor(numSprings, SPRING_NETWORK_CHUNK, [&](int first, int last) {
+		ComputeSpringImpulses<INTEGRATOR>(first, last);
+	});
+
+	// Sum per particle. Springs share particles, so this part stays serial;
+	// with sorted topology the particles it touches are mostly in cache.
+	impulseX.assign(numParticles, 0.0f);
+	impulseY.assign(numParticles, 0.0f);
+	impulseZ.assign(numParticles, 0.0f);
+	for (int s = 0; s < numSprings; ++s) {
+		int a = springParticles[s * 2 + 0];
+		int b = springParticles[s * 2 + 1];
+		impulseX[a] += springImpulseX[s]; impulseY[a] += springImpulseY[s]; impulseZ[a] += springImpulseZ[s];
+		impulseX[b] -= springImpulseX[s]; impulseY[b] -= springImpulseY[s]; impulseZ[b] -= springImpulseZ[s];
+	}
+
+	// Same as AddImpulseKernel, scaled by inverse mass like Spring does
+	for (int i = 0; i < numParticles; ++i) {
+		float w = invMass[i];
+		if (INTEGRATOR == INTEGRATOR_VERLET) {
+			oldPositionX[i] -= impulseX[i] * w;
+			oldPositionY[i] -= impulseY[i] * w;
+			oldPositionZ[i] -= impulseZ[i] * w;
+		}
+		else {
+			velocityX[i] += impulseX[i] * w;
+			velocityY[i] += impulseY[i] * w;
+			velocityZ[i] += impulseZ[i] * w;
+		}
+	}
+}
+
+#define INSTANTIATE_SPRING_NETWORK_KERNELS(I) \
+	template void SpringNetwork::ComputeSpringImpulses<I>(int first, int last); \
+	template void SpringNetwork::ApplySpringForcesKernel<I>(float);
+
+INSTANTIATE_SPRING_NETWORK_KERNELS(INTEGRATOR_EULER)
+INSTANTIATE_SPRING_NETWORK_KERNELS(INTEGRATOR_ACCURATE_EULER)
+INSTANTIATE_SPRING_NETWORK_KERNELS(INTEGRATOR_VERLET)
+
+void SpringNetwork::Render(bool debug) {
+	if (debug) {
+		ParticleSystem::Render();
+	}
+	if (GetSpringCount() == 0) {
+		return;
+	}
+	FillRenderBuffer();
+
+	GLboolean status;
+	glGetBooleanv(GL_LIGHTING, &status);
+	glDisable(GL_LIGHTING);
+
+	glEnableClientState(GL_VERTEX_ARRAY);
+	glVertexPointer(3, GL_FLOAT, 0, GetRenderVertices());
+	glDrawElements(GL_LINES, GetSpringCount() * 2, GL_UNSIGNED_INT, &springParticles[0]);
+	glDisableClientState(GL_VERTEX_ARRAY);
+
+	if (status) {
+		glEnable(GL_LIGHTING);
+	}
+}
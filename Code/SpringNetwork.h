@@ -0,0 +1,56 @@
+#ifndef _H_SPRING_NETWORK_
+#define _H_SPRING_NETWORK_
+
+#include "ParticleSystem.h"
+
+// Batched springs between the particles of a ParticleSystem, for ropes
+// and soft bodies with tens of thousands of springs. Springs are stored
+// as arrays instead of Spring objects. Every spring impulse is computed
+// from the same state (SIMD, split over the worker threads) and then
+// summed per particle, instead of one spring at a time.
+//
+// The force is F = -kx + bv, with k negative like in Spring (SimpleSprings
+// uses k from -5 to 0). The damping sign differs from Spring's -bv because
+// v here is the signed relative velocity along the spring, positive while
+// the particles move apart, where Spring uses the relative speed. So a
+// positive b slows the stretching and compressing, and particles moving
+// side by side are not damped.
+
+class SpringNetwork : public ParticleSystem {
+protected:
+	std::vector<int> springParticles; // Two particles per spring, also the GL_LINES index buffer
+	std::vector<float> springRestLength;
+	std::vector<float> springK;
+	std::vector<float> springB;
+
+	std::vector<float> springImpulseX, springImpulseY, springImpulseZ; // One per spring
+	std::vector<float> impulseX, impulseY, impulseZ; // One per particle
+	std::vector<int> sortedIndex; // Particle index before SortTopology to particle index after
+protected:
+	template<int INTEGRATOR> void ComputeSpringImpulses(int first, int last);
+public:
+	void Clear();
+
+	// Rest length is the current distance of the particles
+	int AddSpring(int particle1, int particle2, float k, float b);
+	int AddSpring(int particle1, int particle2, float k, float b, float restLength);
+	inline int GetSpringCount() const {
+		return (int)springRestLength.size();
+	}
+	void SetSpringConstants(float k, float b);
+
+	// Renumbers particles in reverse Cuthill-McKee order and sorts the springs
+	// by particle, so springs that are processed together touch particles that
+	// are close in memory. Call once after building the network; particle
+	// indices change, GetSortedIndex maps the old ones to the new ones.
+	void SortTopology();
+	int GetSortedIndex(int index) const;
+
+	// For Physics System
+	template<int INTEGRATOR> void ApplySpringForcesKernel(float dt); // dt is unused, springs apply impulses
+
+	// Springs as lines, debug adds the particles
+	void Render(bool debug);
+};
+
+#endif
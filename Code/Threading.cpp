@@ -0,0 +1,140 @@
+#include "Threading.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+
+// Only true on the thread that currently owns the workers
+static thread_local bool insideParallelFor = false;
+// Set by SetSerialThread, the thread never takes the workers
+static thread_local bool serialThread = false;
+
+class WorkerPool {
+protected:
+	std::vector<std::thread> threads;
+	std::mutex ownerMutex; // Held by the thread running a ParallelFor
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::condition_variable done;
+
+	const std::function<void(int, int)>* job;
+	int jobCount;
+	int jobChunk;
+	std::atomic<int> nextChunk;
+	int busyWorkers;
+	unsigned int generation;
+	bool quit;
+protected:
+	void RunChunks() {
+		for (;;) {
+			int begin = nextChunk.fetch_add(1) * jobChunk;
+			if (begin >= jobCount) {
+				break;
+			}
+			int end = (begin + jobChunk < jobCount) ? begin + jobChunk : jobCount;
+			(*job)(begin, end);
+		}
+	}
+
+	void WorkerLoop() {
+		unsigned int seen = 0;
+		for (;;) {
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wake.wait(lock, [&] { return quit || generation != seen; });
+				if (quit) {
+					return;
+				}
+				seen = generation;
+			}
+
+			RunChunks();
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--busyWorkers == 0) {
+				done.notify_one();
+			}
+		}
+	}
+public:
+	WorkerPool() : job(0), jobCount(0), jobChunk(1), nextChunk(0), busyWorkers(0), generation(0), quit(false) {
+		unsigned int hardwareThreads = std::thread::hardware_concurrency();
+		for (unsigned int i = 1; i < hardwareThreads; ++i) {
+			threads.push_back(std::thread(&WorkerPool::WorkerLoop, this));
+		}
+	}
+
+	~WorkerPool() {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			quit = true;
+		}
+		wake.notify_all();
+		for (int i = 0, size = threads.size(); i < size; ++i) {
+			threads[i].join();
+		}
+	}
+
+	inline int Size() const {
+		return (int)threads.size() + 1;
+	}
+
+	void Run(int count, int minChunk, const std::function<void(int, int)>& func) {
+		if (minChunk < 1) {
+			minChunk = 1;
+		}
+		if (threads.size() == 0 || count <= minChunk || insideParallelFor || serialThread || !ownerMutex.try_lock()) {
+			func(0, count);
+			return;
+		}
+		insideParallelFor = true;
+
+		// A few chunks per thread so uneven chunks balance out
+		int numChunks = count / minChunk;
+		int maxChunks = Size() * 4;
+		numChunks = (numChunks > maxChunks) ? maxChunks : numChunks;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &func;
+			jobCount = count;
+			jobChunk = (count + numChunks - 1) / numChunks;
+			nextChunk = 0;
+			busyWorkers = (int)threads.size();
+			generation += 1;
+		}
+		wake.notify_all();
+
+		RunChunks();
+
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			done.wait(lock, [&] { return busyWorkers == 0; });
+			job = 0;
+		}
+
+		insideParallelFor = false;
+		ownerMutex.unlock();
+	}
+};
+
+static WorkerPool& GetWorkerPool() {
+	static WorkerPool pool;
+	return pool;
+}
+
+int GetWorkerCount() {
+	return GetWorkerPool().Size();
+}
+
+void ParallelFor(int count, int minChunk, const std::function<void(int, int)>& func) {
+	if (count <= 0) {
+		return;
+	}
+	GetWorkerPool().Run(count, minChunk, func);
+}
+
+void SetSerialThread(bool serial) {
+	serialThread = serial;
+}
@@ -0,0 +1,25 @@
+#ifndef _H_THREADING_
+#define _H_THREADING_
+
+#include <functional>
+
+// Worker threads shared by every parallel kernel. The workers are
+// started on first use, one less than the hardware thread count,
+// the thread calling ParallelFor does its share of the work too.
+
+// Number of threads a ParallelFor can run on, including the caller
+int GetWorkerCount();
+
+// Calls func(begin, end) over [0, count) in chunks of at least
+// minChunk items and returns once every chunk is done. Chunks run
+// in any order on any thread, func must only write to its own range.
+// Nested calls, or calls while another thread owns the workers,
+// run the whole range on the calling thread.
+void ParallelFor(int count, int minChunk, const std::function<void(int, int)>& func);
+
+// Makes every ParallelFor of the calling thread run serially on it. For
+// background threads, which would otherwise own the workers while they
+// run and leave every ParallelFor of the main thread serial.
+void SetSerialThread(bool serial);
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef _H_TREE_BUILD_
+#define _H_TREE_BUILD_
+
+#include "Geometry3D.h"
+#include <vector>
+#include <cmath>
+#include <cfloat>
+
+// Shared by the flattened tree builds, the mesh BVH (BuildLinearBVH) and
+// LinearOctree. Both store their nodes depth first, every node links forward
+// to a node after it, and both build in parallel the same way: the top of
+// the tree is built serially, every small enough subtree is left as a single
+// placeholder node and a task, and the tasks are built on the workers.
+// The bounds tests work on any node with min and max, which both trees have.
+
+// Compares instead of fminf / fmaxf, which don't compile to a single instruction
+inline void GrowBounds(vec3& min, vec3& max, const vec3& pointMin, const vec3& pointMax) {
+	min.x = (pointMin.x < min.x) ? pointMin.x : min.x;
+	min.y = (pointMin.y < min.y) ? pointMin.y : min.y;
+	min.z = (pointMin.z < min.z) ? pointMin.z : min.z;
+	max.x = (pointMax.x > max.x) ? pointMax.x : max.x;
+	max.y = (pointMax.y > max.y) ? pointMax.y : max.y;
+	max.z = (pointMax.z > max.z) ? pointMax.z : max.z;
+}
+
+// 1 / ray direction, with the same small number for 0 components as
+// Raycast(AABB). Directions are normalized, so 0 is anything up to FLT_EPSILON.
+inline vec3 GetInverseDirection(const Ray& ray) {
+	return vec3(
+		1.0f / ((fabsf(ray.direction.x) <= FLT_EPSILON) ? 0.00001f : ray.direction.x),
+		1.0f / ((fabsf(ray.direction.y) <= FLT_EPSILON) ? 0.00001f : ray.direction.y),
+		1.0f / ((fabsf(ray.direction.z) <= FLT_EPSILON) ? 0.00001f : ray.direction.z)
+	);
+}
+
+template<typename Node>
+inline bool BoundsOverlap(const Node& node, const vec3& min, const vec3& max) {
+	return node.min.x <= max.x && node.max.x >= min.x &&
+		node.min.y <= max.y && node.max.y >= min.y &&
+		node.min.z <= max.z && node.max.z >= min.z;
+}
+
+// Slab test, invDirection is from GetInverseDirection. True if the ray enters
+// the bounds between 0 and maxT (FLT_MAX for no limit), outEntry is where,
+// negative if the ray starts inside.
+inline bool RayBounds(const vec3& min, const vec3& max, const vec3& origin, const vec3& invDirection, float maxT, float* outEntry) {
+	float t1 = (min.x - origin.x) * invDirection.x;
+	float t2 = (max.x - origin.x) * invDirection.x;
+	float t3 = (min.y - origin.y) * invDirection.y;
+	float t4 = (max.y - origin.y) * invDirection.y;
+	float t5 = (min.z - origin.z) * invDirection.z;
+	float t6 = (max.z - origin.z) * invDirection.z;
+
+	float tmin = fmaxf(fmaxf(fminf(t1, t2), fminf(t3, t4)), fminf(t5, t6));
+	float tmax = fminf(fminf(fmaxf(t1, t2), fmaxf(t3, t4)), fmaxf(t5, t6));
+	*outEntry = tmin;
+	return tmax >= 0.0f && tmin <= tmax && tmin <= maxT;
+}
+
+template<typename Node>
+inline bool RayBounds(const Node& node, const vec3& origin, const vec3& invDirection, float maxT, float* outEntry) {
+	return RayBounds(node.min, node.max, origin, invDirection, maxT, outEntry);
+}
+
+// Puts the nodes of every task where its placeholder is, so the nodes are in
+// the same order as a serial build. Task has placeholder (index in nodes) and
+// nodes, tasks are sorted by placeholder. getLink(node) returns the int* of the
+// node's forward link, or 0 if it has none. outShift gets how many nodes were
+// inserted before every node of the top of the tree, numTop + 1 entries.
+template<typename Node, typename Task, typename GetLink>
+void SpliceBuildTasks(std::vector<Node>& nodes, const std::vector<Task>& tasks, const GetLink& getLink, std::vector<int>* outShift) {
+	int numTop = (int)nodes.size();
+	std::vector<int>& shift = *outShift;
+	shift.resize(numTop + 1);
+	int inserted = 0;
+	for (int i = 0, t = 0; i <= numTop; ++i) {
+		shift[i] = inserted;
+		if (t < (int)tasks.size() && tasks[t].placeholder == i) {
+			inserted += (int)tasks[t].nodes.size() - 1;
+			t += 1;
+		}
+	}
+
+	std::vector<Node> top;
+	top.swap(nodes);
+	nodes.reserve(numTop + inserted);
+	for (int i = 0, t = 0; i < numTop; ++i) {
+		if (t < (int)tasks.size() && tasks[t].placeholder == i) {
+			int base = (int)nodes.size();
+			for (int j = 0; j < (int)tasks[t].nodes.size(); ++j) {
+				Node node = tasks[t].nodes[j];
+				int* link = getLink(node);
+				if (link != 0) {
+					*link += base;
+				}
+				nodes.push_back(node);
+			}
+			t += 1;
+		}
+		else {
+			Node node = top[i];
+			int* link = getLink(node);
+			if (link != 0) {
+				*link += shift[*link];
+			}
+			nodes.push_back(node);
+		}
+	}
+}
+
+#endif